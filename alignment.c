@@ -0,0 +1,370 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "alignment.h"
+#include "koruza.h"
+#include "network.h"
+#include "configuration.h"
+#include "clock.h"
+
+#include <string.h>
+#include <syslog.h>
+#include <libubox/uloop.h>
+
+// Joint alignment step interval.
+#define ALIGNMENT_INTERVAL 100
+// Time after a move before the peer's power reading reflects it (in ms).
+#define ALIGNMENT_SETTLE_TIME 300
+// Maximum age of peer telemetry before joint alignment is aborted (in ms).
+#define ALIGNMENT_PEER_TIMEOUT 2000
+// Maximum number of moves in a single turn.
+#define ALIGNMENT_TURN_MOVES 8
+// Default initial step size (in motor steps).
+#define ALIGNMENT_DEFAULT_STEP 500
+// Default minimum step size (in motor steps).
+#define ALIGNMENT_DEFAULT_MIN_STEP 25
+
+/**
+ * Joint alignment phases within our turn.
+ */
+enum alignment_phase {
+  ALIGNMENT_PHASE_TURN_START,
+  ALIGNMENT_PHASE_BASELINE,
+  ALIGNMENT_PHASE_MOVING,
+  ALIGNMENT_PHASE_SETTLING,
+};
+
+/**
+ * Joint alignment state.
+ */
+struct alignment_joint {
+  uint8_t active;
+  uint8_t converged;
+  // Turn parity on which we steer.
+  uint8_t parity;
+  uint16_t turn;
+  enum alignment_phase phase;
+
+  // Current step size.
+  int32_t step;
+  // Best known position and the peer's power at that position.
+  int32_t best_x;
+  int32_t best_y;
+  uint16_t best_power;
+  // Position currently being moved to.
+  int32_t target_x;
+  int32_t target_y;
+  // Whether the current move returns to the best position, ending the turn.
+  uint8_t returning;
+
+  // Axis (0 is X, 1 is Y) and direction currently explored.
+  uint8_t axis;
+  int8_t direction;
+  // Whether the current sweep improved the power.
+  uint8_t improved;
+  uint8_t turn_moves;
+
+  uint32_t moves;
+  uint32_t turns;
+  // Time after which peer telemetry reflects our position (in microseconds).
+  uint64_t sample_after;
+};
+
+// Joint alignment state.
+static struct alignment_joint joint;
+// Joint alignment timer.
+static struct uloop_timeout timer_alignment;
+// Configured step sizes.
+static int32_t initial_step;
+static int32_t min_step;
+
+void alignment_timer_handler(struct uloop_timeout *timer);
+
+int alignment_init(struct uci_context *uci)
+{
+  memset(&joint, 0, sizeof(struct alignment_joint));
+  initial_step = uci_get_int(uci, "koruza.@alignment[0].step", ALIGNMENT_DEFAULT_STEP);
+  min_step = uci_get_int(uci, "koruza.@alignment[0].min_step", ALIGNMENT_DEFAULT_MIN_STEP);
+  if (initial_step <= 0 || min_step <= 0 || min_step > initial_step) {
+    syslog(LOG_WARNING, "Invalid alignment step configuration, using defaults.");
+    initial_step = ALIGNMENT_DEFAULT_STEP;
+    min_step = ALIGNMENT_DEFAULT_MIN_STEP;
+  }
+
+  timer_alignment.cb = alignment_timer_handler;
+
+  return 0;
+}
+
+static void alignment_report(uint8_t steering)
+{
+  struct koruza_alignment alignment;
+  memset(&alignment, 0, sizeof(alignment));
+  alignment.state = ALIGNMENT_STATE_JOINT | (joint.turn & ALIGNMENT_STATE_TURN_MASK);
+  if (steering) {
+    alignment.state |= ALIGNMENT_STATE_STEERING;
+  }
+  if (joint.converged) {
+    alignment.state |= ALIGNMENT_STATE_CONVERGED;
+  }
+  alignment.variables[ALIGNMENT_VARIABLE_STEP] = joint.step;
+  alignment.variables[ALIGNMENT_VARIABLE_BEST_POWER] = joint.best_power;
+  alignment.variables[ALIGNMENT_VARIABLE_MOVES] = joint.moves;
+  alignment.variables[ALIGNMENT_VARIABLE_TURNS] = joint.turns;
+
+  // Only report changes to avoid needless notifications.
+  if (memcmp(&alignment, &koruza_get_status()->alignment, sizeof(alignment)) != 0) {
+    koruza_set_alignment(&alignment);
+  }
+}
+
+int alignment_joint_start()
+{
+  const struct koruza_status *status = koruza_get_status();
+  const struct network_device *peer = network_get_status()->peer;
+  if (!peer || !status->motors.connected) {
+    return -1;
+  }
+
+  // Both units derive opposite parities from their identifiers, which is
+  // impossible when they are the same (e.g., both are unconfigured).
+  const char *id = status->serial_number ? status->serial_number : "";
+  int order = strcmp(id, peer->id);
+  if (order == 0) {
+    syslog(LOG_WARNING, "Peer '%s' has the same identifier, refusing joint alignment.", peer->id);
+    return -1;
+  }
+
+  memset(&joint, 0, sizeof(struct alignment_joint));
+  joint.active = 1;
+  joint.step = initial_step;
+  joint.phase = ALIGNMENT_PHASE_TURN_START;
+  joint.parity = order < 0 ? 0 : 1;
+
+  syslog(LOG_INFO, "Starting joint alignment with peer '%s' (steering on %s turns).",
+         peer->id, joint.parity ? "odd" : "even");
+
+  alignment_report(0);
+  uloop_timeout_set(&timer_alignment, ALIGNMENT_INTERVAL);
+  return 0;
+}
+
+void alignment_joint_stop()
+{
+  if (!joint.active) {
+    return;
+  }
+
+  joint.active = 0;
+  uloop_timeout_cancel(&timer_alignment);
+
+  // Keep the last reported variables for inspection.
+  struct koruza_alignment alignment;
+  memcpy(&alignment, &koruza_get_status()->alignment, sizeof(alignment));
+  alignment.state = 0;
+  koruza_set_alignment(&alignment);
+
+  syslog(LOG_INFO, "Joint alignment stopped after %u turns and %u moves.", joint.turns, joint.moves);
+}
+
+int alignment_joint_active()
+{
+  return joint.active;
+}
+
+static void alignment_end_turn()
+{
+  joint.turn++;
+  joint.turns++;
+  joint.phase = ALIGNMENT_PHASE_TURN_START;
+}
+
+static int alignment_move_to(int32_t x, int32_t y, uint8_t returning)
+{
+  const struct koruza_status *status = koruza_get_status();
+  if (koruza_move_motor(x, y, status->motors.z, 0, NULL) != 0) {
+    return -1;
+  }
+
+  joint.target_x = x;
+  joint.target_y = y;
+  joint.returning = returning;
+  joint.phase = ALIGNMENT_PHASE_MOVING;
+  joint.moves++;
+  joint.turn_moves++;
+  return 0;
+}
+
+static void alignment_next_direction()
+{
+  if (joint.direction > 0) {
+    joint.direction = -1;
+  } else {
+    joint.axis++;
+    joint.direction = 1;
+  }
+}
+
+static int alignment_next_candidate()
+{
+  const struct koruza_status *status = koruza_get_status();
+
+  while (joint.axis <= 1 && joint.turn_moves < ALIGNMENT_TURN_MOVES) {
+    int32_t x = joint.best_x;
+    int32_t y = joint.best_y;
+    if (joint.axis == 0) {
+      x += joint.direction * joint.step;
+    } else {
+      y += joint.direction * joint.step;
+    }
+
+    // Steps that would leave the motor range count as failed directions.
+    if (x < -status->motors.range_x || x > status->motors.range_x ||
+        y < -status->motors.range_y || y > status->motors.range_y) {
+      alignment_next_direction();
+      continue;
+    }
+
+    return alignment_move_to(x, y, 0);
+  }
+
+  // Sweep over both axes without improvement, refine the step.
+  if (joint.axis > 1 && !joint.improved) {
+    joint.step /= 2;
+    if (joint.step < min_step) {
+      joint.step = min_step;
+      joint.converged = 1;
+    }
+  }
+
+  if (joint.target_x != joint.best_x || joint.target_y != joint.best_y) {
+    return alignment_move_to(joint.best_x, joint.best_y, 1);
+  }
+
+  alignment_end_turn();
+  return 0;
+}
+
+static int alignment_evaluate(uint16_t power)
+{
+  // Require a small margin so that noise does not cause wandering.
+  if (power > joint.best_power + joint.best_power / 100) {
+    joint.best_x = joint.target_x;
+    joint.best_y = joint.target_y;
+    joint.best_power = power;
+    joint.improved = 1;
+  } else {
+    alignment_next_direction();
+  }
+
+  return alignment_next_candidate();
+}
+
+void alignment_timer_handler(struct uloop_timeout *timer)
+{
+  const struct koruza_status *status = koruza_get_status();
+  const struct network_device *peer = network_get_status()->peer;
+
+  if (!peer || network_telemetry_age(peer) > ALIGNMENT_PEER_TIMEOUT || !status->motors.connected) {
+    syslog(LOG_WARNING, "Peer telemetry or motors unavailable, aborting joint alignment.");
+    alignment_joint_stop();
+    return;
+  }
+
+  uint32_t peer_state = peer->telemetry.alignment_state;
+  uint8_t peer_joint = (peer_state & ALIGNMENT_STATE_JOINT) != 0;
+  if (peer_joint) {
+    // Follow the peer when it has ended its turn.
+    uint16_t peer_turn = peer_state & ALIGNMENT_STATE_TURN_MASK;
+    if ((int16_t) (peer_turn - joint.turn) > 0) {
+      joint.turn = peer_turn;
+      joint.phase = ALIGNMENT_PHASE_TURN_START;
+    }
+  }
+
+  // Finish once both ends have converged.
+  if (joint.converged && (!peer_joint || (peer_state & ALIGNMENT_STATE_CONVERGED))) {
+    syslog(LOG_INFO, "Joint alignment converged (peer power %u).", joint.best_power);
+    alignment_joint_stop();
+    return;
+  }
+
+  // When the peer is not participating, every turn is ours.
+  if (peer_joint && (joint.turn & 1) != joint.parity) {
+    alignment_report(0);
+    uloop_timeout_set(timer, ALIGNMENT_INTERVAL);
+    return;
+  }
+
+  uint64_t now = clock_monotonic_us();
+  int result = 0;
+  switch (joint.phase) {
+    case ALIGNMENT_PHASE_TURN_START: {
+      if (joint.converged) {
+        alignment_end_turn();
+        break;
+      }
+
+      joint.axis = 0;
+      joint.direction = 1;
+      joint.improved = 0;
+      joint.turn_moves = 0;
+      joint.best_x = joint.target_x = status->motors.x;
+      joint.best_y = joint.target_y = status->motors.y;
+      // The peer may have just moved, so wait for a fresh baseline.
+      joint.sample_after = now + ALIGNMENT_SETTLE_TIME * 1000;
+      joint.phase = ALIGNMENT_PHASE_BASELINE;
+      break;
+    }
+    case ALIGNMENT_PHASE_BASELINE: {
+      if (peer->telemetry.updated_at >= joint.sample_after) {
+        joint.best_power = peer->telemetry.rx_power;
+        result = alignment_next_candidate();
+      }
+      break;
+    }
+    case ALIGNMENT_PHASE_MOVING: {
+      if (status->motors.move_id || status->motors.move_queue) {
+        break;
+      }
+
+      if (joint.returning) {
+        alignment_end_turn();
+      } else {
+        joint.sample_after = now + ALIGNMENT_SETTLE_TIME * 1000;
+        joint.phase = ALIGNMENT_PHASE_SETTLING;
+      }
+      break;
+    }
+    case ALIGNMENT_PHASE_SETTLING: {
+      if (peer->telemetry.updated_at >= joint.sample_after) {
+        result = alignment_evaluate(peer->telemetry.rx_power);
+      }
+      break;
+    }
+  }
+
+  if (result != 0) {
+    syslog(LOG_WARNING, "Failed to move motors, aborting joint alignment.");
+    alignment_joint_stop();
+    return;
+  }
+
+  alignment_report(joint.phase != ALIGNMENT_PHASE_TURN_START);
+  uloop_timeout_set(timer, ALIGNMENT_INTERVAL);
+}
@@ -0,0 +1,67 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_ALIGNMENT_H
+#define KORUZA_DRIVER_ALIGNMENT_H
+
+#include <stdint.h>
+#include <uci.h>
+
+// Alignment state flags reported by the joint alignment mode. The lower bits
+// hold the current turn number, shared with the peer to take turns.
+#define ALIGNMENT_STATE_JOINT 0x10000
+#define ALIGNMENT_STATE_STEERING 0x20000
+#define ALIGNMENT_STATE_CONVERGED 0x40000
+#define ALIGNMENT_STATE_TURN_MASK 0xFFFF
+
+/**
+ * Alignment variables reported by the joint alignment mode.
+ */
+enum alignment_joint_variable {
+  // Current step size (in motor steps).
+  ALIGNMENT_VARIABLE_STEP,
+  // Best received power reported by the peer.
+  ALIGNMENT_VARIABLE_BEST_POWER,
+  // Number of moves performed.
+  ALIGNMENT_VARIABLE_MOVES,
+  // Number of completed turns.
+  ALIGNMENT_VARIABLE_TURNS,
+};
+
+int alignment_init(struct uci_context *uci);
+
+/**
+ * Starts joint alignment with the current network peer. Both units steer
+ * their own motors using the received power reported by the other unit,
+ * taking turns so that they never move at the same time.
+ *
+ * @return Zero on success, -1 when there is no peer or motors are not connected
+ */
+int alignment_joint_start();
+
+/**
+ * Stops joint alignment if it is in progress.
+ */
+void alignment_joint_stop();
+
+/**
+ * Returns whether joint alignment is in progress.
+ */
+int alignment_joint_active();
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "auth.h"
+
+#include <string.h>
+#include <assert.h>
+
+void auth_key_init(struct auth_key *key, const char *passphrase, size_t length)
+{
+  uint8_t secret[BLAKE2S_MAX_SIZE];
+  struct blake2s_state state;
+
+  // Hash the passphrase so that keys of any length may be configured.
+  blake2s_init(&state, BLAKE2S_MAX_SIZE, NULL, 0);
+  blake2s_update(&state, (const uint8_t*) passphrase, length);
+  blake2s_final(&state, secret);
+
+  // Keep the state after the key block, so it is only compressed once.
+  blake2s_init(&key->state, AUTH_MAC_LENGTH, secret, sizeof(secret));
+  blake2s_precompute(&key->state);
+  key->enabled = 1;
+
+  memset(secret, 0, sizeof(secret));
+}
+
+void auth_sign(const struct auth_key *key, const uint8_t *data, size_t length, uint8_t *mac)
+{
+  struct blake2s_state state;
+
+  // Precomputed state is only valid when more input follows.
+  assert(length > 0);
+
+  memcpy(&state, &key->state, sizeof(struct blake2s_state));
+  blake2s_update(&state, data, length);
+  blake2s_final(&state, mac);
+}
+
+int auth_verify(const struct auth_key *key, const uint8_t *data, size_t length, const uint8_t *mac)
+{
+  uint8_t expected[AUTH_MAC_LENGTH];
+  uint8_t difference = 0;
+
+  auth_sign(key, data, length, expected);
+  for (size_t i = 0; i < AUTH_MAC_LENGTH; i++) {
+    difference |= expected[i] ^ mac[i];
+  }
+
+  return difference ? -1 : 0;
+}
+
+int auth_replay_check(struct auth_replay_window *window, uint32_t sequence, uint32_t *skipped)
+{
+  if (skipped) {
+    *skipped = 0;
+  }
+
+  if (!window->initialized) {
+    window->initialized = 1;
+    window->top = sequence;
+    window->bitmap = 1;
+    return 0;
+  }
+
+  // Sequence numbers use serial number arithmetic to handle wraparound.
+  int32_t distance = (int32_t) (sequence - window->top);
+  if (distance > 0) {
+    if (skipped) {
+      *skipped = distance - 1;
+    }
+
+    window->bitmap = (distance < AUTH_REPLAY_WINDOW) ? (window->bitmap << distance) | 1 : 1;
+    window->top = sequence;
+    return 0;
+  }
+
+  uint32_t offset = -distance;
+  if (offset >= AUTH_REPLAY_WINDOW || (window->bitmap & ((uint64_t) 1 << offset))) {
+    return -1;
+  }
+
+  window->bitmap |= (uint64_t) 1 << offset;
+  return 0;
+}
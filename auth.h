@@ -0,0 +1,91 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_AUTH_H
+#define KORUZA_DRIVER_AUTH_H
+
+#include "blake2s.h"
+
+// Length of message authentication codes.
+#define AUTH_MAC_LENGTH 16
+// Number of sequence numbers tracked by the replay window.
+#define AUTH_REPLAY_WINDOW 64
+
+/**
+ * Pre-shared key with a precomputed keyed BLAKE2s state.
+ */
+struct auth_key {
+  uint8_t enabled;
+  struct blake2s_state state;
+};
+
+/**
+ * Sliding window of recently accepted sequence numbers.
+ */
+struct auth_replay_window {
+  uint8_t initialized;
+  // Highest accepted sequence number.
+  uint32_t top;
+  // Bit i is set when sequence number top - i has been accepted.
+  uint64_t bitmap;
+};
+
+/**
+ * Derives a MAC key from a passphrase of arbitrary length.
+ *
+ * @param key Destination key
+ * @param passphrase Passphrase
+ * @param length Passphrase length
+ */
+void auth_key_init(struct auth_key *key, const char *passphrase, size_t length);
+
+/**
+ * Computes the authentication code of a message.
+ *
+ * @param key Authentication key
+ * @param data Message to authenticate
+ * @param length Message length (must not be zero)
+ * @param mac Destination buffer of AUTH_MAC_LENGTH bytes
+ */
+void auth_sign(const struct auth_key *key, const uint8_t *data, size_t length, uint8_t *mac);
+
+/**
+ * Verifies the authentication code of a message in constant time.
+ *
+ * @param key Authentication key
+ * @param data Message to verify
+ * @param length Message length
+ * @param mac Received authentication code of AUTH_MAC_LENGTH bytes
+ * @return Zero when the code is valid, -1 otherwise
+ */
+int auth_verify(const struct auth_key *key, const uint8_t *data, size_t length, const uint8_t *mac);
+
+/**
+ * Checks a sequence number against the replay window and records it when
+ * it has not been seen before. A sender that restarts below the window is
+ * only accepted again once the window is reset (e.g., when the unit expires).
+ *
+ * @param window Replay window
+ * @param sequence Received sequence number
+ * @param skipped Optional destination for the number of sequence numbers
+ *   skipped over since the previous highest one
+ * @return Zero when the sequence number is accepted, -1 on replay
+ */
+int auth_replay_check(struct auth_replay_window *window, uint32_t sequence, uint32_t *skipped);
+
+#endif
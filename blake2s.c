@@ -0,0 +1,166 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "blake2s.h"
+
+#include <string.h>
+
+static const uint32_t blake2s_iv[8] = {
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+  0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const uint8_t blake2s_sigma[10][16] = {
+  { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+  { 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+  { 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+  { 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+  { 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+  { 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+  { 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+  { 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+  { 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+  { 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 },
+};
+
+#define BLAKE2S_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+#define BLAKE2S_G(a, b, c, d, x, y) \
+  do { \
+    a = a + b + (x); \
+    d = BLAKE2S_ROTR(d ^ a, 16); \
+    c = c + d; \
+    b = BLAKE2S_ROTR(b ^ c, 12); \
+    a = a + b + (y); \
+    d = BLAKE2S_ROTR(d ^ a, 8); \
+    c = c + d; \
+    b = BLAKE2S_ROTR(b ^ c, 7); \
+  } while (0)
+
+void blake2s_compress(struct blake2s_state *state, int last);
+
+static uint32_t blake2s_load32(const uint8_t *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+void blake2s_compress(struct blake2s_state *state, int last)
+{
+  uint32_t m[16];
+  uint32_t v[16];
+
+  for (size_t i = 0; i < 16; i++) {
+    m[i] = blake2s_load32(&state->buffer[i * 4]);
+  }
+
+  for (size_t i = 0; i < 8; i++) {
+    v[i] = state->h[i];
+    v[i + 8] = blake2s_iv[i];
+  }
+  v[12] ^= state->t[0];
+  v[13] ^= state->t[1];
+  if (last) {
+    v[14] = ~v[14];
+  }
+
+  for (size_t round = 0; round < 10; round++) {
+    const uint8_t *s = blake2s_sigma[round];
+    BLAKE2S_G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]);
+    BLAKE2S_G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]);
+    BLAKE2S_G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]);
+    BLAKE2S_G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]);
+    BLAKE2S_G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]);
+    BLAKE2S_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]);
+    BLAKE2S_G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]);
+    BLAKE2S_G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]]);
+  }
+
+  for (size_t i = 0; i < 8; i++) {
+    state->h[i] ^= v[i] ^ v[i + 8];
+  }
+}
+
+static void blake2s_increment_counter(struct blake2s_state *state, uint32_t increment)
+{
+  state->t[0] += increment;
+  if (state->t[0] < increment) {
+    state->t[1]++;
+  }
+}
+
+int blake2s_init(struct blake2s_state *state, size_t digest_length, const uint8_t *key, size_t key_length)
+{
+  if (!digest_length || digest_length > BLAKE2S_MAX_SIZE || key_length > BLAKE2S_MAX_SIZE) {
+    return -1;
+  }
+
+  memset(state, 0, sizeof(struct blake2s_state));
+  memcpy(state->h, blake2s_iv, sizeof(state->h));
+  state->h[0] ^= 0x01010000 ^ (key_length << 8) ^ digest_length;
+  state->digest_length = digest_length;
+
+  // Key is processed as a full first block.
+  if (key_length) {
+    memcpy(state->buffer, key, key_length);
+    state->buffer_length = BLAKE2S_BLOCK_SIZE;
+  }
+
+  return 0;
+}
+
+void blake2s_precompute(struct blake2s_state *state)
+{
+  if (state->buffer_length == BLAKE2S_BLOCK_SIZE) {
+    blake2s_increment_counter(state, BLAKE2S_BLOCK_SIZE);
+    blake2s_compress(state, 0);
+    state->buffer_length = 0;
+  }
+}
+
+void blake2s_update(struct blake2s_state *state, const uint8_t *data, size_t length)
+{
+  while (length > 0) {
+    // The last block must stay buffered until finalization.
+    if (state->buffer_length == BLAKE2S_BLOCK_SIZE) {
+      blake2s_increment_counter(state, BLAKE2S_BLOCK_SIZE);
+      blake2s_compress(state, 0);
+      state->buffer_length = 0;
+    }
+
+    size_t chunk = BLAKE2S_BLOCK_SIZE - state->buffer_length;
+    if (chunk > length) {
+      chunk = length;
+    }
+
+    memcpy(&state->buffer[state->buffer_length], data, chunk);
+    state->buffer_length += chunk;
+    data += chunk;
+    length -= chunk;
+  }
+}
+
+void blake2s_final(struct blake2s_state *state, uint8_t *digest)
+{
+  blake2s_increment_counter(state, state->buffer_length);
+  memset(&state->buffer[state->buffer_length], 0, BLAKE2S_BLOCK_SIZE - state->buffer_length);
+  blake2s_compress(state, 1);
+
+  for (size_t i = 0; i < state->digest_length; i++) {
+    digest[i] = (state->h[i / 4] >> (8 * (i % 4))) & 0xFF;
+  }
+}
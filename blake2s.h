@@ -0,0 +1,78 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_BLAKE2S_H
+#define KORUZA_DRIVER_BLAKE2S_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// BLAKE2s block size.
+#define BLAKE2S_BLOCK_SIZE 64
+// Maximum BLAKE2s digest and key size.
+#define BLAKE2S_MAX_SIZE 32
+
+/**
+ * BLAKE2s hashing state (RFC 7693).
+ */
+struct blake2s_state {
+  uint32_t h[8];
+  uint32_t t[2];
+  uint8_t buffer[BLAKE2S_BLOCK_SIZE];
+  size_t buffer_length;
+  size_t digest_length;
+};
+
+/**
+ * Initializes a BLAKE2s state, optionally keyed.
+ *
+ * @param state State to initialize
+ * @param digest_length Digest length (1 to 32 bytes)
+ * @param key Key (may be NULL when key_length is zero)
+ * @param key_length Key length (0 to 32 bytes)
+ * @return Zero on success, -1 on invalid lengths
+ */
+int blake2s_init(struct blake2s_state *state, size_t digest_length, const uint8_t *key, size_t key_length);
+
+/**
+ * Compresses a full buffered block ahead of time, so that copies of the
+ * state do not have to repeat the work. Must only be used when more input
+ * will follow, as the last block is compressed differently.
+ *
+ * @param state BLAKE2s state
+ */
+void blake2s_precompute(struct blake2s_state *state);
+
+/**
+ * Hashes more input.
+ *
+ * @param state BLAKE2s state
+ * @param data Input buffer
+ * @param length Size of the input buffer
+ */
+void blake2s_update(struct blake2s_state *state, const uint8_t *data, size_t length);
+
+/**
+ * Finishes hashing and outputs the digest.
+ *
+ * @param state BLAKE2s state
+ * @param digest Destination buffer of digest_length bytes
+ */
+void blake2s_final(struct blake2s_state *state, uint8_t *digest);
+
+#endif
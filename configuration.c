@@ -98,3 +98,18 @@ void uci_delete_ptr(struct uci_context *uci, const char *location)
 
   free(loc);
 }
+
+int uci_commit_package(struct uci_context *uci, const char *package)
+{
+  struct uci_ptr ptr;
+  char *loc = strdup(package);
+  int result = 0;
+
+  if (uci_lookup_ptr(uci, &ptr, loc, true) != UCI_OK ||
+      uci_commit(uci, &ptr.p, false) != UCI_OK) {
+    result = -1;
+  }
+
+  free(loc);
+  return result;
+}
@@ -77,4 +77,13 @@ void uci_set_int(struct uci_context *uci, const char *location, int value);
  */
 void uci_delete_ptr(struct uci_context *uci, const char *location);
 
+/**
+ * Commits pending changes of an UCI configuration package.
+ *
+ * @param uci UCI context
+ * @param package Name of the package to commit
+ * @return 0 on success, -1 on failure
+ */
+int uci_commit_package(struct uci_context *uci, const char *package);
+
 #endif
@@ -0,0 +1,445 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "firmware.h"
+#include "serial.h"
+#include "configuration.h"
+#include "crc32.h"
+#include "memory.h"
+#include "clock.h"
+
+#include <libubox/uloop.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+
+// Default size of image blocks (in bytes).
+#define FIRMWARE_BLOCK_SIZE 512
+// Default number of unacknowledged blocks in flight (fully escaped default
+// blocks in flight fit into half of the 16 KiB serial transmit budget).
+#define FIRMWARE_WINDOW 7
+// Worst case (fully escaped) framed size of a block message.
+#define FIRMWARE_FRAME_SIZE(block) (2 * ((block) + 22) + 2)
+// Time for the MCU to start its bootloader (in milliseconds).
+#define FIRMWARE_BOOTLOADER_DELAY 500
+// Maximum accepted image size (in bytes).
+#define FIRMWARE_MAX_SIZE (1024 * 1024)
+// Time to wait for the bootloader to erase flash (in milliseconds).
+#define FIRMWARE_START_TIMEOUT 5000
+// Time to wait for block acks before sending blocks again (in milliseconds).
+#define FIRMWARE_ACK_TIMEOUT 500
+// Time to wait for the bootloader to verify the image (in milliseconds).
+#define FIRMWARE_VERIFY_TIMEOUT 2000
+// Number of consecutive timeouts before flashing fails.
+#define FIRMWARE_MAX_RETRIES 5
+
+// Configured block size and window.
+static uint32_t block_size;
+static uint32_t window;
+// Memory-mapped firmware image.
+static const uint8_t *image;
+static size_t image_size;
+static uint32_t image_crc;
+// Offset of the next block to send.
+static uint32_t next_offset;
+// Offset up to which blocks are being sent again after a loss.
+static uint32_t recover_offset;
+// Number of consecutive timeouts.
+static uint8_t retries;
+// Time when flashing started (in microseconds).
+static uint64_t started_at;
+// Progress reported with the last update (in percent).
+static uint8_t reported_percent;
+// Flashing progress.
+static struct firmware_progress progress;
+// Handler for progress updates.
+static firmware_progress_handler progress_handler;
+// Timer for ack timeouts.
+static struct uloop_timeout timer_ack;
+
+void firmware_set_state(enum firmware_state state);
+void firmware_report_progress();
+void firmware_finish(enum firmware_state state);
+int firmware_send_start();
+int firmware_send_block(uint32_t offset);
+int firmware_send_finish();
+void firmware_fill_window();
+void firmware_timer_ack_handler(struct uloop_timeout *timer);
+
+int firmware_init(struct uci_context *uci)
+{
+  block_size = uci_get_int(uci, "koruza.@firmware[0].block_size", FIRMWARE_BLOCK_SIZE);
+  if (block_size < 16 || block_size > TLV_FIRMWARE_BLOCK_MAX) {
+    syslog(LOG_ERR, "Invalid firmware block size specified, defaulting to %d.", FIRMWARE_BLOCK_SIZE);
+    block_size = FIRMWARE_BLOCK_SIZE;
+  }
+
+  window = uci_get_int(uci, "koruza.@firmware[0].window", FIRMWARE_WINDOW);
+  if (window < 1) {
+    window = 1;
+  }
+
+  // Blocks in flight must fit into half of the transmit queue budget, or a
+  // full queue would turn into repeated ack timeouts.
+  size_t limit = memory_get_usage(MEMORY_SERIAL_TX_MOTORS)->limit;
+  if (limit && window * FIRMWARE_FRAME_SIZE(block_size) > limit / 2) {
+    window = (limit / 2) / FIRMWARE_FRAME_SIZE(block_size);
+    if (window < 1) {
+      window = 1;
+    }
+    syslog(LOG_WARNING, "Firmware window exceeds serial transmit budget, limiting to %u blocks.", window);
+  }
+
+  timer_ack.cb = firmware_timer_ack_handler;
+  return 0;
+}
+
+void firmware_set_progress_handler(firmware_progress_handler handler)
+{
+  progress_handler = handler;
+}
+
+const struct firmware_progress *firmware_get_progress()
+{
+  if (firmware_active()) {
+    progress.elapsed = (clock_monotonic_us() - started_at) / 1000;
+  }
+
+  return &progress;
+}
+
+const char *firmware_state_name(enum firmware_state state)
+{
+  switch (state) {
+    case FIRMWARE_IDLE: return "idle";
+    case FIRMWARE_ENTERING: return "entering";
+    case FIRMWARE_STARTING: return "starting";
+    case FIRMWARE_STREAMING: return "streaming";
+    case FIRMWARE_VERIFYING: return "verifying";
+    case FIRMWARE_DONE: return "done";
+    case FIRMWARE_FAILED: return "failed";
+    default: return "unknown";
+  }
+}
+
+int firmware_active()
+{
+  return progress.state == FIRMWARE_ENTERING ||
+         progress.state == FIRMWARE_STARTING ||
+         progress.state == FIRMWARE_STREAMING ||
+         progress.state == FIRMWARE_VERIFYING;
+}
+
+int firmware_flash(const char *path)
+{
+  if (firmware_active()) {
+    return -1;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Failed to open firmware image '%s'.", path);
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > FIRMWARE_MAX_SIZE) {
+    syslog(LOG_ERR, "Invalid firmware image '%s'.", path);
+    close(fd);
+    return -1;
+  }
+
+  // Blocks are sent straight from the page cache.
+  void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    syslog(LOG_ERR, "Failed to map firmware image '%s'.", path);
+    return -1;
+  }
+
+  madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+
+  image = (const uint8_t*) mapping;
+  image_size = st.st_size;
+  image_crc = crc32(0, image, image_size);
+  next_offset = 0;
+  recover_offset = 0;
+  retries = 0;
+  started_at = clock_monotonic_us();
+  reported_percent = 0;
+
+  memset(&progress, 0, sizeof(progress));
+  progress.size = image_size;
+
+  syslog(LOG_INFO, "Flashing MCU firmware '%s' (%u bytes, CRC %08X).", path, progress.size, image_crc);
+  firmware_set_state(FIRMWARE_ENTERING);
+
+  // Jump into the bootloader, which always runs at base rate.
+  message_t msg;
+  message_init(&msg);
+  message_tlv_add_command(&msg, COMMAND_FIRMWARE_UPGRADE);
+  message_tlv_add_checksum(&msg);
+  serial_send_message(DEVICE_MOTORS, &msg, SERIAL_PRIORITY_HIGH);
+  message_free(&msg);
+
+  serial_set_link_negotiation(DEVICE_MOTORS, 0);
+  serial_restart(DEVICE_MOTORS);
+  uloop_timeout_set(&timer_ack, FIRMWARE_BOOTLOADER_DELAY);
+
+  return 0;
+}
+
+void firmware_abort()
+{
+  if (!firmware_active()) {
+    return;
+  }
+
+  syslog(LOG_WARNING, "Aborting MCU firmware flashing.");
+  firmware_finish(FIRMWARE_FAILED);
+}
+
+void firmware_set_state(enum firmware_state state)
+{
+  progress.state = state;
+  if (progress_handler) {
+    progress_handler(firmware_get_progress());
+  }
+}
+
+void firmware_report_progress()
+{
+  // Limit updates to one per percent of progress.
+  uint8_t percent = (uint64_t) progress.offset * 100 / progress.size;
+  if (percent == reported_percent) {
+    return;
+  }
+
+  reported_percent = percent;
+  if (progress_handler) {
+    progress_handler(firmware_get_progress());
+  }
+}
+
+void firmware_finish(enum firmware_state state)
+{
+  uloop_timeout_cancel(&timer_ack);
+  progress.elapsed = (clock_monotonic_us() - started_at) / 1000;
+
+  munmap((void*) image, image_size);
+  image = NULL;
+  image_size = 0;
+
+  serial_set_link_negotiation(DEVICE_MOTORS, 1);
+  if (state == FIRMWARE_DONE) {
+    syslog(LOG_INFO, "MCU firmware flashed in %u ms (%u blocks sent again).", progress.elapsed, progress.retransmits);
+
+    // Boot the new firmware, which starts at base link rate.
+    if (serial_reset(DEVICE_MOTORS) != 0) {
+      syslog(LOG_WARNING, "Failed to reset MCU after flashing, reset it manually.");
+      serial_restart(DEVICE_MOTORS);
+    }
+  } else {
+    // Renegotiate with whatever is running now.
+    serial_restart(DEVICE_MOTORS);
+  }
+
+  firmware_set_state(state);
+}
+
+int firmware_send_start()
+{
+  tlv_firmware_info_t info;
+  info.size = image_size;
+  info.crc = image_crc;
+  info.block_size = block_size;
+
+  message_t msg;
+  message_init(&msg);
+  message_tlv_add_command(&msg, COMMAND_FIRMWARE_START);
+  message_tlv_add_firmware_info(&msg, &info);
+  message_tlv_add_checksum(&msg);
+  int result = serial_send_message(DEVICE_MOTORS, &msg, SERIAL_PRIORITY_HIGH);
+  message_free(&msg);
+
+  return result;
+}
+
+int firmware_send_block(uint32_t offset)
+{
+  uint32_t length = image_size - offset;
+  if (length > block_size) {
+    length = block_size;
+  }
+
+  message_t msg;
+  message_init(&msg);
+  message_tlv_add_command(&msg, COMMAND_FIRMWARE_BLOCK);
+  message_tlv_add_firmware_block(&msg, offset, &image[offset], length);
+  message_tlv_add_checksum(&msg);
+  int result = serial_send_message(DEVICE_MOTORS, &msg, SERIAL_PRIORITY_HIGH);
+  message_free(&msg);
+
+  return result;
+}
+
+int firmware_send_finish()
+{
+  message_t msg;
+  message_init(&msg);
+  message_tlv_add_command(&msg, COMMAND_FIRMWARE_FINISH);
+  message_tlv_add_checksum(&msg);
+  int result = serial_send_message(DEVICE_MOTORS, &msg, SERIAL_PRIORITY_HIGH);
+  message_free(&msg);
+
+  return result;
+}
+
+void firmware_fill_window()
+{
+  while (next_offset < image_size && next_offset - progress.offset < window * block_size) {
+    // When the transmit queue is full, the ack timer sends remaining blocks.
+    if (firmware_send_block(next_offset) != 0) {
+      break;
+    }
+
+    next_offset += block_size;
+    if (next_offset > image_size) {
+      next_offset = image_size;
+    }
+  }
+}
+
+void firmware_ack_received(const message_t *message)
+{
+  tlv_firmware_ack_t ack;
+  if (message_tlv_get_firmware_ack(message, &ack) != MESSAGE_SUCCESS) {
+    return;
+  }
+
+  switch (progress.state) {
+    case FIRMWARE_STARTING: {
+      if (ack.offset != 0) {
+        break;
+      }
+
+      // Flash has been erased, start streaming.
+      retries = 0;
+      firmware_set_state(FIRMWARE_STREAMING);
+      firmware_fill_window();
+      uloop_timeout_set(&timer_ack, FIRMWARE_ACK_TIMEOUT);
+      break;
+    }
+
+    case FIRMWARE_STREAMING: {
+      if (ack.offset > next_offset) {
+        // Ack for something that was never sent.
+        break;
+      }
+
+      if (ack.offset > progress.offset) {
+        progress.offset = ack.offset;
+        retries = 0;
+        uloop_timeout_set(&timer_ack, FIRMWARE_ACK_TIMEOUT);
+
+        if (progress.offset == image_size) {
+          firmware_send_finish();
+          uloop_timeout_set(&timer_ack, FIRMWARE_VERIFY_TIMEOUT);
+          firmware_set_state(FIRMWARE_VERIFYING);
+          break;
+        }
+
+        firmware_report_progress();
+      } else if (ack.offset == progress.offset && next_offset > progress.offset &&
+                 progress.offset >= recover_offset) {
+        // Repeated ack means the bootloader dropped the block at the acked
+        // offset (bad CRC), so it discarded everything after it as well.
+        progress.retransmits += (next_offset - progress.offset + block_size - 1) / block_size;
+        recover_offset = next_offset;
+        next_offset = progress.offset;
+      }
+
+      firmware_fill_window();
+      break;
+    }
+
+    case FIRMWARE_VERIFYING: {
+      if (ack.offset != image_size) {
+        syslog(LOG_ERR, "MCU bootloader failed to verify firmware image.");
+        firmware_finish(FIRMWARE_FAILED);
+        break;
+      }
+
+      firmware_finish(FIRMWARE_DONE);
+      break;
+    }
+
+    default: {
+      // Ignore stale acks.
+    }
+  }
+}
+
+void firmware_timer_ack_handler(struct uloop_timeout *timer)
+{
+  if (progress.state == FIRMWARE_ENTERING) {
+    // Bootloader should be up, its ack to the start command is the probe.
+    firmware_set_state(FIRMWARE_STARTING);
+    firmware_send_start();
+    uloop_timeout_set(timer, FIRMWARE_START_TIMEOUT);
+    return;
+  }
+
+  if (++retries > FIRMWARE_MAX_RETRIES) {
+    syslog(LOG_ERR, "MCU bootloader is not responding, firmware flashing failed.");
+    firmware_finish(FIRMWARE_FAILED);
+    return;
+  }
+
+  switch (progress.state) {
+    case FIRMWARE_STARTING: {
+      firmware_send_start();
+      uloop_timeout_set(timer, FIRMWARE_START_TIMEOUT);
+      break;
+    }
+
+    case FIRMWARE_STREAMING: {
+      // Go back to the last acked offset and send everything again.
+      progress.retransmits += (next_offset - progress.offset + block_size - 1) / block_size;
+      recover_offset = next_offset;
+      next_offset = progress.offset;
+      firmware_fill_window();
+      uloop_timeout_set(timer, FIRMWARE_ACK_TIMEOUT);
+      break;
+    }
+
+    case FIRMWARE_VERIFYING: {
+      firmware_send_finish();
+      uloop_timeout_set(timer, FIRMWARE_VERIFY_TIMEOUT);
+      break;
+    }
+
+    default: {
+      // Stale timer.
+    }
+  }
+}
@@ -0,0 +1,134 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_FIRMWARE_H
+#define KORUZA_DRIVER_FIRMWARE_H
+
+#include <stdint.h>
+#include <uci.h>
+
+#include "message.h"
+
+/*
+ * MCU bootloader protocol (must match the MCU firmware).
+ *
+ * All messages use the regular TLV framing with a checksum TLV at 115200
+ * baud, higher link rates are never negotiated while flashing.
+ *
+ * 1. COMMAND_FIRMWARE_UPGRADE makes the application jump into the
+ *    bootloader, which comes up at base rate.
+ * 2. COMMAND_FIRMWARE_START (9) with TLV_FIRMWARE_INFO (13) announces the
+ *    image size, its CRC32 and the block size. The bootloader erases flash
+ *    and answers with REPLY_FIRMWARE_ACK (4) carrying TLV_FIRMWARE_ACK (15)
+ *    with offset zero.
+ * 3. COMMAND_FIRMWARE_BLOCK (10) with TLV_FIRMWARE_BLOCK (14) carries the
+ *    block offset, CRC32 of the block data and the data. The bootloader
+ *    writes blocks in order, verifies each one by reading it back and acks
+ *    every block with the number of contiguous bytes written so far. Blocks
+ *    that are out of order or fail their CRC are dropped and the previous
+ *    offset is acked again.
+ * 4. COMMAND_FIRMWARE_FINISH (11) asks the bootloader to verify the CRC32 of
+ *    the whole image. It acks with the image size on success and any other
+ *    offset on failure.
+ */
+
+/**
+ * MCU firmware flashing states.
+ */
+enum firmware_state {
+  FIRMWARE_IDLE = 0,
+  // Waiting for the MCU to jump into its bootloader.
+  FIRMWARE_ENTERING,
+  // Waiting for the bootloader to accept the image and erase flash.
+  FIRMWARE_STARTING,
+  // Streaming image blocks.
+  FIRMWARE_STREAMING,
+  // Waiting for the bootloader to verify the whole image.
+  FIRMWARE_VERIFYING,
+  FIRMWARE_DONE,
+  FIRMWARE_FAILED,
+};
+
+/**
+ * Firmware flashing progress.
+ */
+struct firmware_progress {
+  enum firmware_state state;
+  // Number of bytes acknowledged by the bootloader.
+  uint32_t offset;
+  // Image size (in bytes).
+  uint32_t size;
+  // Number of blocks that had to be sent again.
+  uint32_t retransmits;
+  // Time since flashing started (in milliseconds).
+  uint32_t elapsed;
+};
+
+/**
+ * Handler for firmware flashing progress updates.
+ */
+typedef void (*firmware_progress_handler)(const struct firmware_progress *progress);
+
+int firmware_init(struct uci_context *uci);
+
+/**
+ * Starts streaming a firmware image to the MCU bootloader over the motors
+ * serial link. Blocks are pipelined up to the configured window and the
+ * bootloader acknowledges the number of contiguous bytes it has written and
+ * verified, so missing or corrupted blocks are sent again from that offset.
+ *
+ * @param path Path to the firmware image
+ * @return Zero on success, -1 when the image is invalid or flashing is in progress
+ */
+int firmware_flash(const char *path);
+
+/**
+ * Aborts firmware flashing if it is in progress.
+ */
+void firmware_abort();
+
+/**
+ * Returns true while firmware flashing is in progress.
+ */
+int firmware_active();
+
+/**
+ * Handles a firmware ack reply from the MCU.
+ *
+ * @param message Reply message
+ */
+void firmware_ack_received(const message_t *message);
+
+/**
+ * Returns current firmware flashing progress.
+ */
+const struct firmware_progress *firmware_get_progress();
+
+/**
+ * Sets the handler invoked on flashing state changes and progress.
+ *
+ * @param handler Progress handler
+ */
+void firmware_set_progress_handler(firmware_progress_handler handler);
+
+/**
+ * Returns the name of a firmware flashing state.
+ */
+const char *firmware_state_name(enum firmware_state state);
+
+#endif
@@ -17,30 +17,76 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "frame.h"
+#include "metrics.h"
+#include "memory.h"
 
 #include <stdlib.h>
 
 void frame_parser_add_to_frame(parser_t *parser, uint8_t byte);
+int frame_parser_resize(parser_t *parser, size_t size);
+void frame_parser_frame_done(parser_t *parser);
 
 void frame_parser_init(parser_t *parser)
 {
   parser->handler = NULL;
   parser->state = SERIAL_STATE_WAIT_START;
   parser->length = 0;
-  parser->buffer_size = 1024;
-  parser->buffer = (uint8_t*) malloc(parser->buffer_size);
-  if (!parser->buffer) {
+  parser->errors = 0;
+  parser->small_frames = 0;
+  parser->buffer_size = 0;
+  parser->buffer = NULL;
+  if (frame_parser_resize(parser, FRAME_PARSER_INITIAL_SIZE) != 0) {
     // Out of memory abort.
     abort();
   }
 }
 
+int frame_parser_resize(parser_t *parser, size_t size)
+{
+  if (size > parser->buffer_size && memory_reserve(MEMORY_PARSER, size - parser->buffer_size) != 0) {
+    return -1;
+  }
+
+  uint8_t *buffer = (uint8_t*) realloc(parser->buffer, size);
+  if (!buffer) {
+    if (size > parser->buffer_size) {
+      memory_release(MEMORY_PARSER, size - parser->buffer_size);
+    }
+    return -1;
+  }
+
+  if (size < parser->buffer_size) {
+    memory_release(MEMORY_PARSER, parser->buffer_size - size);
+  }
+
+  parser->buffer = buffer;
+  parser->buffer_size = size;
+  return 0;
+}
+
+void frame_parser_frame_done(parser_t *parser)
+{
+  // Shrink the buffer once large frames have not been seen for a while.
+  if (parser->buffer_size > FRAME_PARSER_INITIAL_SIZE && parser->length <= parser->buffer_size / 4) {
+    if (++parser->small_frames >= FRAME_PARSER_SHRINK_FRAMES) {
+      frame_parser_resize(parser, parser->buffer_size / 2);
+      parser->small_frames = 0;
+    }
+  } else {
+    parser->small_frames = 0;
+  }
+
+  parser->length = 0;
+}
+
 void frame_parser_free(parser_t *parser)
 {
   parser->state = SERIAL_STATE_WAIT_START;
   parser->length = 0;
+  memory_release(MEMORY_PARSER, parser->buffer_size);
   parser->buffer_size = 0;
   free(parser->buffer);
+  parser->buffer = NULL;
 }
 
 void frame_parser_push_buffer(parser_t *parser, uint8_t *buffer, size_t length)
@@ -53,19 +99,24 @@ void frame_parser_push_buffer(parser_t *parser, uint8_t *buffer, size_t length)
 void frame_parser_add_to_frame(parser_t *parser, uint8_t byte)
 {
   // If there is already too many bytes in the buffer, discard them and resync.
-  if (parser->length > FRAME_MAX_LENGTH) {
+  if (parser->length >= FRAME_MAX_LENGTH) {
     parser->state = SERIAL_STATE_WAIT_START;
     parser->length = 0;
     return;
   }
 
-  // Increase buffer when needed.
+  // Grow buffer geometrically when needed, dropping the frame when over budget.
   if (parser->length == parser->buffer_size) {
-    parser->buffer_size += 1024;
-    parser->buffer = (uint8_t*) realloc(parser->buffer, parser->buffer_size);
-    if (!parser->buffer) {
-      // Out of memory abort.
-      abort();
+    size_t size = parser->buffer_size * 2;
+    if (size > FRAME_MAX_LENGTH) {
+      size = FRAME_MAX_LENGTH;
+    }
+
+    if (frame_parser_resize(parser, size) != 0) {
+      parser->state = SERIAL_STATE_WAIT_START;
+      parser->length = 0;
+      parser->errors++;
+      return;
     }
   }
 
@@ -101,13 +152,20 @@ void frame_parser_push_byte(parser_t *parser, uint8_t byte)
         if (parser->handler != NULL) {
           message_t message;
           message_init(&message);
-          if (message_parse(&message, parser->buffer, parser->length) == MESSAGE_SUCCESS) {
+          METRICS_TIMER_START(parse);
+          message_result_t result = message_parse(&message, parser->buffer, parser->length);
+          METRICS_TIMER_STOP(parse, METRICS_MESSAGE_PARSE);
+          if (result == MESSAGE_SUCCESS) {
+            METRICS_COUNT(METRICS_MESSAGES_PARSED, 1);
             parser->handler(&message);
+          } else {
+            METRICS_COUNT(METRICS_MESSAGE_PARSE_ERRORS, 1);
+            parser->errors++;
           }
           message_free(&message);
         }
 
-        parser->length = 0;
+        frame_parser_frame_done(parser);
         parser->state = SERIAL_STATE_WAIT_START;
       } else {
         // Frame content.
@@ -148,7 +206,8 @@ ssize_t frame_message(uint8_t *frame, size_t length, const message_t *message)
   size_t index = 0;
   frame[index++] = FRAME_MARKER_START;
   for (size_t i = 0; i < buffer_size; i++) {
-    if (index >= length) {
+    // Leave room for an escaped byte and the end marker.
+    if (index + 3 > length) {
       free(buffer);
       return -1;
     }
@@ -42,6 +42,11 @@ typedef enum {
 #define FRAME_MARKER_END 0xF2
 #define FRAME_MARKER_ESCAPE 0xF3
 
+// Initial size of the parser buffer (grows geometrically up to the maximum frame length).
+#define FRAME_PARSER_INITIAL_SIZE 256
+// Number of consecutive small frames after which the parser buffer is shrunk.
+#define FRAME_PARSER_SHRINK_FRAMES 32
+
 /**
  * Frame parser.
  */
@@ -54,6 +59,12 @@ typedef struct {
   uint8_t *buffer;
   size_t buffer_size;
   size_t length;
+
+  /// Number of received frames that failed to parse.
+  uint32_t errors;
+
+  // Number of consecutive frames using at most a quarter of the buffer.
+  size_t small_frames;
 } parser_t;
 
 /**
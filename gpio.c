@@ -18,11 +18,17 @@
  */
 #include "gpio.h"
 
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <linux/gpio.h>
+#include <libubox/utils.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
 #include <unistd.h>
 
 #define GPIO_SYSFS_EXPORT "/sys/class/gpio/export"
@@ -32,6 +38,9 @@
 
 int gpio_configure(const char *interface, int pin);
 int gpio_raw_write_pin(const char *interface, int pin, const char *value, size_t length);
+int gpio_chip_open(const char *chip);
+int gpio_line_request_sysfs(struct gpio_line *line, int pin, int direction, int value);
+void gpio_event_fd_handler(struct uloop_fd *ufd, unsigned int events);
 
 int gpio_configure(const char *interface, int pin)
 {
@@ -115,3 +124,196 @@ int gpio_write(int pin, int value)
 {
   return gpio_raw_write_pin(GPIO_SYSFS_VALUE, pin, value == GPIO_LOW ? "0" : "1", 1);
 }
+
+int gpio_chip_open(const char *chip)
+{
+  return open(chip, O_RDONLY | O_CLOEXEC);
+}
+
+int gpio_line_request_sysfs(struct gpio_line *line, int pin, int direction, int value)
+{
+  // Exporting an already exported pin fails, so only check the direction.
+  gpio_export(pin);
+  if (gpio_direction(pin, direction) != 0) {
+    gpio_unexport(pin);
+    return -1;
+  }
+
+  if (direction == GPIO_OUT && gpio_write(pin, value) != 0) {
+    gpio_unexport(pin);
+    return -1;
+  }
+
+  char path[128];
+  snprintf(path, sizeof(path), GPIO_SYSFS_VALUE, pin);
+  line->fd = open(path, (direction == GPIO_IN ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+  if (line->fd < 0) {
+    gpio_unexport(pin);
+    return -1;
+  }
+
+  line->pin = pin;
+  return 0;
+}
+
+int gpio_line_request(struct gpio_line *line, const char *chip, int offset,
+  int direction, int value, const char *consumer)
+{
+  line->fd = -1;
+  line->pin = -1;
+
+  int chip_fd = gpio_chip_open(chip);
+  if (chip_fd < 0) {
+    // Fall back to the sysfs interface on kernels without GPIO character devices.
+    return gpio_line_request_sysfs(line, offset, direction, value);
+  }
+
+  struct gpiohandle_request request;
+  memset(&request, 0, sizeof(request));
+  request.lineoffsets[0] = offset;
+  request.lines = 1;
+  request.flags = (direction == GPIO_IN) ? GPIOHANDLE_REQUEST_INPUT : GPIOHANDLE_REQUEST_OUTPUT;
+  request.default_values[0] = (value == GPIO_LOW) ? 0 : 1;
+  strncpy(request.consumer_label, consumer, sizeof(request.consumer_label) - 1);
+
+  int result = ioctl(chip_fd, GPIO_GET_LINEHANDLE_IOCTL, &request);
+  close(chip_fd);
+  if (result < 0) {
+    // The line may be claimed by a driver or the chip may not support line
+    // handles, so try the sysfs interface as well.
+    syslog(LOG_WARNING, "Failed to request line %d on GPIO chip '%s': %s", offset, chip, strerror(errno));
+    return gpio_line_request_sysfs(line, offset, direction, value);
+  }
+
+  line->fd = request.fd;
+  return 0;
+}
+
+int gpio_line_read(struct gpio_line *line)
+{
+  if (line->fd < 0) {
+    return -1;
+  }
+
+  if (line->pin >= 0) {
+    char buffer[3];
+    if (pread(line->fd, buffer, sizeof(buffer), 0) < 1) {
+      return -1;
+    }
+
+    return buffer[0] == '0' ? GPIO_LOW : GPIO_HIGH;
+  }
+
+  struct gpiohandle_data data;
+  memset(&data, 0, sizeof(data));
+  if (ioctl(line->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) < 0) {
+    return -1;
+  }
+
+  return data.values[0] ? GPIO_HIGH : GPIO_LOW;
+}
+
+int gpio_line_write(struct gpio_line *line, int value)
+{
+  if (line->fd < 0) {
+    return -1;
+  }
+
+  if (line->pin >= 0) {
+    return pwrite(line->fd, value == GPIO_LOW ? "0" : "1", 1, 0) == 1 ? 0 : -1;
+  }
+
+  struct gpiohandle_data data;
+  memset(&data, 0, sizeof(data));
+  data.values[0] = (value == GPIO_LOW) ? 0 : 1;
+  return ioctl(line->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data) < 0 ? -1 : 0;
+}
+
+void gpio_line_release(struct gpio_line *line)
+{
+  if (line->fd >= 0) {
+    close(line->fd);
+  }
+
+  if (line->pin >= 0) {
+    gpio_unexport(line->pin);
+  }
+
+  line->fd = -1;
+  line->pin = -1;
+}
+
+int gpio_event_request(struct gpio_event *event, const char *chip, int offset,
+  int edges, gpio_event_handler handler, const char *consumer)
+{
+  memset(event, 0, sizeof(*event));
+  event->ufd.fd = -1;
+
+  int chip_fd = gpio_chip_open(chip);
+  if (chip_fd < 0) {
+    return -1;
+  }
+
+  struct gpioevent_request request;
+  memset(&request, 0, sizeof(request));
+  request.lineoffset = offset;
+  request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+  if (edges & GPIO_EDGE_RISING) {
+    request.eventflags |= GPIOEVENT_REQUEST_RISING_EDGE;
+  }
+  if (edges & GPIO_EDGE_FALLING) {
+    request.eventflags |= GPIOEVENT_REQUEST_FALLING_EDGE;
+  }
+  strncpy(request.consumer_label, consumer, sizeof(request.consumer_label) - 1);
+
+  int result = ioctl(chip_fd, GPIO_GET_LINEEVENT_IOCTL, &request);
+  close(chip_fd);
+  if (result < 0) {
+    syslog(LOG_WARNING, "Failed to request events for line %d on GPIO chip '%s': %s", offset, chip, strerror(errno));
+    return -1;
+  }
+
+  // Event reads must never block the event loop.
+  fcntl(request.fd, F_SETFL, fcntl(request.fd, F_GETFL) | O_NONBLOCK);
+
+  event->handler = handler;
+  event->ufd.fd = request.fd;
+  event->ufd.cb = gpio_event_fd_handler;
+  uloop_fd_add(&event->ufd, ULOOP_READ);
+  return 0;
+}
+
+void gpio_event_fd_handler(struct uloop_fd *ufd, unsigned int events)
+{
+  struct gpio_event *event = container_of(ufd, struct gpio_event, ufd);
+  struct gpioevent_data data[16];
+
+  for (;;) {
+    ssize_t length = read(ufd->fd, data, sizeof(data));
+    if (length < (ssize_t) sizeof(data[0])) {
+      break;
+    }
+
+    for (size_t i = 0; i < length / sizeof(data[0]); i++) {
+      if (event->handler) {
+        event->handler(
+          event,
+          data[i].id == GPIOEVENT_EVENT_RISING_EDGE ? GPIO_HIGH : GPIO_LOW,
+          data[i].timestamp
+        );
+      }
+    }
+  }
+}
+
+void gpio_event_release(struct gpio_event *event)
+{
+  if (event->ufd.fd < 0) {
+    return;
+  }
+
+  uloop_fd_delete(&event->ufd);
+  close(event->ufd.fd);
+  event->ufd.fd = -1;
+  event->handler = NULL;
+}
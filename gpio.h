@@ -19,6 +19,9 @@
 #ifndef KORUZA_DRIVER_GPIO_H
 #define KORUZA_DRIVER_GPIO_H
 
+#include <stdint.h>
+#include <libubox/uloop.h>
+
 // Directions.
 #define GPIO_IN 0
 #define GPIO_OUT 1
@@ -27,6 +30,41 @@
 #define GPIO_LOW 0
 #define GPIO_HIGH 1
 
+// Edges.
+#define GPIO_EDGE_RISING 0x01
+#define GPIO_EDGE_FALLING 0x02
+#define GPIO_EDGE_BOTH (GPIO_EDGE_RISING | GPIO_EDGE_FALLING)
+
+/**
+ * Requested GPIO line. The handle stays open until the line is released,
+ * so reads and writes do not need to reopen anything.
+ */
+struct gpio_line {
+  // Line handle or sysfs value file descriptor.
+  int fd;
+  // Sysfs pin number when the character device is not available, -1 otherwise.
+  int pin;
+};
+
+struct gpio_event;
+
+/**
+ * Handler for GPIO line edge events.
+ *
+ * @param event Event source
+ * @param value Line state after the edge (either GPIO_LOW or GPIO_HIGH)
+ * @param timestamp Kernel event timestamp (in nanoseconds)
+ */
+typedef void (*gpio_event_handler)(struct gpio_event *event, int value, uint64_t timestamp);
+
+/**
+ * GPIO line edge event source, registered with uloop.
+ */
+struct gpio_event {
+  struct uloop_fd ufd;
+  gpio_event_handler handler;
+};
+
 /**
  * Export GPIO pin via sysfs interface.
  *
@@ -69,4 +107,65 @@ int gpio_read(int pin);
  */
 int gpio_write(int pin, int value);
 
+/**
+ * Requests a GPIO line from a character device (for example /dev/gpiochip0).
+ * When the character device is not available, the pin is exported via sysfs
+ * instead and its value file is kept open.
+ *
+ * @param line Line to initialize
+ * @param chip Path to the GPIO character device
+ * @param offset Line offset on the chip (or pin number for sysfs)
+ * @param direction Direction (either GPIO_IN or GPIO_OUT)
+ * @param value Initial state for outputs (either GPIO_LOW or GPIO_HIGH)
+ * @param consumer Consumer label shown by the kernel
+ * @return Zero on success, -1 on failure
+ */
+int gpio_line_request(struct gpio_line *line, const char *chip, int offset,
+  int direction, int value, const char *consumer);
+
+/**
+ * Reads state from a requested GPIO line.
+ *
+ * @param line Line to read from
+ * @return Value or -1 on failure
+ */
+int gpio_line_read(struct gpio_line *line);
+
+/**
+ * Sets state of a requested GPIO line.
+ *
+ * @param line Line to write to
+ * @param value State to set (either GPIO_LOW or GPIO_HIGH)
+ * @return Zero on success, -1 on failure
+ */
+int gpio_line_write(struct gpio_line *line, int value);
+
+/**
+ * Releases a requested GPIO line.
+ *
+ * @param line Line to release
+ */
+void gpio_line_release(struct gpio_line *line);
+
+/**
+ * Requests edge events for a GPIO line and registers them with uloop.
+ *
+ * @param event Event source to initialize
+ * @param chip Path to the GPIO character device
+ * @param offset Line offset on the chip
+ * @param edges Edges to report (GPIO_EDGE_RISING, GPIO_EDGE_FALLING or both)
+ * @param handler Handler to invoke on each edge
+ * @param consumer Consumer label shown by the kernel
+ * @return Zero on success, -1 on failure
+ */
+int gpio_event_request(struct gpio_event *event, const char *chip, int offset,
+  int edges, gpio_event_handler handler, const char *consumer);
+
+/**
+ * Unregisters and releases a GPIO edge event source.
+ *
+ * @param event Event source to release
+ */
+void gpio_event_release(struct gpio_event *event);
+
 #endif
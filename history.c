@@ -0,0 +1,316 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "history.h"
+#include "koruza.h"
+#include "configuration.h"
+#include "metrics.h"
+
+#include <libubox/uloop.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+
+#define HISTORY_MAGIC 0x4B524853
+#define HISTORY_VERSION 1
+#define HISTORY_SAMPLE_INTERVAL 1000
+
+/**
+ * Ring of history slots at a given resolution.
+ */
+struct history_tier {
+  uint32_t resolution;
+  uint32_t capacity;
+  // Index of the next slot to be written.
+  uint32_t head;
+  // Number of valid slots.
+  uint32_t length;
+};
+
+// Configured tiers: 1 s for an hour, 1 min for a week and 1 h for a year.
+static const struct history_tier history_tiers[] = {
+  { .resolution = 1, .capacity = 3600 },
+  { .resolution = 60, .capacity = 10080 },
+  { .resolution = 3600, .capacity = 8760 },
+};
+
+#define HISTORY_TIER_COUNT (sizeof(history_tiers) / sizeof(history_tiers[0]))
+
+/**
+ * Header of the memory-mapped history file.
+ */
+struct history_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t point_size;
+  uint32_t tier_count;
+
+  struct history_tier tiers[HISTORY_TIER_COUNT];
+};
+
+static const char *history_metric_names[__HISTORY_METRIC_MAX] = {
+  [HISTORY_METRIC_RX_POWER] = "rx_power",
+  [HISTORY_METRIC_TX_POWER] = "tx_power",
+  [HISTORY_METRIC_MOTOR_X] = "motor_x",
+  [HISTORY_METRIC_MOTOR_Y] = "motor_y",
+  [HISTORY_METRIC_ENCODER_X] = "encoder_x",
+  [HISTORY_METRIC_ENCODER_Y] = "encoder_y",
+};
+
+// Memory-mapped history store.
+static struct history_header *history;
+static size_t history_size;
+// Points of each tier inside the store.
+static struct history_point *history_points[HISTORY_TIER_COUNT];
+// Timer for periodic sampling.
+static struct uloop_timeout timer_sample;
+
+int history_open(const char *path);
+void history_reset();
+void history_tier_ingest(size_t tier, uint32_t now, const int32_t *values);
+struct history_point *history_tier_point(size_t tier, uint32_t index);
+void history_timer_sample_handler(struct uloop_timeout *timer);
+
+int history_init(struct uci_context *uci)
+{
+  char *path = uci_get_string(uci, "koruza.@history[0].path");
+  int result = history_open(path ? path : HISTORY_DEFAULT_PATH);
+  free(path);
+
+  if (result != 0) {
+    syslog(LOG_WARNING, "Failed to open history store, history will not be recorded.");
+    return 0;
+  }
+
+  timer_sample.cb = history_timer_sample_handler;
+  uloop_timeout_set(&timer_sample, HISTORY_SAMPLE_INTERVAL);
+
+  return 0;
+}
+
+int history_open(const char *path)
+{
+  history_size = sizeof(struct history_header);
+  for (size_t i = 0; i < HISTORY_TIER_COUNT; i++) {
+    history_size += history_tiers[i].capacity * sizeof(struct history_point);
+  }
+
+  // Create the parent directory as nothing else does on a fresh boot.
+  char *directory = strdup(path);
+  char *separator = directory ? strrchr(directory, '/') : NULL;
+  if (separator && separator != directory) {
+    *separator = '\0';
+    if (mkdir(directory, 0700) != 0 && errno != EEXIST) {
+      syslog(LOG_WARNING, "Failed to create history directory '%s': %s", directory, strerror(errno));
+    }
+  }
+  free(directory);
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (ftruncate(fd, history_size) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  void *store = mmap(NULL, history_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (store == MAP_FAILED) {
+    return -1;
+  }
+
+  history = (struct history_header*) store;
+  uint8_t *points = (uint8_t*) store + sizeof(struct history_header);
+  for (size_t i = 0; i < HISTORY_TIER_COUNT; i++) {
+    history_points[i] = (struct history_point*) points;
+    points += history_tiers[i].capacity * sizeof(struct history_point);
+  }
+
+  // Keep existing history (e.g., after a driver restart) if layout matches.
+  int valid = (history->magic == HISTORY_MAGIC &&
+               history->version == HISTORY_VERSION &&
+               history->point_size == sizeof(struct history_point) &&
+               history->tier_count == HISTORY_TIER_COUNT);
+  for (size_t i = 0; valid && i < HISTORY_TIER_COUNT; i++) {
+    const struct history_tier *tier = &history->tiers[i];
+    valid = (tier->resolution == history_tiers[i].resolution &&
+             tier->capacity == history_tiers[i].capacity &&
+             tier->head < tier->capacity &&
+             tier->length <= tier->capacity);
+  }
+
+  if (!valid) {
+    history_reset();
+  }
+
+  return 0;
+}
+
+void history_reset()
+{
+  memset(history, 0, history_size);
+  history->magic = HISTORY_MAGIC;
+  history->version = HISTORY_VERSION;
+  history->point_size = sizeof(struct history_point);
+  history->tier_count = HISTORY_TIER_COUNT;
+  memcpy(history->tiers, history_tiers, sizeof(history_tiers));
+}
+
+const char *history_metric_name(enum history_metric metric)
+{
+  return history_metric_names[metric];
+}
+
+struct history_point *history_tier_point(size_t tier, uint32_t index)
+{
+  // Translate logical index (zero is the oldest slot) into ring position.
+  const struct history_tier *t = &history->tiers[tier];
+  uint32_t position = (t->head + t->capacity - t->length + index) % t->capacity;
+  return &history_points[tier][position];
+}
+
+void history_tier_ingest(size_t tier, uint32_t now, const int32_t *values)
+{
+  struct history_tier *t = &history->tiers[tier];
+  uint32_t slot = now - (now % t->resolution);
+  struct history_point *point = NULL;
+
+  // When the clock steps backwards (e.g., on the first NTP sync), drop the
+  // slots from the future so that the ring stays in chronological order.
+  uint32_t dropped = 0;
+  while (t->length && history_tier_point(tier, t->length - 1)->timestamp > slot) {
+    t->head = (t->head + t->capacity - 1) % t->capacity;
+    t->length--;
+    dropped++;
+  }
+
+  if (dropped) {
+    syslog(LOG_WARNING, "Clock stepped backwards, dropped %u history slots at %u s resolution.",
+      dropped, t->resolution);
+  }
+
+  if (t->length) {
+    point = history_tier_point(tier, t->length - 1);
+    if (point->timestamp != slot) {
+      point = NULL;
+    }
+  }
+
+  if (!point) {
+    // Start a new slot, overwriting the oldest one when full.
+    point = &history_points[tier][t->head];
+    t->head = (t->head + 1) % t->capacity;
+    if (t->length < t->capacity) {
+      t->length++;
+    }
+
+    point->timestamp = slot;
+    point->samples = 0;
+  }
+
+  // Update rollups incrementally.
+  for (size_t m = 0; m < __HISTORY_METRIC_MAX; m++) {
+    struct history_value *value = &point->values[m];
+    if (!point->samples) {
+      value->min = values[m];
+      value->max = values[m];
+      value->avg = values[m];
+    } else {
+      if (values[m] < value->min) value->min = values[m];
+      if (values[m] > value->max) value->max = values[m];
+      value->avg += ((float) values[m] - value->avg) / (float) (point->samples + 1);
+    }
+  }
+
+  point->samples++;
+}
+
+void history_timer_sample_handler(struct uloop_timeout *timer)
+{
+  uloop_timeout_set(timer, HISTORY_SAMPLE_INTERVAL);
+  METRICS_TIMER_START(timer);
+
+  const struct koruza_status *status = koruza_get_status();
+  int32_t values[__HISTORY_METRIC_MAX];
+  values[HISTORY_METRIC_RX_POWER] = status->sfp.rx_power;
+  values[HISTORY_METRIC_TX_POWER] = status->sfp.tx_power;
+  values[HISTORY_METRIC_MOTOR_X] = status->motors.x;
+  values[HISTORY_METRIC_MOTOR_Y] = status->motors.y;
+  values[HISTORY_METRIC_ENCODER_X] = status->motors.encoder_x;
+  values[HISTORY_METRIC_ENCODER_Y] = status->motors.encoder_y;
+
+  uint32_t now = (uint32_t) time(NULL);
+  for (size_t i = 0; i < HISTORY_TIER_COUNT; i++) {
+    history_tier_ingest(i, now, values);
+  }
+
+  METRICS_TIMER_STOP(timer, METRICS_TIMER_HISTORY);
+}
+
+int history_query(uint32_t resolution, uint32_t start, uint32_t end, uint32_t limit,
+                  history_point_handler handler, void *priv)
+{
+  if (!history) {
+    return -1;
+  }
+
+  size_t tier;
+  for (tier = 0; tier < HISTORY_TIER_COUNT; tier++) {
+    if (history->tiers[tier].resolution == resolution) {
+      break;
+    }
+  }
+
+  if (tier == HISTORY_TIER_COUNT) {
+    return -1;
+  }
+
+  // Binary search for the first slot that overlaps the range.
+  uint32_t low = 0;
+  uint32_t high = history->tiers[tier].length;
+  while (low < high) {
+    uint32_t middle = low + (high - low) / 2;
+    if (history_tier_point(tier, middle)->timestamp + resolution <= start) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  int count = 0;
+  for (uint32_t index = low; index < history->tiers[tier].length && count < limit; index++) {
+    const struct history_point *point = history_tier_point(tier, index);
+    if (point->timestamp > end) {
+      break;
+    }
+
+    handler(point, priv);
+    count++;
+  }
+
+  return count;
+}
@@ -0,0 +1,92 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_HISTORY_H
+#define KORUZA_DRIVER_HISTORY_H
+
+#include <stdint.h>
+#include <uci.h>
+
+// Default location of the history store (should be on tmpfs).
+#define HISTORY_DEFAULT_PATH "/var/run/koruza-driver/history"
+
+/**
+ * Metrics recorded in the history store.
+ */
+enum history_metric {
+  HISTORY_METRIC_RX_POWER,
+  HISTORY_METRIC_TX_POWER,
+  HISTORY_METRIC_MOTOR_X,
+  HISTORY_METRIC_MOTOR_Y,
+  HISTORY_METRIC_ENCODER_X,
+  HISTORY_METRIC_ENCODER_Y,
+  __HISTORY_METRIC_MAX,
+};
+
+/**
+ * Rollup of a single metric over one history slot.
+ */
+struct history_value {
+  int32_t min;
+  int32_t max;
+  float avg;
+};
+
+/**
+ * History slot as stored in the memory-mapped file.
+ */
+struct history_point {
+  // Start of the slot (UNIX timestamp).
+  uint32_t timestamp;
+  // Number of samples aggregated into this slot.
+  uint32_t samples;
+
+  struct history_value values[__HISTORY_METRIC_MAX];
+};
+
+/**
+ * Handler for points returned by a history query. The point references the
+ * store directly and must not be retained.
+ */
+typedef void (*history_point_handler)(const struct history_point *point, void *priv);
+
+int history_init(struct uci_context *uci);
+
+/**
+ * Returns the name of a history metric.
+ *
+ * @param metric Metric identifier
+ * @return Metric name
+ */
+const char *history_metric_name(enum history_metric metric);
+
+/**
+ * Performs a range query over the history tier with the given resolution.
+ *
+ * @param resolution Tier resolution in seconds
+ * @param start Start of the range (UNIX timestamp, inclusive)
+ * @param end End of the range (UNIX timestamp, inclusive)
+ * @param limit Maximum number of points to return
+ * @param handler Handler called for each point in chronological order
+ * @param priv Private data passed to the handler
+ * @return Number of points returned or -1 when there is no such tier
+ */
+int history_query(uint32_t resolution, uint32_t start, uint32_t end, uint32_t limit,
+                  history_point_handler handler, void *priv);
+
+#endif
@@ -19,11 +19,16 @@
 #include "koruza.h"
 #include "serial.h"
 #include "gpio.h"
+#include "firmware.h"
 #include "configuration.h"
+#include "metrics.h"
+#include "memory.h"
+#include "clock.h"
 
 #include "rpi_ws281x/ws2811.h"
 
 #include <string.h>
+#include <stdlib.h>
 #include <syslog.h>
 #include <libubox/uloop.h>
 #include <libubox/blobmsg.h>
@@ -34,8 +39,13 @@
 
 #define KORUZA_SFP_REFRESH_INTERVAL 100
 #define KORUZA_REFRESH_INTERVAL 500
+#define KORUZA_REFRESH_INTERVAL_FAST 40
+#define KORUZA_REFRESH_STABLE_REPORTS 10
+#define KORUZA_ACCELEROMETER_REFRESH_INTERVAL 500
+#define KORUZA_MOVE_STALL_REPORTS 25
 #define KORUZA_MCU_TIMEOUT 2000
-#define KORUZA_MCU_RESET_DELAY 120000
+#define KORUZA_MAX_PENDING_REQUESTS 64
+#define KORUZA_MAX_REQUEST_TIMEOUTS 8
 #define KORUZA_SURVEY_INTERVAL 700
 
 #define LED_COUNT 25
@@ -46,16 +56,55 @@ static struct ubus_context *koruza_ubus;
 static struct uci_context *koruza_uci;
 // Status of the connected KORUZA unit.
 static struct koruza_status status;
+// MCU reset line, requested once and kept open.
+static struct gpio_line gpio_reset_line = { .fd = -1, .pin = -1 };
 // Timer for periodic status retrieval.
 struct uloop_timeout timer_status;
+// Current status polling interval (adapts to motor activity).
+static int status_poll_interval = KORUZA_REFRESH_INTERVAL;
+// Number of consecutive status reports without motor activity.
+static int status_stable_reports = 0;
+// Timer for periodic accelerometer status retrieval.
+struct uloop_timeout timer_accelerometer_status;
 // Timer for periodic SFP status retrieval.
 struct uloop_timeout timer_sfp_status;
 // Timer for periodic survey updates.
 struct uloop_timeout timer_survey;
-// Timer for detection when MCU disconnects.
-struct uloop_timeout timer_wait_reply;
+// Request awaiting a reply from a device.
+struct koruza_request {
+  // Sequence number (zero when the slot is free).
+  uint32_t sequence;
+  serial_device_t device;
+  // Time when the request was sent (in microseconds).
+  uint64_t sent_at;
+  // Timer for detection of lost replies.
+  struct uloop_timeout timeout;
+};
+
+// Table of pending requests.
+static struct koruza_request pending_requests[KORUZA_MAX_PENDING_REQUESTS];
+// Last assigned request sequence number.
+static uint32_t request_last_sequence;
+// Time of the last accepted reply from the motor driver (in microseconds).
+static uint64_t motors_last_reply;
+// Number of consecutive request timeouts per device.
+static uint8_t request_timeouts[DEVICE_ACCELEROMETER + 1];
+// Time when the request answered by the last motor driver reply was sent.
+static uint64_t motors_last_answered;
+// Whether the stored motor position has uncommitted changes.
+static int motors_position_dirty = 0;
 // Survey.
 static struct koruza_survey survey;
+// Queue of motor moves, the first one is currently in progress.
+static LIST_HEAD(move_queue);
+// Finished moves waiting for their result to be reported.
+static LIST_HEAD(move_finished);
+// Timer for reporting finished moves.
+struct uloop_timeout timer_move_finished;
+// Last assigned move identifier.
+static uint32_t move_last_id;
+// Handler for finished moves.
+static koruza_move_handler move_handler;
 
 // LED configuration.
 static ws2811_t led_config = {
@@ -100,19 +149,30 @@ static struct color_map led_color_map[] = {
 int koruza_update_sfp();
 int koruza_update_sfp_leds();
 int koruza_uci_commit();
+int koruza_request_status(serial_device_t device);
+int koruza_send_request(serial_device_t device, message_t *message);
+int koruza_reply_received(serial_device_t device, const message_t *message);
+void koruza_request_timeout_handler(struct uloop_timeout *timer);
+void koruza_request_dropped(uint32_t sequence);
+int koruza_send_move(struct koruza_move *move);
+void koruza_move_start_next();
+void koruza_move_finish(struct koruza_move *move, enum koruza_move_result result);
+void koruza_timer_move_finished_handler(struct uloop_timeout *timer);
+void koruza_move_flush(enum koruza_move_result result);
+void koruza_move_update(int active);
+void koruza_poll_burst();
+void koruza_poll_update(int active);
+void koruza_status_changed(enum koruza_status_section section);
 void koruza_serial_motors_message_handler(const message_t *message);
 void koruza_serial_accelerometer_message_handler(const message_t *message);
 void koruza_timer_status_handler(struct uloop_timeout *timer);
+void koruza_timer_accelerometer_status_handler(struct uloop_timeout *timer);
+int koruza_mcu_reset_handler(int asserted);
 void koruza_timer_sfp_status_handler(struct uloop_timeout *timer);
-void koruza_timer_wait_reply_handler(struct uloop_timeout *timer);
 void koruza_timer_survey_handler(struct uloop_timeout *timer);
 void koruza_calibration_forward_transform();
 void koruza_calibration_inverse_transform();
 
-void koruza_compute_accelerometer_statistics_item(struct accelerometer_statistics_item *item);
-void koruza_update_accelerometer_statistics_item(struct accelerometer_statistics_item *item,
-                                                 float avg,
-                                                 float max);
 
 int koruza_init(struct uci_context *uci, struct ubus_context *ubus)
 {
@@ -122,6 +182,8 @@ int koruza_init(struct uci_context *uci, struct ubus_context *ubus)
   memset(&status, 0, sizeof(struct koruza_status));
   serial_set_message_handler(DEVICE_MOTORS, koruza_serial_motors_message_handler);
   serial_set_message_handler(DEVICE_ACCELEROMETER, koruza_serial_accelerometer_message_handler);
+  serial_set_drop_handler(DEVICE_MOTORS, koruza_request_dropped);
+  serial_set_drop_handler(DEVICE_ACCELEROMETER, koruza_request_dropped);
 
   koruza_survey_reset();
 
@@ -201,13 +263,19 @@ int koruza_init(struct uci_context *uci, struct ubus_context *ubus)
 
   // Setup timer handlers.
   timer_status.cb = koruza_timer_status_handler;
+  timer_accelerometer_status.cb = koruza_timer_accelerometer_status_handler;
   timer_sfp_status.cb = koruza_timer_sfp_status_handler;
-  timer_wait_reply.cb = koruza_timer_wait_reply_handler;
   timer_survey.cb = koruza_timer_survey_handler;
-  uloop_timeout_set(&timer_status, KORUZA_REFRESH_INTERVAL);
+  timer_move_finished.cb = koruza_timer_move_finished_handler;
+  uloop_timeout_set(&timer_status, status_poll_interval);
+  uloop_timeout_set(&timer_accelerometer_status, KORUZA_ACCELEROMETER_REFRESH_INTERVAL);
   uloop_timeout_set(&timer_sfp_status, KORUZA_SFP_REFRESH_INTERVAL);
   uloop_timeout_set(&timer_survey, KORUZA_SURVEY_INTERVAL);
 
+  for (size_t i = 0; i < KORUZA_MAX_PENDING_REQUESTS; i++) {
+    pending_requests[i].timeout.cb = koruza_request_timeout_handler;
+  }
+
   // Initialize LEDs.
   status.leds = uci_get_int(uci, "koruza.leds.status", 1);
   led_config.channel[0].gpionum = uci_get_int(uci, "koruza.leds.gpio", 40);
@@ -219,6 +287,13 @@ int koruza_init(struct uci_context *uci, struct ubus_context *ubus)
 
   // Perform a hard MCU reset.
   status.gpio_reset = uci_get_int(uci, "koruza.@mcu[0].gpio_reset", 18);
+  char *gpio_chip = uci_get_string(uci, "koruza.@mcu[0].gpio_chip");
+  if (gpio_line_request(&gpio_reset_line, gpio_chip ? gpio_chip : "/dev/gpiochip0",
+                        status.gpio_reset, GPIO_OUT, GPIO_LOW, "koruza-reset") != 0) {
+    syslog(LOG_WARNING, "Failed to request MCU reset GPIO line.");
+  }
+  free(gpio_chip);
+  serial_set_reset_handler(DEVICE_MOTORS, koruza_mcu_reset_handler);
   if (koruza_hard_reset() != 0) {
     syslog(LOG_WARNING, "Failed to trigger MCU reset.");
   }
@@ -236,6 +311,158 @@ const struct koruza_survey *koruza_get_survey()
   return &survey;
 }
 
+void koruza_status_changed(enum koruza_status_section section)
+{
+  status.generation[section]++;
+}
+
+int koruza_send_request(serial_device_t device, message_t *message)
+{
+  // The bootloader does not answer requests while firmware is being flashed.
+  if (device == DEVICE_MOTORS && firmware_active()) {
+    return -1;
+  }
+
+  // Find a free slot, evicting the oldest pending request when the table is full.
+  struct koruza_request *request = NULL;
+  for (size_t i = 0; i < KORUZA_MAX_PENDING_REQUESTS; i++) {
+    if (!pending_requests[i].sequence) {
+      request = &pending_requests[i];
+      break;
+    }
+
+    if (!request || pending_requests[i].sent_at < request->sent_at) {
+      request = &pending_requests[i];
+    }
+  }
+
+  if (request->sequence) {
+    uloop_timeout_cancel(&request->timeout);
+    koruza_request_timeout_handler(&request->timeout);
+  }
+
+  if (++request_last_sequence == 0) {
+    request_last_sequence = 1;
+  }
+
+  message_tlv_add_sequence_number(message, request_last_sequence);
+  message_tlv_add_checksum(message);
+
+  int result = serial_send_message(device, message, SERIAL_PRIORITY_LOW);
+  if (result != 0) {
+    return result;
+  }
+
+  request->sequence = request_last_sequence;
+  request->device = device;
+  request->sent_at = clock_monotonic_us();
+  uloop_timeout_set(&request->timeout, KORUZA_MCU_TIMEOUT);
+
+  return 0;
+}
+
+int koruza_reply_received(serial_device_t device, const message_t *message)
+{
+  struct koruza_request *request = NULL;
+  uint32_t sequence;
+  int tagged = message_tlv_get_sequence_number(message, &sequence) == MESSAGE_SUCCESS;
+
+  for (size_t i = 0; i < KORUZA_MAX_PENDING_REQUESTS; i++) {
+    struct koruza_request *r = &pending_requests[i];
+    if (!r->sequence || r->device != device) {
+      continue;
+    }
+
+    if (tagged) {
+      if (r->sequence == sequence) {
+        request = r;
+        break;
+      }
+    } else if (!request || r->sent_at < request->sent_at) {
+      // Firmware without sequence number support answers in order.
+      request = r;
+    }
+  }
+
+  request_timeouts[device] = 0;
+
+  if (!request) {
+    if (tagged) {
+      // Reply to a request that has already timed out or was answered before.
+      METRICS_COUNT(METRICS_REPLIES_DROPPED, 1);
+      return -1;
+    }
+
+    if (device == DEVICE_MOTORS) {
+      motors_last_reply = motors_last_answered = clock_monotonic_us();
+    }
+
+    return 0;
+  }
+
+  uint64_t now = clock_monotonic_us();
+  METRICS_RECORD(device == DEVICE_MOTORS ? METRICS_MCU_ROUND_TRIP : METRICS_ACCELEROMETER_ROUND_TRIP,
+                 now - request->sent_at);
+  uloop_timeout_cancel(&request->timeout);
+  request->sequence = 0;
+
+  if (device == DEVICE_MOTORS) {
+    motors_last_reply = now;
+    motors_last_answered = request->sent_at;
+  }
+
+  return 0;
+}
+
+void koruza_request_timeout_handler(struct uloop_timeout *timer)
+{
+  METRICS_TIMER_START(timer);
+  struct koruza_request *request = container_of(timer, struct koruza_request, timeout);
+
+  METRICS_COUNT(METRICS_REQUEST_TIMEOUTS, 1);
+
+  // Pipelined requests may be lost individually, the motor driver is only
+  // considered disconnected when nothing was received since the request.
+  if (request->device == DEVICE_MOTORS && status.motors.connected && motors_last_reply < request->sent_at) {
+    syslog(LOG_WARNING, "KORUZA motor driver has been disconnected.");
+    status.motors.connected = 0;
+    koruza_status_changed(KORUZA_SECTION_MOTORS);
+    koruza_move_flush(KORUZA_MOVE_CANCELLED);
+  }
+
+  request->sequence = 0;
+
+  // The device may have restarted on its own (watchdog) or still be at the
+  // negotiated rate, so reset it to base rate when possible. Otherwise reopen
+  // at base rate, probing the other rates while the device stays silent.
+  if (++request_timeouts[request->device] >= KORUZA_MAX_REQUEST_TIMEOUTS) {
+    request_timeouts[request->device] = 0;
+    if (serial_reset(request->device) != 0) {
+      serial_restart(request->device);
+    }
+  }
+
+  METRICS_TIMER_STOP(timer, METRICS_TIMER_WAIT_REPLY);
+}
+
+void koruza_request_dropped(uint32_t sequence)
+{
+  if (!sequence) {
+    return;
+  }
+
+  // A request dropped from the transmit queue was never sent, so complete
+  // it right away instead of counting it as a timeout.
+  for (size_t i = 0; i < KORUZA_MAX_PENDING_REQUESTS; i++) {
+    struct koruza_request *request = &pending_requests[i];
+    if (request->sequence == sequence) {
+      uloop_timeout_cancel(&request->timeout);
+      request->sequence = 0;
+      return;
+    }
+  }
+}
+
 void koruza_serial_motors_message_handler(const message_t *message)
 {
   // Check if this is a reply or a command message.
@@ -249,32 +476,48 @@ void koruza_serial_motors_message_handler(const message_t *message)
 
   switch (reply) {
     case REPLY_STATUS_REPORT: {
-      uloop_timeout_cancel(&timer_wait_reply);
+      if (koruza_reply_received(DEVICE_MOTORS, message) != 0) {
+        break;
+      }
 
       if (!status.motors.connected) {
         // Was not considered connected until now.
         syslog(LOG_INFO, "Detected KORUZA motor driver on the configured serial port.");
         status.motors.connected = 1;
+        koruza_status_changed(KORUZA_SECTION_MOTORS);
 
         // Restore motor position.
         koruza_restore_motor();
       }
 
+      uint32_t baudrate = serial_get_baudrate(DEVICE_MOTORS);
+      if (status.motors.baudrate != baudrate) {
+        status.motors.baudrate = baudrate;
+        koruza_status_changed(KORUZA_SECTION_MOTORS);
+      }
+
+      // Motors are considered active while any reported value keeps changing.
+      int active = 0;
+
       // Handle motor position report.
       tlv_motor_position_t position;
       if (message_tlv_get_motor_position(message, &position) == MESSAGE_SUCCESS) {
+        if (position.x != status.motors.x || position.y != status.motors.y || position.z != status.motors.z) {
+          active = 1;
+        }
+
         status.motors.x = position.x;
         status.motors.y = position.y;
         status.motors.z = position.z;
 
-        // Save stored position (when in range).
+        // Save stored position (when in range and changed).
         if (status.motors.x >= -status.motors.range_x && status.motors.x <= status.motors.range_x &&
             status.motors.y >= -status.motors.range_y && status.motors.y <= status.motors.range_y) {
-          uci_set_int(koruza_uci, "koruza.@motors[0].last_x", status.motors.x);
-          uci_set_int(koruza_uci, "koruza.@motors[0].last_y", status.motors.y);
-
-          // Commit changes.
-          koruza_uci_commit();
+          if (active) {
+            uci_set_int(koruza_uci, "koruza.@motors[0].last_x", status.motors.x);
+            uci_set_int(koruza_uci, "koruza.@motors[0].last_y", status.motors.y);
+            motors_position_dirty = 1;
+          }
         } else {
           syslog(LOG_WARNING, "MCU sent an out-of-range motor position.");
         }
@@ -283,22 +526,49 @@ void koruza_serial_motors_message_handler(const message_t *message)
       // Handle encoder value report.
       tlv_encoder_value_t encoder_value;
       if (message_tlv_get_encoder_value(message, &encoder_value) == MESSAGE_SUCCESS) {
+        if (encoder_value.x != status.motors.encoder_x || encoder_value.y != status.motors.encoder_y) {
+          active = 1;
+        }
+
         status.motors.encoder_x = encoder_value.x;
         status.motors.encoder_y = encoder_value.y;
       }
 
+      if (active) {
+        koruza_status_changed(KORUZA_SECTION_MOTORS);
+      }
+
+      koruza_move_update(active);
+      koruza_poll_update(active);
+
+      // Commit the stored position once the motors have come to rest, instead
+      // of writing flash on every report while moving.
+      if (!active && !status.motors.move_id && motors_position_dirty) {
+        koruza_uci_commit();
+        motors_position_dirty = 0;
+      }
+      break;
+    }
+
+    case REPLY_FIRMWARE_ACK: {
+      firmware_ack_received(message);
       break;
     }
 
     case REPLY_ERROR_REPORT: {
       // Parse the error report.
       tlv_error_report_t error;
-      if (message_tlv_get_error_report(message, &error) == MESSAGE_SUCCESS) {
+      if (message_tlv_get_error_report(message, &error) == MESSAGE_SUCCESS && status.errors.code != error.code) {
         status.errors.code = error.code;
+        koruza_status_changed(KORUZA_SECTION_GENERAL);
       }
 
       break;
     }
+
+    default: {
+      // Ignore.
+    }
   }
 
   switch (command) {
@@ -327,25 +597,38 @@ void koruza_serial_accelerometer_message_handler(const message_t *message)
 
   switch (reply) {
     case REPLY_STATUS_REPORT: {
+      if (koruza_reply_received(DEVICE_ACCELEROMETER, message) != 0) {
+        break;
+      }
+
       if (!status.accelerometer.connected) {
         // Was not considered connected until now.
         syslog(LOG_INFO, "Detected accelerometer driver on the configured serial port.");
         status.accelerometer.connected = 1;
       }
 
+      status.accelerometer.baudrate = serial_get_baudrate(DEVICE_ACCELEROMETER);
+      koruza_status_changed(KORUZA_SECTION_ACCELEROMETER);
+
       // Handle accelerometer value report.
       tlv_vibration_value_t vibration_value;
       if (message_tlv_get_vibration_value(message, &vibration_value) == MESSAGE_SUCCESS) {
         for (size_t i = 0; i < 4; i++) {
-          koruza_update_accelerometer_statistics_item(&status.accelerometer.x[i],
-                                                      vibration_value.avg_x[i],
-                                                      vibration_value.max_x[i]);
-          koruza_update_accelerometer_statistics_item(&status.accelerometer.y[i],
-                                                      vibration_value.avg_y[i],
-                                                      vibration_value.max_y[i]);
-          koruza_update_accelerometer_statistics_item(&status.accelerometer.z[i],
-                                                      vibration_value.avg_z[i],
-                                                      vibration_value.max_z[i]);
+          accelerometer_statistics_update(&status.accelerometer.x[i],
+                                         vibration_value.avg_x[i],
+                                         vibration_value.max_x[i]);
+          accelerometer_statistics_update(&status.accelerometer.y[i],
+                                         vibration_value.avg_y[i],
+                                         vibration_value.max_y[i]);
+          accelerometer_statistics_update(&status.accelerometer.z[i],
+                                         vibration_value.avg_z[i],
+                                         vibration_value.max_z[i]);
+
+          // Sample rate equals the accelerometer polling rate.
+          float sample_rate = 1000.0 / (float) KORUZA_ACCELEROMETER_REFRESH_INTERVAL;
+          accelerometer_statistics_spectrum(&status.accelerometer.x[i], sample_rate);
+          accelerometer_statistics_spectrum(&status.accelerometer.y[i], sample_rate);
+          accelerometer_statistics_spectrum(&status.accelerometer.z[i], sample_rate);
         }
       }
 
@@ -370,46 +653,228 @@ int koruza_restore_motor()
   message_tlv_add_command(&msg, COMMAND_RESTORE_MOTOR);
   message_tlv_add_motor_position(&msg, &position);
   message_tlv_add_checksum(&msg);
-  serial_send_message(DEVICE_MOTORS, &msg);
+  serial_send_message(DEVICE_MOTORS, &msg, SERIAL_PRIORITY_HIGH);
   message_free(&msg);
+
+  koruza_poll_burst();
   return 0;
 }
 
-int koruza_move_motor(int32_t x, int32_t y, int32_t z)
+int koruza_move_motor(int32_t x, int32_t y, int32_t z, uint8_t queue, uint32_t *move_id)
 {
-  if (!status.motors.connected) {
+  if (!status.motors.connected || firmware_active()) {
+    return -1;
+  }
+
+  // Moves that are not queued replace pending ones, so only queueing is limited.
+  if (queue && status.motors.move_queue >= KORUZA_MOVE_QUEUE_LENGTH) {
     return -1;
   }
 
+  if (memory_reserve(MEMORY_MOVES, sizeof(struct koruza_move)) != 0) {
+    return -1;
+  }
+
+  struct koruza_move *move = (struct koruza_move*) malloc(sizeof(struct koruza_move));
+  if (!move) {
+    memory_release(MEMORY_MOVES, sizeof(struct koruza_move));
+    return -1;
+  }
+
+  memset(move, 0, sizeof(struct koruza_move));
+  move->id = ++move_last_id;
+  if (!move->id) {
+    // Zero is reserved for "no move".
+    move->id = ++move_last_id;
+  }
+  move->x = x;
+  move->y = y;
+  move->z = z;
+
+  // Unless queueing was requested, the new move supersedes all others.
+  if (!queue) {
+    struct koruza_move *current = NULL;
+    if (status.motors.move_id) {
+      current = list_first_entry(&move_queue, struct koruza_move, list);
+    }
+
+    if (current && !current->accepted) {
+      // The MCU has not seen the current move yet. Keep it in flight and
+      // replace any pending targets, so at most one new frame is sent once
+      // the MCU catches up.
+      struct koruza_move *pending, *tmp;
+      list_for_each_entry_safe(pending, tmp, &move_queue, list) {
+        if (pending != current) {
+          status.motors.move_collapsed++;
+          koruza_move_finish(pending, KORUZA_MOVE_COLLAPSED);
+        }
+      }
+
+      move->supersede = 1;
+    } else {
+      koruza_move_flush(KORUZA_MOVE_CANCELLED);
+    }
+  }
+
+  list_add_tail(&move->list, &move_queue);
+  status.motors.move_queue++;
+  koruza_status_changed(KORUZA_SECTION_MOTORS);
+
+  if (move_id) {
+    *move_id = move->id;
+  }
+
+  // Start the move immediately if nothing else is in progress.
+  if (!status.motors.move_id) {
+    koruza_move_start_next();
+  }
+
+  return 0;
+}
+
+void koruza_set_move_handler(koruza_move_handler handler)
+{
+  move_handler = handler;
+}
+
+int koruza_send_move(struct koruza_move *move)
+{
   tlv_motor_position_t position;
-  position.x = x;
-  position.y = y;
-  position.z = z;
+  position.x = move->x;
+  position.y = move->y;
+  position.z = move->z;
 
   message_t msg;
   message_init(&msg);
   message_tlv_add_command(&msg, COMMAND_MOVE_MOTOR);
   message_tlv_add_motor_position(&msg, &position);
   message_tlv_add_checksum(&msg);
-  serial_send_message(DEVICE_MOTORS, &msg);
+  int result = serial_send_message(DEVICE_MOTORS, &msg, SERIAL_PRIORITY_HIGH);
   message_free(&msg);
 
-  return 0;
+  move->sent_at = clock_monotonic_us();
+  move->accepted = 0;
+
+  koruza_poll_burst();
+  return result;
+}
+
+void koruza_move_start_next()
+{
+  status.motors.move_id = 0;
+  koruza_status_changed(KORUZA_SECTION_MOTORS);
+  if (list_empty(&move_queue)) {
+    return;
+  }
+
+  struct koruza_move *move = list_first_entry(&move_queue, struct koruza_move, list);
+  status.motors.move_id = move->id;
+
+  // Moves to the current position complete immediately.
+  if (move->x == status.motors.x && move->y == status.motors.y && move->z == status.motors.z) {
+    koruza_move_finish(move, KORUZA_MOVE_COMPLETED);
+    return;
+  }
+
+  if (koruza_send_move(move) != 0) {
+    koruza_move_finish(move, KORUZA_MOVE_CANCELLED);
+  }
+}
+
+void koruza_move_finish(struct koruza_move *move, enum koruza_move_result result)
+{
+  int current = (move->id == status.motors.move_id);
+
+  move->result = result;
+  list_del(&move->list);
+  status.motors.move_queue--;
+  koruza_status_changed(KORUZA_SECTION_MOTORS);
+
+  // Moves may finish while they are being submitted, so report results from
+  // the event loop, after the caller has been given the move identifier.
+  list_add_tail(&move->list, &move_finished);
+  uloop_timeout_set(&timer_move_finished, 0);
+
+  if (current) {
+    koruza_move_start_next();
+  }
+}
+
+void koruza_timer_move_finished_handler(struct uloop_timeout *timer)
+{
+  struct koruza_move *move, *tmp;
+  list_for_each_entry_safe(move, tmp, &move_finished, list) {
+    list_del(&move->list);
+    if (move_handler) {
+      move_handler(move);
+    }
+    memory_release(MEMORY_MOVES, sizeof(struct koruza_move));
+    free(move);
+  }
+}
+
+void koruza_move_flush(enum koruza_move_result result)
+{
+  struct koruza_move *move, *tmp;
+
+  // Prevent finishing moves from starting the next one.
+  status.motors.move_id = 0;
+
+  list_for_each_entry_safe(move, tmp, &move_queue, list) {
+    koruza_move_finish(move, result);
+  }
+}
+
+void koruza_move_update(int active)
+{
+  if (!status.motors.move_id) {
+    return;
+  }
+
+  struct koruza_move *move = list_first_entry(&move_queue, struct koruza_move, list);
+  if (!move->accepted && motors_last_answered >= move->sent_at) {
+    // Status was requested after the move command, so the MCU has seen it.
+    move->accepted = 1;
+
+    // A newer target that arrived in the meantime replaces this move.
+    if (move->list.next != &move_queue) {
+      struct koruza_move *next = list_entry(move->list.next, struct koruza_move, list);
+      if (next->supersede) {
+        koruza_move_finish(move, KORUZA_MOVE_CANCELLED);
+        return;
+      }
+    }
+  }
+  if (move->x == status.motors.x && move->y == status.motors.y && move->z == status.motors.z) {
+    koruza_move_finish(move, KORUZA_MOVE_COMPLETED);
+    return;
+  }
+
+  // Detect moves that can never complete (e.g., target is out of range).
+  if (active) {
+    move->stable_reports = 0;
+  } else if (++move->stable_reports >= KORUZA_MOVE_STALL_REPORTS) {
+    koruza_move_finish(move, KORUZA_MOVE_STALLED);
+  }
 }
 
 int koruza_homing()
 {
-  if (!status.motors.connected) {
+  if (!status.motors.connected || firmware_active()) {
     return -1;
   }
 
+  // Homing overrides any queued moves.
+  koruza_move_flush(KORUZA_MOVE_CANCELLED);
+
   message_t msg;
   message_init(&msg);
   message_tlv_add_command(&msg, COMMAND_HOMING);
   message_tlv_add_checksum(&msg);
-  serial_send_message(DEVICE_MOTORS, &msg);
+  serial_send_message(DEVICE_MOTORS, &msg, SERIAL_PRIORITY_HIGH);
   message_free(&msg);
 
+  koruza_poll_burst();
   return 0;
 }
 
@@ -419,9 +884,12 @@ int koruza_reboot()
   message_init(&msg);
   message_tlv_add_command(&msg, COMMAND_REBOOT);
   message_tlv_add_checksum(&msg);
-  serial_send_message(DEVICE_MOTORS, &msg);
+  serial_send_message(DEVICE_MOTORS, &msg, SERIAL_PRIORITY_HIGH);
   message_free(&msg);
 
+  // MCU comes back at base rate.
+  serial_restart(DEVICE_MOTORS);
+
   return 0;
 }
 
@@ -431,37 +899,24 @@ int koruza_firmware_upgrade()
   message_init(&msg);
   message_tlv_add_command(&msg, COMMAND_FIRMWARE_UPGRADE);
   message_tlv_add_checksum(&msg);
-  serial_send_message(DEVICE_MOTORS, &msg);
+  serial_send_message(DEVICE_MOTORS, &msg, SERIAL_PRIORITY_HIGH);
   message_free(&msg);
 
+  // Bootloader runs at base rate.
+  serial_restart(DEVICE_MOTORS);
+
   return 0;
 }
 
-int koruza_hard_reset()
+int koruza_mcu_reset_handler(int asserted)
 {
-  if (gpio_export(status.gpio_reset) != 0) {
-    return -1;
-  }
-
-  if (gpio_direction(status.gpio_reset, GPIO_OUT) != 0) {
-    gpio_unexport(status.gpio_reset);
-    return -1;
-  }
-
-  if (gpio_write(status.gpio_reset, GPIO_HIGH) != 0) {
-    gpio_unexport(status.gpio_reset);
-    return -1;
-  }
-
-  usleep(KORUZA_MCU_RESET_DELAY);
-
-  if (gpio_write(status.gpio_reset, GPIO_LOW) != 0) {
-    gpio_unexport(status.gpio_reset);
-    return -1;
-  }
+  return gpio_line_write(&gpio_reset_line, asserted ? GPIO_HIGH : GPIO_LOW);
+}
 
-  gpio_unexport(status.gpio_reset);
-  return 0;
+int koruza_hard_reset()
+{
+  // Reset line is released and the device reopened asynchronously.
+  return serial_reset(DEVICE_MOTORS);
 }
 
 int koruza_update_sfp_leds()
@@ -490,7 +945,11 @@ int koruza_update_sfp_leds()
     led_config.channel[0].brightness = 0;
   }
 
-  if (ws2811_render(&led_config) != WS2811_SUCCESS) {
+  METRICS_TIMER_START(render);
+  ws2811_return_t result = ws2811_render(&led_config);
+  METRICS_TIMER_STOP(render, METRICS_LED_RENDER);
+
+  if (result != WS2811_SUCCESS) {
     syslog(LOG_WARNING, "Failed to render LED status.");
     return -1;
   }
@@ -505,35 +964,91 @@ int koruza_update_status()
   koruza_update_sfp_leds();
 
   // Send a status update request via the serial interface.
+  koruza_request_status(DEVICE_MOTORS);
+  koruza_request_status(DEVICE_ACCELEROMETER);
+
+  return 0;
+}
+
+int koruza_request_status(serial_device_t device)
+{
   message_t msg;
   message_init(&msg);
   message_tlv_add_command(&msg, COMMAND_GET_STATUS);
   message_tlv_add_power_reading(&msg, status.sfp.rx_power);
-  message_tlv_add_checksum(&msg);
 
-  if (serial_send_message(DEVICE_MOTORS, &msg) != 0) {
-    status.motors.connected = 0;
+  int result = koruza_send_request(device, &msg);
+  if (result != 0) {
+    switch (device) {
+      case DEVICE_MOTORS: {
+        if (status.motors.connected) {
+          status.motors.connected = 0;
+          koruza_status_changed(KORUZA_SECTION_MOTORS);
+        }
+        break;
+      }
+      case DEVICE_ACCELEROMETER: {
+        if (status.accelerometer.connected) {
+          status.accelerometer.connected = 0;
+          koruza_status_changed(KORUZA_SECTION_ACCELEROMETER);
+        }
+        break;
+      }
+    }
   }
 
-  if (serial_send_message(DEVICE_ACCELEROMETER, &msg) != 0) {
-    status.accelerometer.connected = 0;
+  message_free(&msg);
+
+  return result;
+}
+
+void koruza_poll_burst()
+{
+  status_stable_reports = 0;
+  if (status_poll_interval == KORUZA_REFRESH_INTERVAL_FAST) {
+    return;
   }
 
-  message_free(&msg);
+  // Switch to fast polling and pull the next status request forward.
+  status_poll_interval = KORUZA_REFRESH_INTERVAL_FAST;
+  if (!timer_status.pending || uloop_timeout_remaining(&timer_status) > status_poll_interval) {
+    uloop_timeout_set(&timer_status, status_poll_interval);
+  }
+}
 
-  return 0;
+void koruza_poll_update(int active)
+{
+  // Any alignment in progress also requires fast updates.
+  if (active || status.alignment.state != 0) {
+    koruza_poll_burst();
+    return;
+  }
+
+  // Decay towards the idle polling rate once the motors are stable.
+  if (++status_stable_reports < KORUZA_REFRESH_STABLE_REPORTS) {
+    return;
+  }
+
+  status_poll_interval *= 2;
+  if (status_poll_interval > KORUZA_REFRESH_INTERVAL) {
+    status_poll_interval = KORUZA_REFRESH_INTERVAL;
+  }
 }
 
 int koruza_uci_commit()
 {
   struct uci_ptr ptr;
+  int result = 0;
+
+  METRICS_TIMER_START(commit);
   if (uci_lookup_ptr(koruza_uci, &ptr, "koruza", true) != UCI_OK ||
       uci_commit(koruza_uci, &ptr.p, false) != UCI_OK) {
     syslog(LOG_ERR, "Failed to commit updated webcam calibration offsets.");
-    return 1;
+    result = 1;
   }
+  METRICS_TIMER_STOP(commit, METRICS_UCI_COMMIT);
 
-  return 0;
+  return result;
 }
 
 void koruza_calibration_inverse_transform()
@@ -558,6 +1073,7 @@ int koruza_set_webcam_calibration(uint32_t offset_x, uint32_t offset_y)
   cal->offset_x = offset_x;
   cal->offset_y = offset_y;
   koruza_calibration_inverse_transform();
+  koruza_status_changed(KORUZA_SECTION_CAMERA);
 
   uci_set_int(koruza_uci, "koruza.@webcam[0].global_offset_x", cal->global_offset_x);
   uci_set_int(koruza_uci, "koruza.@webcam[0].global_offset_y", cal->global_offset_y);
@@ -568,6 +1084,7 @@ int koruza_set_webcam_calibration(uint32_t offset_x, uint32_t offset_y)
 int koruza_set_distance(uint32_t distance)
 {
   status.camera_calibration.distance = distance;
+  koruza_status_changed(KORUZA_SECTION_CAMERA);
 
   uci_set_int(koruza_uci, "koruza.@webcam[0].distance", distance);
 
@@ -650,14 +1167,22 @@ static void koruza_sfp_get_diagnostics(struct ubus_request *req, int type, struc
       const char *tx_power = blobmsg_get_string(tb_value[SFP_DIAG_ITEM_TX_POWER]);
       float tx_power_float = 0;
       sscanf(tx_power, "%f", &tx_power_float);
-      status.sfp.tx_power = (uint16_t) (tx_power_float * 10000);
+      uint16_t value = (uint16_t) (tx_power_float * 10000);
+      if (status.sfp.tx_power != value) {
+        status.sfp.tx_power = value;
+        koruza_status_changed(KORUZA_SECTION_SFP);
+      }
     }
 
     if (tb_value[SFP_DIAG_ITEM_RX_POWER]) {
       const char *rx_power = blobmsg_get_string(tb_value[SFP_DIAG_ITEM_RX_POWER]);
       float rx_power_float = 0;
       sscanf(rx_power, "%f", &rx_power_float);
-      status.sfp.rx_power = (uint16_t) (rx_power_float * 10000);
+      uint16_t value = (uint16_t) (rx_power_float * 10000);
+      if (status.sfp.rx_power != value) {
+        status.sfp.rx_power = value;
+        koruza_status_changed(KORUZA_SECTION_SFP);
+      }
     }
 
     // Only process the first module.
@@ -690,7 +1215,10 @@ static void koruza_sfp_get_calibration_data(struct ubus_request *req, int type,
   message_t calibration_msg;
   tlv_sfp_calibration_t calibration;
   message_init(&calibration_msg);
-  if (message_parse(&calibration_msg, vendor_specific, vendor_specific_length) != MESSAGE_SUCCESS) {
+  METRICS_TIMER_START(parse);
+  message_result_t result = message_parse(&calibration_msg, vendor_specific, vendor_specific_length);
+  METRICS_TIMER_STOP(parse, METRICS_MESSAGE_PARSE);
+  if (result != MESSAGE_SUCCESS) {
     return;
   }
 
@@ -699,8 +1227,12 @@ static void koruza_sfp_get_calibration_data(struct ubus_request *req, int type,
     return;
   }
 
-  status.camera_calibration.offset_x = calibration.offset_x;
-  status.camera_calibration.offset_y = calibration.offset_y;
+  if (status.camera_calibration.offset_x != calibration.offset_x ||
+      status.camera_calibration.offset_y != calibration.offset_y) {
+    status.camera_calibration.offset_x = calibration.offset_x;
+    status.camera_calibration.offset_y = calibration.offset_y;
+    koruza_status_changed(KORUZA_SECTION_CAMERA);
+  }
 
   message_free(&calibration_msg);
 }
@@ -714,49 +1246,59 @@ int koruza_update_sfp()
   }
 
   static struct blob_buf req;
+  int result;
 
   // Fetch a list of modules and get the first identifier of the module on bus /dev/i2c-0.
   char module_id[MAX_SFP_MODULE_ID_LENGTH] = {0,};
   blob_buf_init(&req, 0);
-  if (ubus_invoke(
-        koruza_ubus,
-        ubus_id,
-        "get_modules",
-        req.head,
-        koruza_sfp_get_module,
-        &module_id,
-        1000
-      ) != UBUS_STATUS_OK) {
+  METRICS_TIMER_START(modules);
+  result = ubus_invoke(
+    koruza_ubus,
+    ubus_id,
+    "get_modules",
+    req.head,
+    koruza_sfp_get_module,
+    &module_id,
+    1000
+  );
+  METRICS_TIMER_STOP(modules, METRICS_SFP_GET_MODULES);
+  if (result != UBUS_STATUS_OK) {
     return -1;
   }
 
   // Get diagnostic data for this module.
   blob_buf_init(&req, 0);
   blobmsg_add_string(&req, "module", module_id);
-  if (ubus_invoke(
-        koruza_ubus,
-        ubus_id,
-        "get_diagnostics",
-        req.head,
-        koruza_sfp_get_diagnostics,
-        NULL,
-        1000
-      ) != UBUS_STATUS_OK) {
+  METRICS_TIMER_START(diagnostics);
+  result = ubus_invoke(
+    koruza_ubus,
+    ubus_id,
+    "get_diagnostics",
+    req.head,
+    koruza_sfp_get_diagnostics,
+    NULL,
+    1000
+  );
+  METRICS_TIMER_STOP(diagnostics, METRICS_SFP_GET_DIAGNOSTICS);
+  if (result != UBUS_STATUS_OK) {
     return -1;
   }
 
   // Now get vendor-specific data for this module.
   blob_buf_init(&req, 0);
   blobmsg_add_string(&req, "module", module_id);
-  if (ubus_invoke(
-        koruza_ubus,
-        ubus_id,
-        "get_vendor_specific_data",
-        req.head,
-        koruza_sfp_get_calibration_data,
-        NULL,
-        1000
-      ) != UBUS_STATUS_OK) {
+  METRICS_TIMER_START(vendor);
+  result = ubus_invoke(
+    koruza_ubus,
+    ubus_id,
+    "get_vendor_specific_data",
+    req.head,
+    koruza_sfp_get_calibration_data,
+    NULL,
+    1000
+  );
+  METRICS_TIMER_STOP(vendor, METRICS_SFP_GET_VENDOR_DATA);
+  if (result != UBUS_STATUS_OK) {
     return -1;
   }
 
@@ -766,32 +1308,40 @@ int koruza_update_sfp()
 void koruza_timer_status_handler(struct uloop_timeout *timer)
 {
   (void) timer;
+  METRICS_TIMER_START(timer);
 
-  koruza_update_status();
+  // SFP data is refreshed by its own timer, so only query the MCU here.
+  koruza_request_status(DEVICE_MOTORS);
 
-  uloop_timeout_set(&timer_status, KORUZA_REFRESH_INTERVAL);
+  uloop_timeout_set(&timer_status, status_poll_interval);
 
-  if (!timer_wait_reply.pending)
-    uloop_timeout_set(&timer_wait_reply, KORUZA_MCU_TIMEOUT);
+  METRICS_TIMER_STOP(timer, METRICS_TIMER_STATUS);
+}
+
+void koruza_timer_accelerometer_status_handler(struct uloop_timeout *timer)
+{
+  METRICS_TIMER_START(timer);
+
+  // Accelerometer statistics windows assume a fixed sampling rate, so it is
+  // always polled at the idle rate.
+  koruza_request_status(DEVICE_ACCELEROMETER);
+
+  uloop_timeout_set(timer, KORUZA_ACCELEROMETER_REFRESH_INTERVAL);
+
+  METRICS_TIMER_STOP(timer, METRICS_TIMER_ACCELEROMETER_STATUS);
 }
 
 void koruza_timer_sfp_status_handler(struct uloop_timeout *timer)
 {
+  METRICS_TIMER_START(timer);
+
   // Update data from the SFP driver.
   koruza_update_sfp();
   koruza_update_sfp_leds();
 
   uloop_timeout_set(timer, KORUZA_SFP_REFRESH_INTERVAL);
-}
-
-void koruza_timer_wait_reply_handler(struct uloop_timeout *timer)
-{
-  if (!status.motors.connected) {
-    return;
-  }
 
-  syslog(LOG_WARNING, "KORUZA motor driver has been disconnected.");
-  status.motors.connected = 0;
+  METRICS_TIMER_STOP(timer, METRICS_TIMER_SFP_STATUS);
 }
 
 void koruza_survey_reset()
@@ -807,6 +1357,8 @@ void koruza_timer_survey_handler(struct uloop_timeout *timer)
     return;
   }
 
+  METRICS_TIMER_START(timer);
+
   int x_bin = (status.motors.x * (SURVEY_BINS / 2)) / SURVEY_COVERAGE + (SURVEY_BINS / 2);
   int y_bin = (status.motors.y * (SURVEY_BINS / 2)) / SURVEY_COVERAGE + (SURVEY_BINS / 2);
 
@@ -816,11 +1368,14 @@ void koruza_timer_survey_handler(struct uloop_timeout *timer)
   if (y_bin >= SURVEY_BINS) y_bin = SURVEY_BINS - 1;
 
   survey.data[y_bin][x_bin].rx_power = status.sfp.rx_power;
+
+  METRICS_TIMER_STOP(timer, METRICS_TIMER_SURVEY);
 }
 
 void koruza_set_leds(uint8_t leds)
 {
   status.leds = leds;
+  koruza_status_changed(KORUZA_SECTION_GENERAL);
 
   // Persist LED configuration.
   uci_set_string(koruza_uci, "koruza.leds", "leds");
@@ -830,54 +1385,12 @@ void koruza_set_leds(uint8_t leds)
   koruza_update_sfp_leds();
 }
 
-void koruza_update_accelerometer_statistics_item(struct accelerometer_statistics_item *item,
-                                                 float avg,
-                                                 float max)
-{
-  item->sum -= item->buffer[item->index];
-  item->buffer[item->index] = avg;
-  item->buffer_max[item->index] = max;
-  item->sum += avg;
-
-  if (item->samples < ACCELEROMETER_STATISTICS_BUFFER_SIZE) {
-    item->samples++;
-  }
-  item->index = (item->index + 1) % ACCELEROMETER_STATISTICS_BUFFER_SIZE;
-
-  item->average = item->sum / (float) item->samples;
-
-  // Invalidate statistics computed on-demand.
-  item->variance = NAN;
-  item->maximum = -INFINITY;
-}
-
-void koruza_compute_accelerometer_statistics_item(struct accelerometer_statistics_item *item)
-{
-  item->variance = 0;
-  item->maximum = -INFINITY;
-
-  for (size_t index = 0; index < item->samples; index++) {
-    float value = item->buffer[index];
-    float value_max = item->buffer_max[index];
-    if (value_max > item->maximum) {
-      item->maximum = value_max;
-    }
-    item->variance += (value - item->average) * (value - item->average);
-  }
-
-  item->variance /= (float) item->samples;
-}
-
-void koruza_compute_accelerometer_statistics()
-{
-  for (size_t i = 0; i < 4; i++) {
-    koruza_compute_accelerometer_statistics_item(&status.accelerometer.x[i]);
-    koruza_compute_accelerometer_statistics_item(&status.accelerometer.y[i]);
-    koruza_compute_accelerometer_statistics_item(&status.accelerometer.z[i]);
-  }
-}
-
 void koruza_set_alignment(struct koruza_alignment *alignment)
 {
   memcpy(&status.alignment, alignment, sizeof(struct koruza_alignment));
+  koruza_status_changed(KORUZA_SECTION_ALIGNMENT);
+
+  if (status.alignment.state != 0) {
+    koruza_poll_burst();
+  }
 }
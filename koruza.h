@@ -22,31 +22,23 @@
 #include <uci.h>
 #include <libubus.h>
 
+#include "statistics.h"
+
 // Survey resolution (number of bins in each direction).
 #define SURVEY_BINS 100
 // Survey coverage (motor coordinate distance from center to edge of survey).
 #define SURVEY_COVERAGE 10000
 
-// Accelerometer statistics window size (in number of samples).
-#define ACCELEROMETER_STATISTICS_BUFFER_SIZE 120
-
 // Number of extra variables for alignment algorithms.
 #define ALIGNMENT_VARIABLE_COUNT 4
 
-struct accelerometer_statistics_item {
-  float sum;
-  float average;
-  float variance;
-  float maximum;
-
-  float buffer[ACCELEROMETER_STATISTICS_BUFFER_SIZE];
-  float buffer_max[ACCELEROMETER_STATISTICS_BUFFER_SIZE];
-  size_t samples;
-  size_t index;
-};
+// Maximum number of queued motor moves.
+#define KORUZA_MOVE_QUEUE_LENGTH 32
 
 struct koruza_motor_status {
   uint8_t connected;
+  // Serial link rate (in baud).
+  uint32_t baudrate;
 
   int32_t x;
   int32_t y;
@@ -57,8 +49,53 @@ struct koruza_motor_status {
 
   int32_t encoder_x;
   int32_t encoder_y;
+
+  // Identifier of the move currently in progress (zero when idle).
+  uint32_t move_id;
+  // Number of moves waiting in the queue.
+  uint16_t move_queue;
+  // Number of moves that were replaced by a newer target before being sent.
+  uint32_t move_collapsed;
+};
+
+/**
+ * Motor move completion results.
+ */
+enum koruza_move_result {
+  KORUZA_MOVE_PENDING = 0,
+  KORUZA_MOVE_COMPLETED,
+  KORUZA_MOVE_STALLED,
+  KORUZA_MOVE_CANCELLED,
+  KORUZA_MOVE_COLLAPSED,
+};
+
+/**
+ * Queued motor move.
+ */
+struct koruza_move {
+  uint32_t id;
+  int32_t x;
+  int32_t y;
+  int32_t z;
+
+  enum koruza_move_result result;
+  // Number of consecutive status reports without motor activity.
+  uint16_t stable_reports;
+  // Whether this move supersedes the one in progress.
+  uint8_t supersede;
+  // Whether the MCU has seen the move command.
+  uint8_t accepted;
+  // Time when the move command was sent (in microseconds).
+  uint64_t sent_at;
+
+  struct list_head list;
 };
 
+/**
+ * Handler for finished motor moves.
+ */
+typedef void (*koruza_move_handler)(const struct koruza_move *move);
+
 struct koruza_camera_calibration {
   uint16_t port;
   char *path;
@@ -86,6 +123,8 @@ struct koruza_sfp_status {
 
 struct koruza_accelerometer_status {
   uint8_t connected;
+  // Serial link rate (in baud).
+  uint32_t baudrate;
 
   struct accelerometer_statistics_item x[4];
   struct accelerometer_statistics_item y[4];
@@ -97,7 +136,23 @@ struct koruza_alignment {
   uint32_t variables[ALIGNMENT_VARIABLE_COUNT];
 };
 
+/**
+ * Independently updated sections of the unit status.
+ */
+enum koruza_status_section {
+  KORUZA_SECTION_GENERAL,
+  KORUZA_SECTION_MOTORS,
+  KORUZA_SECTION_ACCELEROMETER,
+  KORUZA_SECTION_CAMERA,
+  KORUZA_SECTION_SFP,
+  KORUZA_SECTION_ALIGNMENT,
+  __KORUZA_SECTION_MAX,
+};
+
 struct koruza_status {
+  // Per-section generation counters, incremented on each change.
+  uint32_t generation[__KORUZA_SECTION_MAX];
+
   char *serial_number;
 
   uint8_t gpio_reset;
@@ -121,7 +176,8 @@ struct koruza_survey {
 
 int koruza_init(struct uci_context *uci, struct ubus_context *ubus);
 int koruza_restore_motor();
-int koruza_move_motor(int32_t x, int32_t y, int32_t z);
+int koruza_move_motor(int32_t x, int32_t y, int32_t z, uint8_t queue, uint32_t *move_id);
+void koruza_set_move_handler(koruza_move_handler handler);
 int koruza_homing();
 int koruza_reboot();
 int koruza_firmware_upgrade();
@@ -135,8 +191,6 @@ const struct koruza_status *koruza_get_status();
 void koruza_survey_reset();
 const struct koruza_survey *koruza_get_survey();
 
-void koruza_compute_accelerometer_statistics();
-
 void koruza_set_alignment(struct koruza_alignment *alignment);
 
 #endif
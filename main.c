@@ -30,7 +30,12 @@
 #include "koruza.h"
 #include "ubus.h"
 #include "network.h"
+#include "alignment.h"
+#include "firmware.h"
 #include "upgrade.h"
+#include "history.h"
+#include "memory.h"
+#include "configuration.h"
 
 // Global ubus connection context.
 static struct ubus_context *ubus;
@@ -88,6 +93,18 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  // Configure memory budgets (in bytes), keeping the defaults for invalid values.
+  for (memory_component_t i = 0; i < __MEMORY_COMPONENT_MAX; i++) {
+    char location[64];
+    snprintf(location, sizeof(location), "koruza.@memory[0].%s", memory_component_name(i));
+    int limit = uci_get_int(uci, location, -1);
+    if (limit > 0) {
+      memory_set_limit(i, limit);
+    } else if (limit != -1) {
+      syslog(LOG_WARNING, "Invalid memory budget for '%s', using the default.", memory_component_name(i));
+    }
+  }
+
   if (serial_init(uci) != 0) {
     syslog(LOG_ERR, "Failed to initialize serial device!");
     return -1;
@@ -98,7 +115,12 @@ int main(int argc, char **argv)
     return -1;
   }
 
-  if (ubus_init(ubus) != 0) {
+  if (history_init(uci) != 0) {
+    syslog(LOG_ERR, "Failed to initialize history store!");
+    return -1;
+  }
+
+  if (ubus_init(ubus, uci) != 0) {
     syslog(LOG_ERR, "Failed to initialize ubus!");
     return -1;
   }
@@ -108,6 +130,16 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  if (alignment_init(uci) != 0) {
+    syslog(LOG_ERR, "Failed to initialize alignment.");
+    return -1;
+  }
+
+  if (firmware_init(uci) != 0) {
+    syslog(LOG_ERR, "Failed to initialize firmware flasher.");
+    return -1;
+  }
+
   if (upgrade_init(uci) != 0) {
     syslog(LOG_ERR, "Failed to initialize upgrade service!");
     return -1;
@@ -0,0 +1,84 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "memory.h"
+
+#include <stdint.h>
+
+static const char *memory_component_names[__MEMORY_COMPONENT_MAX] = {
+  [MEMORY_PARSER] = "parser",
+  [MEMORY_MESSAGE] = "message",
+  [MEMORY_SERIAL_TX_MOTORS] = "serial_tx_motors",
+  [MEMORY_SERIAL_TX_ACCELEROMETER] = "serial_tx_accelerometer",
+  [MEMORY_MOVES] = "moves",
+};
+
+static struct memory_usage usage[__MEMORY_COMPONENT_MAX] = {
+  [MEMORY_PARSER] = { .limit = 65536 },
+  [MEMORY_MESSAGE] = { .limit = 65536 },
+  // Serial devices have separate budgets, so that a backlog on one cannot
+  // starve the other.
+  [MEMORY_SERIAL_TX_MOTORS] = { .limit = 16384 },
+  [MEMORY_SERIAL_TX_ACCELEROMETER] = { .limit = 16384 },
+};
+
+int memory_reserve(memory_component_t component, size_t size)
+{
+  struct memory_usage *u = &usage[component];
+  if (u->limit && u->current + size > u->limit) {
+    return -1;
+  }
+
+  u->current += size;
+  if (u->current > u->peak) {
+    u->peak = u->current;
+  }
+
+  return 0;
+}
+
+void memory_release(memory_component_t component, size_t size)
+{
+  struct memory_usage *u = &usage[component];
+  u->current = size > u->current ? 0 : u->current - size;
+}
+
+size_t memory_available(memory_component_t component)
+{
+  const struct memory_usage *u = &usage[component];
+  if (!u->limit) {
+    return SIZE_MAX;
+  }
+
+  return u->current > u->limit ? 0 : u->limit - u->current;
+}
+
+void memory_set_limit(memory_component_t component, size_t limit)
+{
+  usage[component].limit = limit;
+}
+
+const struct memory_usage *memory_get_usage(memory_component_t component)
+{
+  return &usage[component];
+}
+
+const char *memory_component_name(memory_component_t component)
+{
+  return memory_component_names[component];
+}
@@ -0,0 +1,96 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_MEMORY_H
+#define KORUZA_DRIVER_MEMORY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Components with an accounted heap budget.
+ */
+typedef enum {
+  MEMORY_PARSER,
+  MEMORY_MESSAGE,
+  MEMORY_SERIAL_TX_MOTORS,
+  MEMORY_SERIAL_TX_ACCELEROMETER,
+  MEMORY_MOVES,
+  __MEMORY_COMPONENT_MAX,
+} memory_component_t;
+
+/**
+ * Heap usage of a component (in bytes).
+ */
+struct memory_usage {
+  size_t current;
+  size_t peak;
+  // Maximum allowed usage (zero means unlimited).
+  size_t limit;
+};
+
+/**
+ * Reserves part of the budget of a component before allocating memory.
+ *
+ * @param component Component to reserve the memory for
+ * @param size Number of bytes to reserve
+ * @return 0 on success, -1 when the reservation would exceed the limit
+ */
+int memory_reserve(memory_component_t component, size_t size);
+
+/**
+ * Returns previously reserved memory to the budget of a component.
+ *
+ * @param component Component to release the memory for
+ * @param size Number of bytes to release
+ */
+void memory_release(memory_component_t component, size_t size);
+
+/**
+ * Returns the number of bytes that may still be reserved by a component.
+ *
+ * @param component Component to check
+ * @return Number of available bytes (SIZE_MAX when unlimited)
+ */
+size_t memory_available(memory_component_t component);
+
+/**
+ * Configures the budget of a component.
+ *
+ * @param component Component to configure
+ * @param limit Maximum allowed usage in bytes (zero means unlimited)
+ */
+void memory_set_limit(memory_component_t component, size_t limit);
+
+/**
+ * Returns heap usage of a component.
+ *
+ * @param component Component to return the usage for
+ * @return Usage structure
+ */
+const struct memory_usage *memory_get_usage(memory_component_t component);
+
+/**
+ * Returns the name of a component.
+ *
+ * @param component Component to return the name for
+ * @return Component name
+ */
+const char *memory_component_name(memory_component_t component);
+
+#endif
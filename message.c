@@ -17,6 +17,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "message.h"
+#include "memory.h"
 #include "crc32.h"
 
 #include <string.h>
@@ -37,6 +38,7 @@ message_result_t message_init(message_t *message)
 void message_free(message_t *message)
 {
   for (size_t i = 0; i < message->length; i++) {
+    memory_release(MEMORY_MESSAGE, message->tlv[i].length);
     free(message->tlv[i].value);
   }
 
@@ -76,8 +78,14 @@ message_result_t message_parse(message_t *message, const uint8_t *data, size_t l
     }
 
     // Parse value.
+    if (memory_reserve(MEMORY_MESSAGE, message->tlv[i].length) != 0) {
+      message_free(message);
+      return MESSAGE_ERROR_OUT_OF_MEMORY;
+    }
+
     message->tlv[i].value = (uint8_t*) malloc(message->tlv[i].length);
     if (!message->tlv[i].value) {
+      memory_release(MEMORY_MESSAGE, message->tlv[i].length);
       message_free(message);
       return MESSAGE_ERROR_OUT_OF_MEMORY;
     }
@@ -87,8 +95,19 @@ message_result_t message_parse(message_t *message, const uint8_t *data, size_t l
 
     // If this is a checksum TLV, do checksum verification immediately.
     if (message->tlv[i].type == TLV_CHECKSUM) {
+      if (message->tlv[i].length != sizeof(uint32_t)) {
+        // Checksum TLV is not yet part of the message.
+        memory_release(MEMORY_MESSAGE, message->tlv[i].length);
+        free(message->tlv[i].value);
+        message_free(message);
+        return MESSAGE_ERROR_PARSE_ERROR;
+      }
+
       uint32_t checksum = message_checksum(message);
-      if (memcmp(&checksum, message->tlv[i].value, sizeof(uint32_t) != 0)) {
+      if (memcmp(&checksum, message->tlv[i].value, sizeof(uint32_t)) != 0) {
+        // Checksum TLV is not yet part of the message.
+        memory_release(MEMORY_MESSAGE, message->tlv[i].length);
+        free(message->tlv[i].value);
         message_free(message);
         return MESSAGE_ERROR_CHECKSUM_MISMATCH;
       }
@@ -107,8 +126,13 @@ message_result_t message_tlv_add(message_t *message, uint8_t type, uint16_t leng
   }
 
   size_t i = message->length;
+  if (memory_reserve(MEMORY_MESSAGE, length) != 0) {
+    return MESSAGE_ERROR_OUT_OF_MEMORY;
+  }
+
   message->tlv[i].value = (uint8_t*) malloc(length);
   if (!message->tlv[i].value) {
+    memory_release(MEMORY_MESSAGE, length);
     return MESSAGE_ERROR_OUT_OF_MEMORY;
   }
 
@@ -191,6 +215,59 @@ message_result_t message_tlv_add_sfp_calibration(message_t *message, const tlv_s
   return message_tlv_add(message, TLV_SFP_CALIBRATION, sizeof(tlv_sfp_calibration_t), (uint8_t*) &tmp);
 }
 
+message_result_t message_tlv_add_sequence_number(message_t *message, uint32_t sequence)
+{
+  sequence = htonl(sequence);
+  return message_tlv_add(message, TLV_SEQUENCE_NUMBER, sizeof(uint32_t), (uint8_t*) &sequence);
+}
+
+message_result_t message_tlv_add_baudrate(message_t *message, uint32_t baudrate)
+{
+  baudrate = htonl(baudrate);
+  return message_tlv_add(message, TLV_BAUDRATE, sizeof(uint32_t), (uint8_t*) &baudrate);
+}
+
+message_result_t message_tlv_add_net_hello(message_t *message, const tlv_net_hello_t *hello)
+{
+  return message_tlv_add(message, TLV_NET_HELLO, sizeof(tlv_net_hello_t), (uint8_t*) hello);
+}
+
+message_result_t message_tlv_add_net_alignment(message_t *message, const tlv_net_alignment_t *alignment)
+{
+  tlv_net_alignment_t tmp;
+  tmp.state = htonl(alignment->state);
+  return message_tlv_add(message, TLV_NET_ALIGNMENT, sizeof(tlv_net_alignment_t), (uint8_t*) &tmp);
+}
+
+message_result_t message_tlv_add_firmware_info(message_t *message, const tlv_firmware_info_t *info)
+{
+  tlv_firmware_info_t tmp;
+  tmp.size = htonl(info->size);
+  tmp.crc = htonl(info->crc);
+  tmp.block_size = htonl(info->block_size);
+  return message_tlv_add(message, TLV_FIRMWARE_INFO, sizeof(tlv_firmware_info_t), (uint8_t*) &tmp);
+}
+
+message_result_t message_tlv_add_firmware_block(message_t *message, uint32_t offset, const uint8_t *data,
+                                                uint16_t length)
+{
+  assert(length <= TLV_FIRMWARE_BLOCK_MAX);
+
+  // Block is serialized as offset and CRC followed by the data.
+  uint8_t buffer[2 * sizeof(uint32_t) + TLV_FIRMWARE_BLOCK_MAX];
+  uint32_t header[2] = { htonl(offset), htonl(crc32(0, data, length)) };
+  memcpy(buffer, header, sizeof(header));
+  memcpy(buffer + sizeof(header), data, length);
+  return message_tlv_add(message, TLV_FIRMWARE_BLOCK, sizeof(header) + length, buffer);
+}
+
+message_result_t message_tlv_add_firmware_ack(message_t *message, const tlv_firmware_ack_t *ack)
+{
+  tlv_firmware_ack_t tmp;
+  tmp.offset = htonl(ack->offset);
+  return message_tlv_add(message, TLV_FIRMWARE_ACK, sizeof(tlv_firmware_ack_t), (uint8_t*) &tmp);
+}
+
 message_result_t message_tlv_add_checksum(message_t *message)
 {
   uint32_t checksum = message_checksum(message);
@@ -201,7 +278,10 @@ message_result_t message_tlv_get(const message_t *message, uint8_t type, uint8_t
 {
   for (size_t i = 0; i < message->length; i++) {
     if (message->tlv[i].type == type) {
-      assert(message->tlv[i].length <= length);
+      if (message->tlv[i].length > length) {
+        return MESSAGE_ERROR_PARSE_ERROR;
+      }
+
       memcpy(destination, message->tlv[i].value, message->tlv[i].length);
       return MESSAGE_SUCCESS;
     }
@@ -321,6 +401,107 @@ message_result_t message_tlv_get_sfp_calibration(const message_t *message, tlv_s
   return MESSAGE_SUCCESS;
 }
 
+message_result_t message_tlv_get_sequence_number(const message_t *message, uint32_t *sequence)
+{
+  message_result_t result = message_tlv_get(message, TLV_SEQUENCE_NUMBER, (uint8_t*) sequence, sizeof(uint32_t));
+  if (result != MESSAGE_SUCCESS) {
+    return result;
+  }
+
+  *sequence = ntohl(*sequence);
+
+  return MESSAGE_SUCCESS;
+}
+
+message_result_t message_tlv_get_baudrate(const message_t *message, uint32_t *baudrate)
+{
+  message_result_t result = message_tlv_get(message, TLV_BAUDRATE, (uint8_t*) baudrate, sizeof(uint32_t));
+  if (result != MESSAGE_SUCCESS) {
+    return result;
+  }
+
+  *baudrate = ntohl(*baudrate);
+
+  return MESSAGE_SUCCESS;
+}
+
+message_result_t message_tlv_get_net_hello(const message_t *message, tlv_net_hello_t *hello)
+{
+  message_result_t result = message_tlv_get(message, TLV_NET_HELLO, (uint8_t*) hello, sizeof(tlv_net_hello_t));
+  if (result != MESSAGE_SUCCESS) {
+    return result;
+  }
+
+  // Identifier must always be terminated.
+  hello->id[TLV_NET_HELLO_ID_LENGTH - 1] = 0;
+
+  return MESSAGE_SUCCESS;
+}
+
+message_result_t message_tlv_get_net_alignment(const message_t *message, tlv_net_alignment_t *alignment)
+{
+  message_result_t result = message_tlv_get(message, TLV_NET_ALIGNMENT, (uint8_t*) alignment,
+                                            sizeof(tlv_net_alignment_t));
+  if (result != MESSAGE_SUCCESS) {
+    return result;
+  }
+
+  alignment->state = ntohl(alignment->state);
+
+  return MESSAGE_SUCCESS;
+}
+
+message_result_t message_tlv_get_firmware_info(const message_t *message, tlv_firmware_info_t *info)
+{
+  message_result_t result = message_tlv_get(message, TLV_FIRMWARE_INFO, (uint8_t*) info,
+                                            sizeof(tlv_firmware_info_t));
+  if (result != MESSAGE_SUCCESS) {
+    return result;
+  }
+
+  info->size = ntohl(info->size);
+  info->crc = ntohl(info->crc);
+  info->block_size = ntohl(info->block_size);
+
+  return MESSAGE_SUCCESS;
+}
+
+message_result_t message_tlv_get_firmware_block(const message_t *message, tlv_firmware_block_t *block)
+{
+  uint32_t header[2];
+  for (size_t i = 0; i < message->length; i++) {
+    const tlv_t *tlv = &message->tlv[i];
+    if (tlv->type != TLV_FIRMWARE_BLOCK) {
+      continue;
+    }
+
+    if (tlv->length < sizeof(header) || tlv->length - sizeof(header) > TLV_FIRMWARE_BLOCK_MAX) {
+      return MESSAGE_ERROR_PARSE_ERROR;
+    }
+
+    memcpy(header, tlv->value, sizeof(header));
+    block->offset = ntohl(header[0]);
+    block->crc = ntohl(header[1]);
+    block->length = tlv->length - sizeof(header);
+    memcpy(block->data, tlv->value + sizeof(header), block->length);
+    return MESSAGE_SUCCESS;
+  }
+
+  return MESSAGE_ERROR_TLV_NOT_FOUND;
+}
+
+message_result_t message_tlv_get_firmware_ack(const message_t *message, tlv_firmware_ack_t *ack)
+{
+  message_result_t result = message_tlv_get(message, TLV_FIRMWARE_ACK, (uint8_t*) ack, sizeof(tlv_firmware_ack_t));
+  if (result != MESSAGE_SUCCESS) {
+    return result;
+  }
+
+  ack->offset = ntohl(ack->offset);
+
+  return MESSAGE_SUCCESS;
+}
+
 size_t message_serialized_size(const message_t *message)
 {
   size_t size = 0;
@@ -39,10 +39,16 @@ typedef enum {
   TLV_POWER_READING = 8,
   TLV_ENCODER_VALUE = 9,
   TLV_VIBRATION_VALUE = 10,
+  TLV_SEQUENCE_NUMBER = 11,
+  TLV_BAUDRATE = 12,
+  TLV_FIRMWARE_INFO = 13,
+  TLV_FIRMWARE_BLOCK = 14,
+  TLV_FIRMWARE_ACK = 15,
 
   // Network communication TLVs.
   TLV_NET_HELLO = 100,
   TLV_NET_SIGNATURE = 101,
+  TLV_NET_ALIGNMENT = 102,
 } tlv_type_t;
 
 /**
@@ -56,6 +62,10 @@ typedef enum {
   COMMAND_FIRMWARE_UPGRADE = 5,
   COMMAND_HOMING = 6,
   COMMAND_RESTORE_MOTOR = 7,
+  COMMAND_SET_BAUDRATE = 8,
+  COMMAND_FIRMWARE_START = 9,
+  COMMAND_FIRMWARE_BLOCK = 10,
+  COMMAND_FIRMWARE_FINISH = 11,
 } tlv_command_t;
 
 /**
@@ -64,6 +74,8 @@ typedef enum {
 typedef enum {
   REPLY_STATUS_REPORT = 1,
   REPLY_ERROR_REPORT = 2,
+  REPLY_BAUDRATE_ACK = 3,
+  REPLY_FIRMWARE_ACK = 4,
 } tlv_reply_t;
 
 /**
@@ -113,6 +125,60 @@ typedef struct {
   uint32_t offset_y;
 } tlv_sfp_calibration_t;
 
+/**
+ * Contents of the firmware info TLV, sent with the firmware start command.
+ */
+typedef struct {
+  // Image size (in bytes).
+  uint32_t size;
+  // CRC32 of the whole image.
+  uint32_t crc;
+  // Size of blocks that will follow (in bytes).
+  uint32_t block_size;
+} tlv_firmware_info_t;
+
+// Maximum payload of a single firmware block TLV.
+#define TLV_FIRMWARE_BLOCK_MAX 1024
+
+/**
+ * Contents of the firmware block TLV. Only the first length bytes of the
+ * data are transmitted.
+ */
+typedef struct {
+  // Offset of the block in the image.
+  uint32_t offset;
+  // CRC32 of the block data.
+  uint32_t crc;
+  uint16_t length;
+  uint8_t data[TLV_FIRMWARE_BLOCK_MAX];
+} tlv_firmware_block_t;
+
+/**
+ * Contents of the firmware ack TLV.
+ */
+typedef struct {
+  // Number of contiguous image bytes written and verified so far.
+  uint32_t offset;
+} tlv_firmware_ack_t;
+
+// Maximum length of the unit identifier in the hello TLV.
+#define TLV_NET_HELLO_ID_LENGTH 32
+
+/**
+ * Contents of the network hello TLV.
+ */
+typedef struct {
+  uint8_t version;
+  char id[TLV_NET_HELLO_ID_LENGTH];
+} tlv_net_hello_t;
+
+/**
+ * Contents of the network alignment TLV.
+ */
+typedef struct {
+  uint32_t state;
+} tlv_net_alignment_t;
+
 /**
  * Message operations result codes.
  */
@@ -261,6 +327,74 @@ message_result_t message_tlv_add_vibration_value(message_t *message, const tlv_v
  */
 message_result_t message_tlv_add_sfp_calibration(message_t *message, const tlv_sfp_calibration_t *calibration);
 
+/**
+ * Adds a sequence number TLV to a protocol message. Devices that support it
+ * echo the sequence number back in the corresponding reply.
+ *
+ * @param message Destination message instance to add the TLV to
+ * @param sequence Sequence number
+ * @return Operation result code
+ */
+message_result_t message_tlv_add_sequence_number(message_t *message, uint32_t sequence);
+
+/**
+ * Adds a baudrate TLV to a protocol message.
+ *
+ * @param message Destination message instance to add the TLV to
+ * @param baudrate Serial link rate (in baud)
+ * @return Operation result code
+ */
+message_result_t message_tlv_add_baudrate(message_t *message, uint32_t baudrate);
+
+/**
+ * Adds a network hello TLV to a protocol message.
+ *
+ * @param message Destination message instance to add the TLV to
+ * @param hello Hello structure
+ * @return Operation result code
+ */
+message_result_t message_tlv_add_net_hello(message_t *message, const tlv_net_hello_t *hello);
+
+/**
+ * Adds a network alignment TLV to a protocol message.
+ *
+ * @param message Destination message instance to add the TLV to
+ * @param alignment Alignment structure
+ * @return Operation result code
+ */
+message_result_t message_tlv_add_net_alignment(message_t *message, const tlv_net_alignment_t *alignment);
+
+/**
+ * Adds a firmware info TLV to a protocol message.
+ *
+ * @param message Destination message instance to add the TLV to
+ * @param info Firmware info structure
+ * @return Operation result code
+ */
+message_result_t message_tlv_add_firmware_info(message_t *message, const tlv_firmware_info_t *info);
+
+/**
+ * Adds a firmware block TLV to a protocol message. The block CRC is computed
+ * over the given data.
+ *
+ * @param message Destination message instance to add the TLV to
+ * @param offset Offset of the block in the image
+ * @param data Block data
+ * @param length Length of block data (at most TLV_FIRMWARE_BLOCK_MAX)
+ * @return Operation result code
+ */
+message_result_t message_tlv_add_firmware_block(message_t *message, uint32_t offset, const uint8_t *data,
+                                                uint16_t length);
+
+/**
+ * Adds a firmware ack TLV to a protocol message.
+ *
+ * @param message Destination message instance to add the TLV to
+ * @param ack Firmware ack structure
+ * @return Operation result code
+ */
+message_result_t message_tlv_add_firmware_ack(message_t *message, const tlv_firmware_ack_t *ack);
+
 /**
  * Adds a checksum TLV to a protocol message. The checksum value is automatically
  * computed over all the TLVs currently contained in the message.
@@ -353,6 +487,70 @@ message_result_t message_tlv_get_vibration_value(const message_t *message, tlv_v
  */
 message_result_t message_tlv_get_sfp_calibration(const message_t *message, tlv_sfp_calibration_t *calibration);
 
+/**
+ * Find the first sequence number TLV in a message and copies it.
+ *
+ * @param message Message instance to get the TLV from
+ * @param sequence Destination sequence number variable
+ * @return Operation result code
+ */
+message_result_t message_tlv_get_sequence_number(const message_t *message, uint32_t *sequence);
+
+/**
+ * Find the first baudrate TLV in a message and copies it.
+ *
+ * @param message Message instance to get the TLV from
+ * @param baudrate Destination baudrate variable
+ * @return Operation result code
+ */
+message_result_t message_tlv_get_baudrate(const message_t *message, uint32_t *baudrate);
+
+/**
+ * Find the first network hello TLV in a message and copies it.
+ *
+ * @param message Message instance to get the TLV from
+ * @param hello Destination hello variable
+ * @return Operation result code
+ */
+message_result_t message_tlv_get_net_hello(const message_t *message, tlv_net_hello_t *hello);
+
+/**
+ * Find the first network alignment TLV in a message and copies it.
+ *
+ * @param message Message instance to get the TLV from
+ * @param alignment Destination alignment variable
+ * @return Operation result code
+ */
+message_result_t message_tlv_get_net_alignment(const message_t *message, tlv_net_alignment_t *alignment);
+
+/**
+ * Find the first firmware info TLV in a message and copies it.
+ *
+ * @param message Message instance to get the TLV from
+ * @param info Destination firmware info variable
+ * @return Operation result code
+ */
+message_result_t message_tlv_get_firmware_info(const message_t *message, tlv_firmware_info_t *info);
+
+/**
+ * Find the first firmware block TLV in a message and copies it. The block CRC
+ * is not verified.
+ *
+ * @param message Message instance to get the TLV from
+ * @param block Destination firmware block variable
+ * @return Operation result code
+ */
+message_result_t message_tlv_get_firmware_block(const message_t *message, tlv_firmware_block_t *block);
+
+/**
+ * Find the first firmware ack TLV in a message and copies it.
+ *
+ * @param message Message instance to get the TLV from
+ * @param ack Destination firmware ack variable
+ * @return Operation result code
+ */
+message_result_t message_tlv_get_firmware_ack(const message_t *message, tlv_firmware_ack_t *ack);
+
 /**
  * Returns the size a message would take in its serialized form.
  *
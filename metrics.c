@@ -0,0 +1,159 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "metrics.h"
+
+#ifdef KORUZA_METRICS
+
+#include <string.h>
+
+static const char *metrics_histogram_names[__METRICS_HISTOGRAM_MAX] = {
+  [METRICS_SERIAL_FD_HANDLER] = "serial_fd_handler",
+  [METRICS_MESSAGE_PARSE] = "message_parse",
+  [METRICS_FRAME_MESSAGE] = "frame_message",
+  [METRICS_SFP_GET_MODULES] = "sfp_get_modules",
+  [METRICS_SFP_GET_DIAGNOSTICS] = "sfp_get_diagnostics",
+  [METRICS_SFP_GET_VENDOR_DATA] = "sfp_get_vendor_specific_data",
+  [METRICS_LED_RENDER] = "ws2811_render",
+  [METRICS_UCI_COMMIT] = "uci_commit",
+  [METRICS_TIMER_STATUS] = "timer_status",
+  [METRICS_TIMER_ACCELEROMETER_STATUS] = "timer_accelerometer_status",
+  [METRICS_TIMER_SFP_STATUS] = "timer_sfp_status",
+  [METRICS_TIMER_SURVEY] = "timer_survey",
+  [METRICS_TIMER_WAIT_REPLY] = "timer_wait_reply",
+  [METRICS_TIMER_NOTIFY] = "timer_notify",
+  [METRICS_TIMER_HISTORY] = "timer_history",
+  [METRICS_TIMER_ANNOUNCE] = "timer_announce",
+  [METRICS_NETLINK_HANDLER] = "netlink_handler",
+  [METRICS_MCU_ROUND_TRIP] = "mcu_round_trip",
+  [METRICS_ACCELEROMETER_ROUND_TRIP] = "accelerometer_round_trip",
+  [METRICS_SERIAL_TX_QUEUE_TIME] = "serial_tx_queue_time",
+};
+
+static const char *metrics_counter_names[__METRICS_COUNTER_MAX] = {
+  [METRICS_SERIAL_BYTES_READ] = "serial_bytes_read",
+  [METRICS_SERIAL_BYTES_WRITTEN] = "serial_bytes_written",
+  [METRICS_MESSAGES_PARSED] = "messages_parsed",
+  [METRICS_MESSAGE_PARSE_ERRORS] = "message_parse_errors",
+  [METRICS_REQUEST_TIMEOUTS] = "request_timeouts",
+  [METRICS_REPLIES_DROPPED] = "replies_dropped",
+  [METRICS_NETWORK_DATAGRAMS_RECEIVED] = "network_datagrams_received",
+  [METRICS_NETWORK_DATAGRAMS_SENT] = "network_datagrams_sent",
+  [METRICS_NETWORK_AUTH_FAILURES] = "network_auth_failures",
+  [METRICS_NETWORK_REPLAYS] = "network_replays",
+};
+
+static struct metrics_histogram histograms[__METRICS_HISTOGRAM_MAX];
+static uint64_t counters[__METRICS_COUNTER_MAX];
+
+uint32_t metrics_bucket_lower_bound(size_t bucket);
+
+void metrics_record(metrics_histogram_t histogram, uint64_t value)
+{
+  struct metrics_histogram *h = &histograms[histogram];
+  uint32_t v = value > UINT32_MAX ? UINT32_MAX : (uint32_t) value;
+
+  // Small values map directly, larger ones keep SUB_BITS of precision.
+  size_t bucket;
+  if (v < METRICS_HISTOGRAM_SUB_BUCKETS) {
+    bucket = v;
+  } else {
+    size_t shift = (31 - __builtin_clz(v)) - METRICS_HISTOGRAM_SUB_BITS;
+    bucket = (shift + 1) * METRICS_HISTOGRAM_SUB_BUCKETS + ((v >> shift) & (METRICS_HISTOGRAM_SUB_BUCKETS - 1));
+  }
+
+  h->buckets[bucket]++;
+  if (!h->count || v < h->min) {
+    h->min = v;
+  }
+  if (v > h->max) {
+    h->max = v;
+  }
+  h->count++;
+  h->sum += v;
+}
+
+void metrics_count(metrics_counter_t counter, uint64_t value)
+{
+  counters[counter] += value;
+}
+
+void metrics_reset()
+{
+  memset(histograms, 0, sizeof(histograms));
+  memset(counters, 0, sizeof(counters));
+}
+
+const struct metrics_histogram *metrics_get_histogram(metrics_histogram_t histogram)
+{
+  return &histograms[histogram];
+}
+
+uint64_t metrics_get_counter(metrics_counter_t counter)
+{
+  return counters[counter];
+}
+
+uint32_t metrics_bucket_lower_bound(size_t bucket)
+{
+  if (bucket < METRICS_HISTOGRAM_SUB_BUCKETS) {
+    return bucket;
+  }
+
+  size_t shift = bucket / METRICS_HISTOGRAM_SUB_BUCKETS - 1;
+  return (uint32_t) (METRICS_HISTOGRAM_SUB_BUCKETS + bucket % METRICS_HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+uint32_t metrics_histogram_percentile(const struct metrics_histogram *histogram, float percentile)
+{
+  if (!histogram->count) {
+    return 0;
+  }
+
+  uint64_t target = (uint64_t) ((double) histogram->count * percentile / 100.0);
+  if (target < 1) {
+    target = 1;
+  }
+
+  uint64_t total = 0;
+  for (size_t bucket = 0; bucket < METRICS_HISTOGRAM_BUCKETS; bucket++) {
+    total += histogram->buckets[bucket];
+    if (total >= target) {
+      if (bucket == METRICS_HISTOGRAM_BUCKETS - 1) {
+        return histogram->max;
+      }
+
+      uint32_t upper = metrics_bucket_lower_bound(bucket + 1) - 1;
+      return upper < histogram->max ? upper : histogram->max;
+    }
+  }
+
+  return histogram->max;
+}
+
+const char *metrics_histogram_name(metrics_histogram_t histogram)
+{
+  return metrics_histogram_names[histogram];
+}
+
+const char *metrics_counter_name(metrics_counter_t counter)
+{
+  return metrics_counter_names[counter];
+}
+
+#endif
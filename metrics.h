@@ -0,0 +1,161 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_METRICS_H
+#define KORUZA_DRIVER_METRICS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "clock.h"
+
+// Number of sub-buckets per power of two (as bits).
+#define METRICS_HISTOGRAM_SUB_BITS 3
+#define METRICS_HISTOGRAM_SUB_BUCKETS (1 << METRICS_HISTOGRAM_SUB_BITS)
+// Total number of histogram buckets (covers the full 32-bit range).
+#define METRICS_HISTOGRAM_BUCKETS ((32 - METRICS_HISTOGRAM_SUB_BITS + 1) * METRICS_HISTOGRAM_SUB_BUCKETS)
+
+/**
+ * Instrumented hot paths (latencies are measured in microseconds).
+ */
+typedef enum {
+  METRICS_SERIAL_FD_HANDLER,
+  METRICS_MESSAGE_PARSE,
+  METRICS_FRAME_MESSAGE,
+  METRICS_SFP_GET_MODULES,
+  METRICS_SFP_GET_DIAGNOSTICS,
+  METRICS_SFP_GET_VENDOR_DATA,
+  METRICS_LED_RENDER,
+  METRICS_UCI_COMMIT,
+  METRICS_TIMER_STATUS,
+  METRICS_TIMER_ACCELEROMETER_STATUS,
+  METRICS_TIMER_SFP_STATUS,
+  METRICS_TIMER_SURVEY,
+  METRICS_TIMER_WAIT_REPLY,
+  METRICS_TIMER_NOTIFY,
+  METRICS_TIMER_HISTORY,
+  METRICS_TIMER_ANNOUNCE,
+  METRICS_NETLINK_HANDLER,
+  METRICS_MCU_ROUND_TRIP,
+  METRICS_ACCELEROMETER_ROUND_TRIP,
+  METRICS_SERIAL_TX_QUEUE_TIME,
+  __METRICS_HISTOGRAM_MAX,
+} metrics_histogram_t;
+
+/**
+ * Event counters.
+ */
+typedef enum {
+  METRICS_SERIAL_BYTES_READ,
+  METRICS_SERIAL_BYTES_WRITTEN,
+  METRICS_MESSAGES_PARSED,
+  METRICS_MESSAGE_PARSE_ERRORS,
+  METRICS_REQUEST_TIMEOUTS,
+  METRICS_REPLIES_DROPPED,
+  METRICS_NETWORK_DATAGRAMS_RECEIVED,
+  METRICS_NETWORK_DATAGRAMS_SENT,
+  METRICS_NETWORK_AUTH_FAILURES,
+  METRICS_NETWORK_REPLAYS,
+  __METRICS_COUNTER_MAX,
+} metrics_counter_t;
+
+/**
+ * Log-linear latency histogram.
+ */
+struct metrics_histogram {
+  uint64_t count;
+  uint64_t sum;
+  uint32_t min;
+  uint32_t max;
+
+  uint32_t buckets[METRICS_HISTOGRAM_BUCKETS];
+};
+
+#ifdef KORUZA_METRICS
+
+#define METRICS_TIMER_START(name) uint64_t __metrics_start_##name = clock_monotonic_us()
+#define METRICS_TIMER_STOP(name, histogram) metrics_record((histogram), clock_monotonic_us() - __metrics_start_##name)
+#define METRICS_RECORD(histogram, value) metrics_record((histogram), (value))
+#define METRICS_COUNT(counter, value) metrics_count((counter), (value))
+
+/**
+ * Records a value into a histogram.
+ *
+ * @param histogram Histogram identifier
+ * @param value Value to record
+ */
+void metrics_record(metrics_histogram_t histogram, uint64_t value);
+
+/**
+ * Increments an event counter.
+ *
+ * @param counter Counter identifier
+ * @param value Amount to increment by
+ */
+void metrics_count(metrics_counter_t counter, uint64_t value);
+
+/**
+ * Resets all histograms and counters.
+ */
+void metrics_reset();
+
+/**
+ * Returns a histogram.
+ *
+ * @param histogram Histogram identifier
+ * @return Histogram
+ */
+const struct metrics_histogram *metrics_get_histogram(metrics_histogram_t histogram);
+
+/**
+ * Returns the value of a counter.
+ *
+ * @param counter Counter identifier
+ * @return Counter value
+ */
+uint64_t metrics_get_counter(metrics_counter_t counter);
+
+/**
+ * Computes a percentile from a histogram.
+ *
+ * @param histogram Histogram
+ * @param percentile Percentile in range [0, 100]
+ * @return Upper bound of the bucket containing the percentile
+ */
+uint32_t metrics_histogram_percentile(const struct metrics_histogram *histogram, float percentile);
+
+/**
+ * Returns the name of a histogram.
+ */
+const char *metrics_histogram_name(metrics_histogram_t histogram);
+
+/**
+ * Returns the name of a counter.
+ */
+const char *metrics_counter_name(metrics_counter_t counter);
+
+#else
+
+#define METRICS_TIMER_START(name) do {} while (0)
+#define METRICS_TIMER_STOP(name, histogram) do {} while (0)
+#define METRICS_RECORD(histogram, value) do {} while (0)
+#define METRICS_COUNT(counter, value) do {} while (0)
+
+#endif
+
+#endif
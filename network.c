@@ -16,58 +16,161 @@
  * You should have received a copy of the GNU Affero General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 #include "network.h"
 #include "message.h"
 #include "configuration.h"
+#include "koruza.h"
+#include "metrics.h"
+#include "auth.h"
+#include "telemetry.h"
+#include "clock.h"
 
-#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
-#include <netdb.h>
-#include <ifaddrs.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <syslog.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
 #include <libubox/uloop.h>
 #include <libubox/avl-cmp.h>
 
 // Multicast group used for KORUZA devices.
 #define KORUZA_MULTICAST_GROUP "ff02::1:1042"
-// Announce interval.
-#define KORUZA_ANNOUNCE_INTERVAL 1000
-// Address update interval.
-#define KORUZA_NETWORK_UPDATE_INTERVAL 60000
+// Port used for the peer protocol.
+#define KORUZA_NETWORK_PORT 10424
+// Telemetry interval.
+#define KORUZA_TELEMETRY_INTERVAL 100
+// Minimum discovery announce interval (Trickle Imin).
+#define KORUZA_ANNOUNCE_INTERVAL_MIN 500
+// Maximum discovery announce interval (Trickle Imax, 64 seconds).
+#define KORUZA_ANNOUNCE_INTERVAL_MAX (KORUZA_ANNOUNCE_INTERVAL_MIN << 7)
+// Number of consistent announces heard that suppress our own (Trickle k).
+#define KORUZA_ANNOUNCE_REDUNDANCY 2
+// Size of the netlink receive buffer.
+#define NETWORK_NETLINK_BUFFER 8192
+// Maximum size of a received datagram.
+#define NETWORK_MAX_DATAGRAM 1500
+// Number of datagrams received in a single batch.
+#define NETWORK_RX_BATCH 16
+// Sequence number distance after which the peer is considered restarted.
+#define NETWORK_SEQUENCE_WINDOW 64
+// Time after which units that have not been heard from expire (in ms). Units
+// other than the peer only send announces, which may be up to 1.5 Imax apart.
+#define KORUZA_PEER_EXPIRY (2 * KORUZA_ANNOUNCE_INTERVAL_MAX + KORUZA_ANNOUNCE_INTERVAL_MAX / 2)
+// Score needed by another unit to replace the current peer.
+#define NETWORK_PEER_HYSTERESIS 100
+// Score bonus of statically configured units.
+#define NETWORK_SCORE_STATIC 10000
+
+/**
+ * Trickle timer state of discovery announces (RFC 6206).
+ */
+struct network_trickle {
+  // Current interval length (in ms).
+  uint32_t interval;
+  // Number of consistent announces heard in this interval.
+  uint32_t counter;
+  // Whether the announce point of this interval has passed.
+  uint8_t announced;
+  // Time remaining in the interval after the announce point (in ms).
+  uint32_t remaining;
+};
 
 // AVL tree containing all discovered koruza units.
 static struct avl_tree discovered_units;
+// AVL tree containing all discovered koruza units, indexed by IP address.
+static struct avl_tree units_by_address;
+// Expiry timers of discovered units (one tick per telemetry interval).
+static struct timer_wheel unit_expiry;
 // Multicast socket listening for autodiscovery messages.
 static struct uloop_fd ad_socket;
 // Multicast group address.
-static struct in6_addr multicast_group;
+static struct sockaddr_in6 multicast_group;
 // Announce timer.
 static struct uloop_timeout timer_announce;
-// Address update timer.
-static struct uloop_timeout timer_address_update;
+// Netlink socket tracking interface addresses and link state.
+static struct uloop_fd rtnl_socket;
+// Netlink dump in progress (zero when none).
+static int rtnl_dump;
+// Sequence number of the last netlink request.
+static uint32_t rtnl_sequence;
+// Index of the configured interface.
+static int interface_index;
 // Current network state.
 static struct network_status net_status;
+// Sequence number of the last sent telemetry message.
+static uint32_t tx_sequence;
+// Pre-shared key used to authenticate peer messages.
+static struct auth_key network_key;
+// Telemetry message template.
+static struct telemetry_template telemetry_template;
+// Discovery announce timer.
+static struct uloop_timeout timer_discovery;
+// Discovery announce Trickle state.
+static struct network_trickle trickle;
+// Receive buffers.
+static uint8_t rx_buffers[NETWORK_RX_BATCH][NETWORK_MAX_DATAGRAM];
 
-int network_add_device(struct network_device *cfg);
+struct network_device *network_add_device(const struct network_device *cfg);
+void network_remove_device(struct network_device *device);
+struct network_device *network_find_device(const char *id);
+struct network_device *network_find_device_by_address(const char *ip_address);
+int network_device_set_id(struct network_device *device, const char *id);
+int network_device_set_address(struct network_device *device, const char *ip_address);
+void network_device_expired(struct timer_wheel_entry *entry);
+void network_update_score(struct network_device *device);
+void network_select_peer();
 void network_message_received(struct uloop_fd *sock, unsigned int events);
+int network_message_validate(const message_t *msg);
+void network_datagram_received(const uint8_t *data, size_t length, const struct sockaddr_in6 *source,
+                               int multicast);
+void network_trickle_start_interval();
+void network_trickle_reset();
+void network_discovery_timer_handler(struct uloop_timeout *timer);
 void network_announce_ourselves(struct uloop_timeout *timer);
-int network_send_message(message_t *message);
-void network_update_local_address(struct uloop_timeout *timer);
+int network_send_buffer(const uint8_t *buffer, size_t length, const struct sockaddr_in6 *destination);
+int network_build_template();
+void network_update_template(const struct koruza_status *status);
+int network_join_multicast();
+int network_netlink_init();
+int network_netlink_request(int type);
+void network_netlink_received(struct uloop_fd *sock, unsigned int events);
+void network_netlink_link(const struct nlmsghdr *header);
+void network_netlink_address(const struct nlmsghdr *header);
+
+static uint64_t network_expiry_tick()
+{
+  return clock_monotonic_us() / (KORUZA_TELEMETRY_INTERVAL * 1000);
+}
 
 int network_init(struct uci_context *uci)
 {
   memset(&net_status, 0, sizeof(struct network_status));
+  memset(&network_key, 0, sizeof(struct auth_key));
 
-  // Initialize the discovered units AVL tree.
+  // Start sequence numbers from the clock, so they keep increasing across
+  // restarts and peers do not reject our messages as replays. Units without
+  // a real-time clock are accepted again once peers have expired them.
+  tx_sequence = (uint32_t) time(NULL) * 16;
+
+  // Initialize the discovered units AVL trees and expiry timers.
   avl_init(&discovered_units, avl_strcmp, false, NULL);
+  avl_init(&units_by_address, avl_strcmp, false, NULL);
+  timer_wheel_init(&unit_expiry, network_expiry_tick());
 
   // Initialize multicast group address.
-  inet_pton(AF_INET6, KORUZA_MULTICAST_GROUP, &multicast_group);
+  memset(&multicast_group, 0, sizeof(multicast_group));
+  multicast_group.sin6_family = AF_INET6;
+  multicast_group.sin6_port = htons(KORUZA_NETWORK_PORT);
+  inet_pton(AF_INET6, KORUZA_MULTICAST_GROUP, &multicast_group.sin6_addr);
 
   char *interface = uci_get_string(uci, "koruza.@network[0].interface");
   if (!interface) {
@@ -78,12 +181,22 @@ int network_init(struct uci_context *uci)
   net_status.interface = strdup(interface);
   free(interface);
 
-  // Discover interface IPv4 address.
-  timer_address_update.cb = network_update_local_address;
-  network_update_local_address(&timer_address_update);
+  // Configure message authentication.
+  char *key = uci_get_string(uci, "koruza.@network[0].key");
+  if (key) {
+    auth_key_init(&network_key, key, strlen(key));
+    memset(key, 0, strlen(key));
+    free(key);
+  } else {
+    syslog(LOG_WARNING, "Network key not configured. Peer messages will not be authenticated.");
+  }
+
+  // Link-local multicast requires an explicit scope.
+  interface_index = if_nametoindex(net_status.interface);
+  multicast_group.sin6_scope_id = interface_index;
 
   // Prepare multicast socket, listen for updates.
-  ad_socket.fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+  ad_socket.fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, IPPROTO_UDP);
   if (ad_socket.fd < 0) {
     syslog(LOG_ERR, "Failed to setup autodiscovery socket.");
     return -1;
@@ -98,20 +211,32 @@ int network_init(struct uci_context *uci)
   struct sockaddr_in6 address;
   memset(&address, 0, sizeof(address));
   address.sin6_family = AF_INET6;
-  address.sin6_port = htons(10424);
+  address.sin6_port = htons(KORUZA_NETWORK_PORT);
   if (bind(ad_socket.fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
     syslog(LOG_ERR, "Failed to bind autodiscovery socket.");
     close(ad_socket.fd);
     return -1;
   }
 
-  // Subscribe to multicast messages.
-  struct ipv6_mreq mreq;
-  memcpy(&mreq.ipv6mr_multiaddr, &multicast_group, sizeof(multicast_group));
-  mreq.ipv6mr_interface = 0;
+  // Subscribe to multicast messages. The group is joined again once the
+  // link comes up if the interface is not ready yet.
+  if (network_join_multicast() != 0) {
+    syslog(LOG_WARNING, "Failed to join multicast group, retrying on link up.");
+  }
 
-  if (setsockopt(ad_socket.fd, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
-    syslog(LOG_ERR, "Failed to join multicast group.");
+  // Destination addresses distinguish announces from unicast telemetry.
+  int enable = 1;
+  if (setsockopt(ad_socket.fd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &enable, sizeof(enable)) != 0) {
+    syslog(LOG_ERR, "Failed to enable packet information.");
+    close(ad_socket.fd);
+    return -1;
+  }
+
+  // Do not receive our own announces, as unconfigured units share the same
+  // identifier and could not tell them apart from other units.
+  int loop = 0;
+  if (setsockopt(ad_socket.fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &loop, sizeof(loop)) != 0) {
+    syslog(LOG_ERR, "Failed to disable multicast loopback.");
     close(ad_socket.fd);
     return -1;
   }
@@ -124,25 +249,62 @@ int network_init(struct uci_context *uci)
     return -1;
   }
 
+  // Prepare the telemetry message template.
+  if (network_build_template() != 0) {
+    syslog(LOG_ERR, "Failed to prepare telemetry message template.");
+    close(ad_socket.fd);
+    return -1;
+  }
+
+  // Track interface address and link state changes.
+  if (network_netlink_init() != 0) {
+    syslog(LOG_ERR, "Failed to setup netlink socket.");
+    close(ad_socket.fd);
+    return -1;
+  }
+
   // Add socket to uloop.
   ad_socket.cb = network_message_received;
   uloop_fd_add(&ad_socket, ULOOP_READ);
 
-  // Setup announce timer.
+  // Setup telemetry timer.
   timer_announce.cb = network_announce_ourselves;
-  uloop_timeout_set(&timer_announce, KORUZA_ANNOUNCE_INTERVAL);
+  uloop_timeout_set(&timer_announce, KORUZA_TELEMETRY_INTERVAL);
+
+  // Setup discovery announces, starting with the shortest interval.
+  srand(clock_monotonic_us());
+  timer_discovery.cb = network_discovery_timer_handler;
+  trickle.interval = KORUZA_ANNOUNCE_INTERVAL_MIN;
+  network_trickle_start_interval();
 
-  syslog(LOG_INFO, "Initialized network on interface %s (%s).", net_status.interface, net_status.ip_address);
+  syslog(LOG_INFO, "Initialized network on interface %s.", net_status.interface);
   net_status.ready = 1;
 
   // Setup any staticly configured peers.
   char *peer_ip = uci_get_string(uci, "koruza.@network[0].peer");
   if (peer_ip) {
     struct network_device device;
+    memset(&device, 0, sizeof(device));
     device.version = 0;
     device.id = "STATIC";
     device.ip_address = peer_ip;
-    if (network_add_device(&device) != 0) {
+    device.is_static = 1;
+    device.address.sin6_family = AF_INET6;
+    device.address.sin6_port = htons(KORUZA_NETWORK_PORT);
+
+    // IPv4 peers are reached through IPv4-mapped addresses.
+    struct in_addr address4;
+    if (inet_pton(AF_INET, peer_ip, &address4) == 1) {
+      device.address.sin6_addr.s6_addr[10] = 0xff;
+      device.address.sin6_addr.s6_addr[11] = 0xff;
+      memcpy(&device.address.sin6_addr.s6_addr[12], &address4, sizeof(address4));
+    } else if (inet_pton(AF_INET6, peer_ip, &device.address.sin6_addr) != 1) {
+      syslog(LOG_WARNING, "Invalid static network peer address '%s'.", peer_ip);
+      free(peer_ip);
+      return 0;
+    }
+
+    if (!network_add_device(&device)) {
       syslog(LOG_WARNING, "Unable to add static network peer.");
     }
     free(peer_ip);
@@ -156,109 +318,753 @@ const struct network_status *network_get_status()
   return &net_status;
 }
 
-int network_add_device(struct network_device *cfg)
+uint64_t network_telemetry_age(const struct network_device *device)
+{
+  if (!device || !device->telemetry.updated_at) {
+    return UINT64_MAX;
+  }
+
+  return (clock_monotonic_us() - device->telemetry.updated_at) / 1000;
+}
+
+struct network_device *network_add_device(const struct network_device *cfg)
 {
   struct network_device *device = (struct network_device*) malloc(sizeof(struct network_device));
   if (!device) {
-    return -1;
+    return NULL;
   }
 
+  memset(device, 0, sizeof(struct network_device));
   device->version = cfg->version;
   device->id = strdup(cfg->id);
   device->ip_address = strdup(cfg->ip_address);
+  device->is_static = cfg->is_static;
+  memcpy(&device->address, &cfg->address, sizeof(struct sockaddr_in6));
+  device->first_seen = device->last_seen = clock_monotonic_us();
+  timer_wheel_entry_init(&device->expiry, network_device_expired);
+
   device->avl.key = device->id;
   if (avl_insert(&discovered_units, &device->avl) != 0) {
     free(device->id);
     free(device->ip_address);
     free(device);
+    return NULL;
+  }
+
+  device->avl_address.key = device->ip_address;
+  if (avl_insert(&units_by_address, &device->avl_address) != 0) {
+    avl_delete(&discovered_units, &device->avl);
+    free(device->id);
+    free(device->ip_address);
+    free(device);
+    return NULL;
+  }
+
+  timer_wheel_add(&unit_expiry, &device->expiry, KORUZA_PEER_EXPIRY / KORUZA_TELEMETRY_INTERVAL);
+
+  net_status.units++;
+  syslog(LOG_INFO, "Discovered unit '%s' (id %s).", device->ip_address, device->id);
+  network_trickle_reset();
+
+  network_update_score(device);
+  if (!net_status.peer) {
+    network_select_peer();
+  }
+
+  return device;
+}
+
+void network_remove_device(struct network_device *device)
+{
+  timer_wheel_del(&device->expiry);
+  avl_delete(&discovered_units, &device->avl);
+  avl_delete(&units_by_address, &device->avl_address);
+  net_status.units--;
+
+  // Silent units going away are expected, only losing the peer requires
+  // announcing quickly again.
+  if (net_status.peer == device) {
+    net_status.peer = NULL;
+    network_trickle_reset();
+    network_select_peer();
+  }
+
+  free(device->id);
+  free(device->ip_address);
+  free(device);
+}
+
+struct network_device *network_find_device(const char *id)
+{
+  struct network_device *device;
+  return avl_find_element(&discovered_units, id, device, avl);
+}
+
+struct network_device *network_find_device_by_address(const char *ip_address)
+{
+  struct network_device *device;
+  return avl_find_element(&units_by_address, ip_address, device, avl_address);
+}
+
+int network_device_set_id(struct network_device *device, const char *id)
+{
+  char *new_id = strdup(id);
+  if (!new_id) {
+    return -1;
+  }
+
+  avl_delete(&discovered_units, &device->avl);
+  char *old_id = device->id;
+  device->id = new_id;
+  device->avl.key = device->id;
+  if (avl_insert(&discovered_units, &device->avl) != 0) {
+    // Another unit already uses this identifier, keep the old one.
+    device->id = old_id;
+    device->avl.key = device->id;
+    avl_insert(&discovered_units, &device->avl);
+    free(new_id);
+    return -1;
+  }
+  free(old_id);
+
+  // Telemetry of the previous identity is no longer relevant.
+  memset(&device->telemetry, 0, sizeof(struct network_telemetry));
+  memset(&device->replay, 0, sizeof(struct auth_replay_window));
+  device->received = 0;
+  network_trickle_reset();
+  return 0;
+}
+
+int network_device_set_address(struct network_device *device, const char *ip_address)
+{
+  // Any other unit still registered with this address is stale.
+  struct network_device *stale = network_find_device_by_address(ip_address);
+  if (stale && stale != device) {
+    network_remove_device(stale);
+  }
+
+  char *new_address = strdup(ip_address);
+  if (!new_address) {
     return -1;
   }
 
-  // TODO: Perform current peer selection. We just use the last one for now.
-  net_status.peer = device;
-  syslog(LOG_INFO, "New peer '%s' (id %s) selected.", device->ip_address, device->id);
+  avl_delete(&units_by_address, &device->avl_address);
+  char *old_address = device->ip_address;
+  device->ip_address = new_address;
+  device->avl_address.key = device->ip_address;
+  if (avl_insert(&units_by_address, &device->avl_address) != 0) {
+    // Keep the device registered under its old address.
+    device->ip_address = old_address;
+    device->avl_address.key = device->ip_address;
+    avl_insert(&units_by_address, &device->avl_address);
+    free(new_address);
+    return -1;
+  }
+  free(old_address);
 
+  network_trickle_reset();
   return 0;
 }
 
+void network_device_expired(struct timer_wheel_entry *entry)
+{
+  struct network_device *device = container_of(entry, struct network_device, expiry);
+
+  // Static units are kept, but may have restarted with lower sequence
+  // numbers (rejected as replays), so start over with a fresh window.
+  if (device->is_static) {
+    syslog(LOG_INFO, "Static unit '%s' (id %s) expired, resetting its state.", device->ip_address, device->id);
+    memset(&device->telemetry, 0, sizeof(struct network_telemetry));
+    memset(&device->replay, 0, sizeof(struct auth_replay_window));
+    network_update_score(device);
+    return;
+  }
+
+  syslog(LOG_INFO, "Unit '%s' (id %s) expired.", device->ip_address, device->id);
+  network_remove_device(device);
+}
+
+void network_update_score(struct network_device *device)
+{
+  uint32_t score = 0;
+
+  if (device->is_static) {
+    score += NETWORK_SCORE_STATIC;
+  }
+
+  // Units speaking another protocol version are only used as a last resort.
+  if (device->version == NETWORK_PROTOCOL_VERSION) {
+    score += 1000;
+  }
+
+  // Power of our beam as received by the unit (-40 dBm to 0 dBm).
+  if (device->telemetry.updated_at && device->telemetry.rx_power > 0) {
+    double rx_power_dbm = 10.0 * log10(((double) device->telemetry.rx_power) / 10000.0);
+    if (rx_power_dbm < -40.0) {
+      rx_power_dbm = -40.0;
+    } else if (rx_power_dbm > 0.0) {
+      rx_power_dbm = 0.0;
+    }
+    score += (uint32_t) ((rx_power_dbm + 40.0) * 20.0);
+  }
+
+  // Stability of the telemetry channel.
+  uint32_t expected = device->received + device->telemetry.lost;
+  if (expected) {
+    score += 200 * device->received / expected;
+  }
+
+  device->score = score;
+}
+
+void network_select_peer()
+{
+  struct network_device *device;
+  struct network_device *best = NULL;
+
+  avl_for_each_element(&discovered_units, device, avl) {
+    if (!best || device->score > best->score) {
+      best = device;
+    }
+  }
+
+  if (best && best != net_status.peer) {
+    syslog(LOG_INFO, "New peer '%s' (id %s) selected.", best->ip_address, best->id);
+  }
+  net_status.peer = best;
+}
+
 void network_message_received(struct uloop_fd *sock, unsigned int events)
 {
-  (void) sock;
   (void) events;
 
-  // message_result_t message_parse(message_t *message, const uint8_t *data, size_t length);
-  // TODO.
+  struct mmsghdr headers[NETWORK_RX_BATCH];
+  struct iovec iov[NETWORK_RX_BATCH];
+  struct sockaddr_in6 sources[NETWORK_RX_BATCH];
+  uint8_t control[NETWORK_RX_BATCH][CMSG_SPACE(sizeof(struct in6_pktinfo))];
+
+  // Drain all pending datagrams, a full batch at a time.
+  for (;;) {
+    memset(headers, 0, sizeof(headers));
+    for (size_t i = 0; i < NETWORK_RX_BATCH; i++) {
+      iov[i].iov_base = rx_buffers[i];
+      iov[i].iov_len = NETWORK_MAX_DATAGRAM;
+      headers[i].msg_hdr.msg_iov = &iov[i];
+      headers[i].msg_hdr.msg_iovlen = 1;
+      headers[i].msg_hdr.msg_name = &sources[i];
+      headers[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+      headers[i].msg_hdr.msg_control = control[i];
+      headers[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+
+    int count = recvmmsg(sock->fd, headers, NETWORK_RX_BATCH, MSG_DONTWAIT, NULL);
+    if (count < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        syslog(LOG_WARNING, "Failed to receive network messages: %s", strerror(errno));
+      }
+      break;
+    }
+
+    METRICS_COUNT(METRICS_NETWORK_DATAGRAMS_RECEIVED, count);
+
+    for (int i = 0; i < count; i++) {
+      if (headers[i].msg_hdr.msg_flags & MSG_TRUNC) {
+        continue;
+      }
+
+      int multicast = 0;
+      struct cmsghdr *cmsg;
+      for (cmsg = CMSG_FIRSTHDR(&headers[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&headers[i].msg_hdr, cmsg)) {
+        if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO) {
+          struct in6_pktinfo *info = (struct in6_pktinfo*) CMSG_DATA(cmsg);
+          multicast = IN6_IS_ADDR_MULTICAST(&info->ipi6_addr);
+        }
+      }
+
+      network_datagram_received(rx_buffers[i], headers[i].msg_len, &sources[i], multicast);
+    }
+
+    if (count < NETWORK_RX_BATCH) {
+      break;
+    }
+  }
 }
 
-int network_send_message(message_t *message)
+int network_message_validate(const message_t *msg)
 {
-  message_tlv_add_checksum(message);
-  // TODO: Add cryptographic signature.
+  // Datagrams are untrusted, so every known TLV must have exactly its size.
+  for (size_t i = 0; i < msg->length; i++) {
+    size_t expected;
+    switch (msg->tlv[i].type) {
+      case TLV_NET_HELLO: expected = sizeof(tlv_net_hello_t); break;
+      case TLV_NET_ALIGNMENT: expected = sizeof(tlv_net_alignment_t); break;
+      case TLV_NET_SIGNATURE: expected = AUTH_MAC_LENGTH; break;
+      case TLV_SEQUENCE_NUMBER: expected = sizeof(uint32_t); break;
+      case TLV_POWER_READING: expected = sizeof(uint16_t); break;
+      case TLV_MOTOR_POSITION: expected = sizeof(tlv_motor_position_t); break;
+      case TLV_CHECKSUM: expected = sizeof(uint32_t); break;
+      default: continue;
+    }
 
-  // Serialize message.
-  size_t buffer_size = message_serialized_size(message);
-  uint8_t *buffer = (uint8_t*) malloc(buffer_size);
-  if (!buffer) {
-    return -1;
+    if (msg->tlv[i].length != expected) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void network_datagram_received(const uint8_t *data, size_t length, const struct sockaddr_in6 *source,
+                               int multicast)
+{
+  // Verify the signature, which must be the last TLV, before parsing.
+  if (network_key.enabled) {
+    if (length <= TELEMETRY_SIGNATURE_SIZE) {
+      return;
+    }
+
+    size_t offset = length - TELEMETRY_SIGNATURE_SIZE;
+    uint16_t mac_length;
+    memcpy(&mac_length, &data[offset + sizeof(uint8_t)], sizeof(uint16_t));
+    if (data[offset] != TLV_NET_SIGNATURE || ntohs(mac_length) != AUTH_MAC_LENGTH ||
+        auth_verify(&network_key, data, offset, &data[length - AUTH_MAC_LENGTH]) != 0) {
+      METRICS_COUNT(METRICS_NETWORK_AUTH_FAILURES, 1);
+      return;
+    }
+  }
+
+  message_t msg;
+  if (message_parse(&msg, data, length) != MESSAGE_SUCCESS) {
+    return;
+  }
+
+  if (network_message_validate(&msg) != 0) {
+    message_free(&msg);
+    return;
   }
 
-  ssize_t result = message_serialize(buffer, buffer_size, message);
-  if (result != buffer_size) {
-    free(buffer);
+  // Every message must identify the sending unit.
+  tlv_net_hello_t hello;
+  if (message_tlv_get_net_hello(&msg, &hello) != MESSAGE_SUCCESS) {
+    message_free(&msg);
+    return;
+  }
+
+  char ip_address[INET6_ADDRSTRLEN];
+  if (IN6_IS_ADDR_V4MAPPED(&source->sin6_addr)) {
+    inet_ntop(AF_INET, &source->sin6_addr.s6_addr[12], ip_address, sizeof(ip_address));
+  } else {
+    inet_ntop(AF_INET6, &source->sin6_addr, ip_address, sizeof(ip_address));
+  }
+
+  // Authenticated messages must always be sequenced.
+  uint32_t sequence;
+  int sequenced = message_tlv_get_sequence_number(&msg, &sequence) == MESSAGE_SUCCESS;
+  if (!sequenced && network_key.enabled) {
+    message_free(&msg);
+    return;
+  }
+
+  // The unit may be known under another identifier (static peers are
+  // configured without one).
+  struct network_device *device = network_find_device(hello.id);
+  int renamed = 0;
+  if (!device) {
+    device = network_find_device_by_address(ip_address);
+    renamed = device != NULL;
+  }
+
+  // Drop replayed or duplicate messages before they can touch the peer
+  // table, so they can neither redirect nor keep alive a peer.
+  uint32_t skipped = 0;
+  if (device && sequenced && auth_replay_check(&device->replay, sequence, &skipped) != 0) {
+    METRICS_COUNT(METRICS_NETWORK_REPLAYS, 1);
+    message_free(&msg);
+    return;
+  }
+
+  if (renamed) {
+    if (network_device_set_id(device, hello.id) != 0) {
+      message_free(&msg);
+      return;
+    }
+  } else if (!device) {
+    struct network_device cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.version = hello.version;
+    cfg.id = hello.id;
+    cfg.ip_address = ip_address;
+    memcpy(&cfg.address, source, sizeof(struct sockaddr_in6));
+    device = network_add_device(&cfg);
+    if (!device) {
+      message_free(&msg);
+      return;
+    }
+
+    if (sequenced) {
+      auth_replay_check(&device->replay, sequence, NULL);
+    }
+  } else if (strcmp(device->ip_address, ip_address) != 0) {
+    if (network_device_set_address(device, ip_address) != 0) {
+      message_free(&msg);
+      return;
+    }
+  }
+
+  device->last_seen = clock_monotonic_us();
+  device->received++;
+  timer_wheel_add(&unit_expiry, &device->expiry, KORUZA_PEER_EXPIRY / KORUZA_TELEMETRY_INTERVAL);
+
+  device->version = hello.version;
+  memcpy(&device->address, source, sizeof(struct sockaddr_in6));
+
+  // Track losses.
+  struct network_telemetry *telemetry = &device->telemetry;
+  if (sequenced) {
+    if (skipped < NETWORK_SEQUENCE_WINDOW) {
+      telemetry->lost += skipped;
+    } else {
+      // The unit has restarted or was unreachable, and may not know us.
+      network_trickle_reset();
+    }
+    telemetry->sequence = device->replay.top;
+  }
+
+  uint16_t rx_power;
+  if (message_tlv_get(&msg, TLV_POWER_READING, (uint8_t*) &rx_power, sizeof(uint16_t)) == MESSAGE_SUCCESS) {
+    telemetry->rx_power = ntohs(rx_power);
+  }
+
+  tlv_motor_position_t position;
+  if (message_tlv_get_motor_position(&msg, &position) == MESSAGE_SUCCESS) {
+    telemetry->motor_x = position.x;
+    telemetry->motor_y = position.y;
+  }
+
+  tlv_net_alignment_t alignment;
+  if (message_tlv_get_net_alignment(&msg, &alignment) == MESSAGE_SUCCESS) {
+    telemetry->alignment_state = alignment.state;
+  }
+
+  telemetry->updated_at = clock_monotonic_us();
+  message_free(&msg);
+
+  // Announces from known units make our own redundant.
+  if (multicast) {
+    trickle.counter++;
+  }
+
+  // Switch peers only when another unit is clearly better.
+  network_update_score(device);
+  if (!net_status.peer ||
+      (device != net_status.peer && device->score > net_status.peer->score + NETWORK_PEER_HYSTERESIS)) {
+    net_status.peer = device;
+    syslog(LOG_INFO, "New peer '%s' (id %s) selected.", device->ip_address, device->id);
+  }
+}
+
+int network_send_buffer(const uint8_t *buffer, size_t length, const struct sockaddr_in6 *destination)
+{
+  // Datagrams that cannot be sent are dropped, as newer telemetry follows.
+  if (sendto(ad_socket.fd, buffer, length, MSG_DONTWAIT, (const struct sockaddr*) destination,
+             sizeof(struct sockaddr_in6)) < 0) {
+    syslog(LOG_WARNING, "Failed to send network message: %s", strerror(errno));
     return -1;
   }
 
-  sendto(ad_socket.fd, buffer, buffer_size, 0, (struct sockaddr*) &multicast_group, sizeof(multicast_group));
-  free(buffer);
+  METRICS_COUNT(METRICS_NETWORK_DATAGRAMS_SENT, 1);
   return 0;
 }
 
+int network_build_template()
+{
+  const struct koruza_status *status = koruza_get_status();
+
+  tlv_net_hello_t hello;
+  memset(&hello, 0, sizeof(hello));
+  hello.version = NETWORK_PROTOCOL_VERSION;
+  if (status->serial_number) {
+    strncpy(hello.id, status->serial_number, TLV_NET_HELLO_ID_LENGTH - 1);
+  }
+
+  return telemetry_template_build(&telemetry_template, &hello, &network_key);
+}
+
+void network_update_template(const struct koruza_status *status)
+{
+  tlv_motor_position_t position;
+  position.x = status->motors.x;
+  position.y = status->motors.y;
+  position.z = status->motors.z;
+
+  telemetry_template_update(&telemetry_template, ++tx_sequence, status->sfp.rx_power, &position,
+                            status->alignment.state);
+}
+
 void network_announce_ourselves(struct uloop_timeout *timer)
 {
-  // TODO: Generate announce message.
-  message_t msg;
-  message_init(&msg);
-  network_send_message(&msg);
-  message_free(&msg);
+  METRICS_TIMER_START(timer);
+
+  // Expire units that have not been heard from.
+  timer_wheel_advance(&unit_expiry, network_expiry_tick());
 
-  // Reschedule timer if no peer selected.
-  if (net_status.peer == NULL) {
-    uloop_timeout_set(timer, KORUZA_ANNOUNCE_INTERVAL);
+  // Telemetry goes directly to the peer, discovery announces are sent by
+  // the Trickle timer.
+  if (net_status.peer) {
+    network_update_template(koruza_get_status());
+    network_send_buffer(telemetry_template.buffer, telemetry_template.length, &net_status.peer->address);
   }
+
+  uloop_timeout_set(timer, KORUZA_TELEMETRY_INTERVAL);
+
+  METRICS_TIMER_STOP(timer, METRICS_TIMER_ANNOUNCE);
 }
 
-void network_update_local_address(struct uloop_timeout *timer)
+void network_trickle_start_interval()
 {
-  struct ifaddrs *ifaddr, *ifa;
-  if (getifaddrs(&ifaddr) == -1) {
-    syslog(LOG_ERR, "Failed to discover interface IP address.");
-  } else {
-    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-      if (ifa->ifa_addr == NULL || strcmp(ifa->ifa_name, net_status.interface) != 0) {
+  // Announce at a random point in the second half of the interval.
+  uint32_t half = trickle.interval / 2;
+  uint32_t offset = half + rand() % half;
+
+  trickle.counter = 0;
+  trickle.announced = 0;
+  trickle.remaining = trickle.interval - offset;
+  uloop_timeout_set(&timer_discovery, offset);
+}
+
+void network_trickle_reset()
+{
+  // Nothing to do before the timer is set up or when already announcing fast.
+  if (!timer_discovery.cb || trickle.interval <= KORUZA_ANNOUNCE_INTERVAL_MIN) {
+    return;
+  }
+
+  trickle.interval = KORUZA_ANNOUNCE_INTERVAL_MIN;
+  network_trickle_start_interval();
+}
+
+void network_discovery_timer_handler(struct uloop_timeout *timer)
+{
+  if (!trickle.announced) {
+    // Announce unless enough other units have already done so.
+    if (trickle.counter < KORUZA_ANNOUNCE_REDUNDANCY || !net_status.peer) {
+      network_update_template(koruza_get_status());
+      network_send_buffer(telemetry_template.buffer, telemetry_template.length, &multicast_group);
+    }
+
+    trickle.announced = 1;
+    uloop_timeout_set(timer, trickle.remaining);
+    return;
+  }
+
+  // Interval has ended without inconsistencies, back off.
+  trickle.interval *= 2;
+  if (trickle.interval > KORUZA_ANNOUNCE_INTERVAL_MAX) {
+    trickle.interval = KORUZA_ANNOUNCE_INTERVAL_MAX;
+  }
+  network_trickle_start_interval();
+}
+
+int network_join_multicast()
+{
+  struct ipv6_mreq mreq;
+  memcpy(&mreq.ipv6mr_multiaddr, &multicast_group.sin6_addr, sizeof(multicast_group.sin6_addr));
+  mreq.ipv6mr_interface = interface_index;
+
+  // Membership is lost when the interface goes away, so drop any stale one.
+  setsockopt(ad_socket.fd, IPPROTO_IPV6, IPV6_DROP_MEMBERSHIP, &mreq, sizeof(mreq));
+  if (setsockopt(ad_socket.fd, IPPROTO_IPV6, IPV6_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int network_netlink_init()
+{
+  rtnl_socket.fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+  if (rtnl_socket.fd < 0) {
+    return -1;
+  }
+
+  struct sockaddr_nl address;
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+  address.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+  if (bind(rtnl_socket.fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+    close(rtnl_socket.fd);
+    return -1;
+  }
+
+  rtnl_socket.cb = network_netlink_received;
+  uloop_fd_add(&rtnl_socket, ULOOP_READ);
+
+  // Request current state, links first and addresses once that completes.
+  return network_netlink_request(RTM_GETLINK);
+}
+
+int network_netlink_request(int type)
+{
+  struct {
+    struct nlmsghdr header;
+    struct rtgenmsg message;
+  } request;
+
+  memset(&request, 0, sizeof(request));
+  request.header.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg));
+  request.header.nlmsg_type = type;
+  request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.header.nlmsg_seq = ++rtnl_sequence;
+  request.message.rtgen_family = (type == RTM_GETADDR) ? AF_INET : AF_UNSPEC;
+
+  if (send(rtnl_socket.fd, &request, request.header.nlmsg_len, 0) < 0) {
+    syslog(LOG_WARNING, "Failed to request interface state: %s", strerror(errno));
+    rtnl_dump = 0;
+    return -1;
+  }
+
+  rtnl_dump = type;
+  return 0;
+}
+
+void network_netlink_received(struct uloop_fd *sock, unsigned int events)
+{
+  METRICS_TIMER_START(netlink);
+  (void) events;
+
+  static uint8_t buffer[NETWORK_NETLINK_BUFFER];
+  for (;;) {
+    struct sockaddr_nl sender;
+    socklen_t sender_length = sizeof(sender);
+    ssize_t length = recvfrom(sock->fd, buffer, sizeof(buffer), MSG_DONTWAIT,
+      (struct sockaddr*) &sender, &sender_length);
+    if (length < 0) {
+      if (errno == ENOBUFS) {
+        // Events were lost, resynchronize with a full dump.
+        syslog(LOG_WARNING, "Netlink buffer overrun, refreshing interface state.");
+        network_netlink_request(RTM_GETLINK);
         continue;
       }
+      break;
+    } else if (length == 0) {
+      break;
+    }
 
-      // Get IPv4 address.
-      if (ifa->ifa_addr->sa_family == AF_INET) {
-        char host[NI_MAXHOST];
-        int s = getnameinfo(ifa->ifa_addr, sizeof(struct sockaddr_in), host, NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
-        if (s != 0) {
-          syslog(LOG_ERR, "Failed to discover interface IP address.");
-          freeifaddrs(ifaddr);
-          break;
-        }
+    // Only trust messages sent by the kernel.
+    if (sender_length != sizeof(sender) || sender.nl_pid != 0) {
+      continue;
+    }
 
-        if (!net_status.ip_address || strcmp(net_status.ip_address, host) != 0) {
-          free(net_status.ip_address);
-          net_status.ip_address = strdup(host);
+    struct nlmsghdr *header = (struct nlmsghdr*) buffer;
+    for (; NLMSG_OK(header, length); header = NLMSG_NEXT(header, length)) {
+      switch (header->nlmsg_type) {
+        case RTM_NEWLINK:
+        case RTM_DELLINK: network_netlink_link(header); break;
+        case RTM_NEWADDR:
+        case RTM_DELADDR: network_netlink_address(header); break;
+        case NLMSG_DONE:
+        case NLMSG_ERROR: {
+          // Continue with the address dump once links are known.
+          if (rtnl_dump == RTM_GETLINK) {
+            network_netlink_request(RTM_GETADDR);
+          } else {
+            rtnl_dump = 0;
+          }
+          break;
         }
-        break;
+        default: break;
       }
     }
+  }
+
+  METRICS_TIMER_STOP(netlink, METRICS_NETLINK_HANDLER);
+}
+
+void network_netlink_link(const struct nlmsghdr *header)
+{
+  const struct ifinfomsg *info = (const struct ifinfomsg*) NLMSG_DATA(header);
+  const char *name = NULL;
+  int length = IFLA_PAYLOAD(header);
+
+  for (const struct rtattr *attr = IFLA_RTA(info); RTA_OK(attr, length); attr = RTA_NEXT(attr, length)) {
+    if (attr->rta_type == IFLA_IFNAME) {
+      name = (const char*) RTA_DATA(attr);
+    }
+  }
+
+  if (!name || strcmp(name, net_status.interface) != 0) {
+    return;
+  }
+
+  uint8_t link = (header->nlmsg_type == RTM_NEWLINK) && (info->ifi_flags & IFF_UP) && (info->ifi_flags & IFF_RUNNING);
 
-    freeifaddrs(ifaddr);
+  // The interface may have been recreated with a different index.
+  if (interface_index != info->ifi_index) {
+    interface_index = info->ifi_index;
+    multicast_group.sin6_scope_id = interface_index;
+    net_status.link = 0;
   }
 
-  // Reschedule timer.
-  uloop_timeout_set(timer, KORUZA_NETWORK_UPDATE_INTERVAL);
+  if (link == net_status.link) {
+    return;
+  }
+
+  net_status.link = link;
+  if (link) {
+    syslog(LOG_INFO, "Link on interface %s is up.", net_status.interface);
+    network_trickle_reset();
+    if (network_join_multicast() != 0) {
+      syslog(LOG_WARNING, "Failed to join multicast group.");
+    }
+  } else {
+    syslog(LOG_WARNING, "Link on interface %s is down.", net_status.interface);
+  }
+}
+
+void network_netlink_address(const struct nlmsghdr *header)
+{
+  const struct ifaddrmsg *info = (const struct ifaddrmsg*) NLMSG_DATA(header);
+  if ((int) info->ifa_index != interface_index) {
+    return;
+  }
+
+  // Multicast sending requires a link-local address, which only becomes
+  // usable once duplicate address detection completes.
+  if (info->ifa_family == AF_INET6) {
+    if (header->nlmsg_type == RTM_NEWADDR && info->ifa_scope == RT_SCOPE_LINK && net_status.link) {
+      network_join_multicast();
+    }
+    return;
+  } else if (info->ifa_family != AF_INET) {
+    return;
+  }
+
+  const void *address = NULL;
+  int length = IFA_PAYLOAD(header);
+  for (const struct rtattr *attr = IFA_RTA(info); RTA_OK(attr, length); attr = RTA_NEXT(attr, length)) {
+    // Prefer the local address on point-to-point links.
+    if (attr->rta_type == IFA_LOCAL || (attr->rta_type == IFA_ADDRESS && !address)) {
+      address = RTA_DATA(attr);
+    }
+  }
+
+  if (!address) {
+    return;
+  }
+
+  char host[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, address, host, sizeof(host));
+
+  if (header->nlmsg_type == RTM_NEWADDR) {
+    if (!net_status.ip_address || strcmp(net_status.ip_address, host) != 0) {
+      free(net_status.ip_address);
+      net_status.ip_address = strdup(host);
+      network_trickle_reset();
+      syslog(LOG_INFO, "Interface %s address is %s.", net_status.interface, net_status.ip_address);
+    }
+  } else if (net_status.ip_address && strcmp(net_status.ip_address, host) == 0) {
+    free(net_status.ip_address);
+    net_status.ip_address = NULL;
+    syslog(LOG_WARNING, "Interface %s address %s removed.", net_status.interface, host);
+  }
 }
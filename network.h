@@ -21,6 +21,30 @@
 
 #include <libubox/avl.h>
 #include <uci.h>
+#include <netinet/in.h>
+
+#include "timer_wheel.h"
+#include "auth.h"
+
+// Version of the peer protocol.
+#define NETWORK_PROTOCOL_VERSION 1
+
+/**
+ * Telemetry most recently received from a KORUZA unit.
+ */
+struct network_telemetry {
+  uint16_t rx_power;
+  int32_t motor_x;
+  int32_t motor_y;
+  uint32_t alignment_state;
+
+  // Last received sequence number.
+  uint32_t sequence;
+  // Number of telemetry messages lost in transit.
+  uint32_t lost;
+  // Time of last update (in microseconds, zero when never updated).
+  uint64_t updated_at;
+};
 
 /**
  * Discovered KORUZA units.
@@ -29,11 +53,30 @@ struct network_device {
   uint8_t version;
   char *id;
   char *ip_address;
+  // Whether the unit is configured statically (such units are only reset on expiry).
+  uint8_t is_static;
+
+  // Unicast address of the unit.
+  struct sockaddr_in6 address;
+  // Latest telemetry.
+  struct network_telemetry telemetry;
+  // Recently received sequence numbers.
+  struct auth_replay_window replay;
+
+  // Time the unit was first and last heard from (in microseconds).
+  uint64_t first_seen;
+  uint64_t last_seen;
+  // Number of messages received from the unit.
+  uint32_t received;
+  // Peer selection score (higher is better).
+  uint32_t score;
 
-  // TODO: Protocol state.
+  // Expiry timer.
+  struct timer_wheel_entry expiry;
 
-  // AVL node.
+  // AVL nodes, indexed by identifier and by IP address.
   struct avl_node avl;
+  struct avl_node avl_address;
 };
 
 /**
@@ -43,6 +86,10 @@ struct network_status {
   char *interface;
   char *ip_address;
   uint8_t ready;
+  // Whether the interface link is up.
+  uint8_t link;
+  // Number of discovered units.
+  uint32_t units;
 
   // Active peer unit.
   struct network_device *peer;
@@ -50,5 +97,6 @@ struct network_status {
 
 int network_init(struct uci_context *uci);
 const struct network_status *network_get_status();
+uint64_t network_telemetry_age(const struct network_device *device);
 
 #endif
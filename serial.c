@@ -18,10 +18,20 @@
  */
 #include "serial.h"
 #include "configuration.h"
+#include "metrics.h"
+#include "memory.h"
+#include "clock.h"
 
 #include <libubox/uloop.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <linux/netlink.h>
+#include <linux/serial.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <syslog.h>
@@ -31,36 +41,218 @@
 #include <string.h>
 #include <errno.h>
 
+// Link rate used by devices after reset.
+#define SERIAL_BASE_BAUDRATE 115200
+// Time to wait for the device to acknowledge a link rate change.
+#define SERIAL_NEGOTIATION_TIMEOUT 500
+// Number of frame errors within the burst window that trigger a fallback.
+#define SERIAL_ERROR_BURST_THRESHOLD 5
+#define SERIAL_ERROR_BURST_WINDOW 1000
+// Maximum number of queued low priority frames (older ones are dropped).
+#define SERIAL_TX_QUEUE_LOW_LIMIT 4
+// Time the reset line is held asserted (in milliseconds).
+#define SERIAL_RESET_DELAY 120
+// Time to wait for the first valid message after opening (in milliseconds).
+#define SERIAL_PROBE_TIMEOUT 3000
+// Bounds for the exponential reopen backoff (in milliseconds).
+#define SERIAL_BACKOFF_MIN 250
+#define SERIAL_BACKOFF_MAX 30000
+// USB-serial adapter latency timer in low-latency mode (in milliseconds).
+#define SERIAL_LATENCY_TIMER 1
+// Size of the kernel uevent receive buffer.
+#define SERIAL_UEVENT_BUFFER 8192
+// Kernel uevent multicast group (as opposed to the udev one).
+#define SERIAL_UEVENT_GROUP_KERNEL 1
+
+/**
+ * Device lifecycle state.
+ */
+enum serial_device_state {
+  // Device is closed and its reset line is asserted.
+  SERIAL_DEVICE_RESETTING,
+  // Device is being opened and configured.
+  SERIAL_DEVICE_OPENING,
+  // Device is open, waiting for the first valid message.
+  SERIAL_DEVICE_PROBING,
+  // Device is open and responding.
+  SERIAL_DEVICE_READY,
+  // Device is closed, waiting before the next open attempt.
+  SERIAL_DEVICE_BACKOFF,
+  // Device has been unplugged, waiting for a hotplug event.
+  SERIAL_DEVICE_DETACHED,
+};
+
+/**
+ * Link rate negotiation state.
+ */
+enum serial_link_state {
+  // Running at base rate, negotiation not yet attempted.
+  SERIAL_LINK_BASE,
+  // Waiting for the device to acknowledge the proposed rate.
+  SERIAL_LINK_PROPOSE,
+  // Switched to the proposed rate, waiting for confirmation at new rate.
+  SERIAL_LINK_CONFIRM,
+  // Negotiation finished.
+  SERIAL_LINK_ESTABLISHED,
+};
+
+struct serial_baudrate {
+  uint32_t rate;
+  speed_t speed;
+};
+
+// Supported link rates in order of preference, the last one is the base rate.
+static const struct serial_baudrate serial_baudrates[] = {
+  {1000000, B1000000},
+  {921600, B921600},
+  {460800, B460800},
+  {SERIAL_BASE_BAUDRATE, B115200},
+};
+
+#define SERIAL_BAUDRATE_COUNT (sizeof(serial_baudrates) / sizeof(serial_baudrates[0]))
+
+/**
+ * Framed message waiting for transmission.
+ */
+struct serial_tx_frame {
+  struct list_head list;
+  // Time when the frame was queued (in microseconds).
+  uint64_t queued_at;
+  // Sequence number of the framed message (zero if none).
+  uint32_t sequence;
+  // Number of bytes already written.
+  size_t offset;
+  size_t length;
+  uint8_t data[];
+};
+
 struct serial_device {
-  uint8_t ready;
+  // Lifecycle state.
+  enum serial_device_state state;
+  // Timer for lifecycle state transitions.
+  struct uloop_timeout timer_state;
+  // Current reopen backoff (in milliseconds).
+  uint32_t backoff;
+  // Handler for driving the device reset line.
+  serial_reset_handler reset_handler;
   // Device.
   char *device;
+  // USB serial number used to locate the device (optional).
+  char *usb_serial;
+  // Whether to trade CPU time for lower read latency.
+  uint8_t low_latency;
+  // UCI section holding device configuration.
+  const char *section;
   // Serial device uloop file descriptor wrapper.
   struct uloop_fd ufd;
   // Frame parser.
   parser_t parser;
+  // Handler for received messages.
+  frame_message_handler handler;
+  // Handler for frames dropped due to queue limits.
+  serial_drop_handler drop_handler;
+
+  // Current link rate.
+  uint32_t baudrate;
+  // Link rate before the last switch (for reverting failed confirmations).
+  uint32_t previous_baudrate;
+  // Link rate negotiation state.
+  enum serial_link_state link_state;
+  // Whether higher link rates may be negotiated.
+  uint8_t negotiate;
+  // Index of the link rate currently being negotiated.
+  size_t candidate;
+  // Number of link rates the silent device has been probed at since opening.
+  size_t probe;
+  // Timer for negotiation timeouts.
+  struct uloop_timeout timer_negotiation;
+
+  // Frame error burst detection.
+  uint32_t parse_errors;
+  uint64_t error_window_start;
+  uint32_t error_window_count;
+
+  // Memory budget of the transmit queues.
+  memory_component_t memory;
+  // Transmit queues, one per priority class.
+  struct list_head tx_queue[__SERIAL_PRIORITY_MAX];
+  uint32_t tx_queue_length[__SERIAL_PRIORITY_MAX];
+  // Frame currently being written.
+  struct serial_tx_frame *tx_current;
+  // Transmit queue statistics.
+  uint32_t tx_bytes;
+  uint32_t tx_dropped;
+  // Whether the device is waiting for write readiness.
+  uint8_t tx_armed;
+  // Whether the device should be reopened at base rate once output drains.
+  uint8_t restart_pending;
 };
 
+// UCI context.
+static struct uci_context *serial_uci;
+
 static struct serial_device device_motors;
 static struct serial_device device_accelerometer;
+// Kernel uevent socket for device hotplug.
+static struct uloop_fd uevent_socket = { .fd = -1 };
 
 int serial_start_device(struct serial_device *cfg);
 int serial_init_device(struct serial_device *cfg, int quiet);
-int serial_reinit_device(struct serial_device *cfg);
+void serial_close_device(struct serial_device *cfg);
+void serial_fail_device(struct serial_device *cfg);
+void serial_restart_device(struct serial_device *cfg);
+int serial_device_open(struct serial_device *cfg);
+void serial_timer_state_handler(struct uloop_timeout *timer);
+int serial_set_speed(struct serial_device *cfg, uint32_t baudrate);
+int serial_write_message(struct serial_device *cfg, const message_t *message, serial_priority_t priority);
+void serial_tx_flush(struct serial_device *cfg);
+void serial_tx_clear(struct serial_device *cfg);
+void serial_tx_drop(struct serial_device *cfg, struct serial_tx_frame *frame, serial_priority_t priority);
+void serial_tx_evict(struct serial_device *cfg, serial_priority_t priority);
+void serial_message_received(struct serial_device *cfg, const message_t *message);
+void serial_link_start(struct serial_device *cfg);
+void serial_link_propose(struct serial_device *cfg);
+void serial_link_next(struct serial_device *cfg);
+void serial_link_ack(struct serial_device *cfg, uint32_t baudrate);
+void serial_link_check_errors(struct serial_device *cfg);
+void serial_timer_negotiation_handler(struct uloop_timeout *timer);
 struct serial_device *serial_get_device(serial_device_t device);
 struct serial_device *serial_get_device_fd(int fd);
 void serial_fd_handler(struct uloop_fd *ufd, unsigned int events);
+int serial_hotplug_init();
+void serial_hotplug_received(struct uloop_fd *sock, unsigned int events);
+void serial_hotplug_event(const char *action, const char *subsystem, const char *devname);
+void serial_hotplug_attach(struct serial_device *cfg);
+void serial_hotplug_resync();
+int serial_hotplug_read_serial(const char *devname, char *serial, size_t length);
+char *serial_hotplug_find(const char *serial);
+void serial_configure_device(struct serial_device *cfg, const char *section, const char *default_device);
+void serial_set_low_latency(struct serial_device *cfg);
+
+static void serial_motors_message_handler(const message_t *message)
+{
+  serial_message_received(&device_motors, message);
+}
+
+static void serial_accelerometer_message_handler(const message_t *message)
+{
+  serial_message_received(&device_accelerometer, message);
+}
 
 int serial_init(struct uci_context *uci)
 {
   int result = 0;
 
-  // Motors MCU.
-  device_motors.ready = 0;
-  device_motors.device = uci_get_string(uci, "koruza.@mcu[0].device");
-  if (!device_motors.device) {
-    device_motors.device = "/dev/ttyS1";
+  serial_uci = uci;
+
+  // Hotplug events are optional, devices are polled for when unavailable.
+  if (serial_hotplug_init() != 0) {
+    syslog(LOG_WARNING, "Failed to listen for device hotplug events: %s (%d)", strerror(errno), errno);
   }
+
+  // Motors MCU.
+  serial_configure_device(&device_motors, "koruza.@mcu[0]", "/dev/ttyS1");
+  device_motors.memory = MEMORY_SERIAL_TX_MOTORS;
   result = serial_start_device(&device_motors);
 
   if (result != 0) {
@@ -68,16 +260,40 @@ int serial_init(struct uci_context *uci)
   }
 
   // Accelerometer MCU (can be disconnected).
-  device_accelerometer.ready = 0;
-  device_accelerometer.device = uci_get_string(uci, "koruza.@accelerometer[0].device");
-  if (!device_accelerometer.device) {
-    device_accelerometer.device = "/dev/ttyUSB0";
+  serial_configure_device(&device_accelerometer, "koruza.@accelerometer[0]", "/dev/ttyUSB0");
+  device_accelerometer.memory = MEMORY_SERIAL_TX_ACCELEROMETER;
+  if (serial_start_device(&device_accelerometer) != 0) {
+    // Keep retrying in the background in case the device is plugged in later.
+    serial_fail_device(&device_accelerometer);
   }
-  (void) serial_start_device(&device_accelerometer);
 
   return 0;
 }
 
+void serial_configure_device(struct serial_device *cfg, const char *section, const char *default_device)
+{
+  char location[64];
+  cfg->section = section;
+
+  snprintf(location, sizeof(location), "%s.low_latency", section);
+  cfg->low_latency = uci_get_int(serial_uci, location, 0);
+
+  snprintf(location, sizeof(location), "%s.usb_serial", section);
+  cfg->usb_serial = uci_get_string(serial_uci, location);
+  if (cfg->usb_serial) {
+    // Locate the device node by its USB serial number. When the adapter is
+    // not plugged in, wait for it instead of opening some other device.
+    cfg->device = serial_hotplug_find(cfg->usb_serial);
+    return;
+  }
+
+  snprintf(location, sizeof(location), "%s.device", section);
+  cfg->device = uci_get_string(serial_uci, location);
+  if (!cfg->device) {
+    cfg->device = strdup(default_device);
+  }
+}
+
 struct serial_device *serial_get_device(serial_device_t device)
 {
   switch (device) {
@@ -106,22 +322,190 @@ void serial_set_message_handler(serial_device_t device, frame_message_handler ha
     return;
   }
 
-  cfg->parser.handler = handler;
+  cfg->handler = handler;
+}
+
+void serial_set_reset_handler(serial_device_t device, serial_reset_handler handler)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  if (!cfg) {
+    syslog(LOG_ERR, "Failed to set reset handler for serial device %d", device);
+    return;
+  }
+
+  cfg->reset_handler = handler;
+}
+
+void serial_set_drop_handler(serial_device_t device, serial_drop_handler handler)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  if (!cfg) {
+    syslog(LOG_ERR, "Failed to set drop handler for serial device %d", device);
+    return;
+  }
+
+  cfg->drop_handler = handler;
+}
+
+void serial_set_link_negotiation(serial_device_t device, int enabled)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  if (!cfg) {
+    return;
+  }
+
+  cfg->negotiate = enabled ? 1 : 0;
+}
+
+int serial_restart(serial_device_t device)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  if (!cfg) {
+    return -1;
+  }
+
+  // Closed devices are always reopened at base rate.
+  if (!serial_device_open(cfg)) {
+    return 0;
+  }
+
+  // Let queued frames (like the command that restarts the device) go out
+  // at the current rate first.
+  cfg->restart_pending = 1;
+  if (!cfg->tx_current) {
+    serial_restart_device(cfg);
+  }
+
+  return 0;
+}
+
+void serial_restart_device(struct serial_device *cfg)
+{
+  syslog(LOG_INFO, "Reopening serial device '%s' at base rate.", cfg->device);
+  serial_close_device(cfg);
+  cfg->backoff = SERIAL_BACKOFF_MIN;
+  cfg->probe = 0;
+  if (serial_init_device(cfg, 0) != 0) {
+    serial_fail_device(cfg);
+  }
+}
+
+int serial_reset(serial_device_t device)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  if (!cfg || !cfg->reset_handler) {
+    return -1;
+  }
+
+  if (cfg->state == SERIAL_DEVICE_RESETTING) {
+    return 0;
+  }
+
+  if (cfg->reset_handler(1) != 0) {
+    return -1;
+  }
+
+  // Device restarts at base rate, so the link is reestablished after release.
+  serial_close_device(cfg);
+  cfg->state = SERIAL_DEVICE_RESETTING;
+  cfg->backoff = SERIAL_BACKOFF_MIN;
+  cfg->probe = 0;
+  uloop_timeout_set(&cfg->timer_state, SERIAL_RESET_DELAY);
+
+  return 0;
+}
+
+uint32_t serial_get_baudrate(serial_device_t device)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  if (!cfg || !serial_device_open(cfg)) {
+    return 0;
+  }
+
+  return cfg->baudrate;
+}
+
+int serial_get_queue_stats(serial_device_t device, struct serial_queue_stats *stats)
+{
+  struct serial_device *cfg = serial_get_device(device);
+  if (!cfg) {
+    return -1;
+  }
+
+  memset(stats, 0, sizeof(struct serial_queue_stats));
+  stats->bytes = cfg->tx_bytes;
+  stats->dropped = cfg->tx_dropped;
+
+  uint64_t oldest = 0;
+  if (cfg->tx_current) {
+    stats->depth++;
+    oldest = cfg->tx_current->queued_at;
+  }
+
+  for (size_t i = 0; i < __SERIAL_PRIORITY_MAX; i++) {
+    stats->depth += cfg->tx_queue_length[i];
+    if (!list_empty(&cfg->tx_queue[i])) {
+      struct serial_tx_frame *frame = list_first_entry(&cfg->tx_queue[i], struct serial_tx_frame, list);
+      if (!oldest || frame->queued_at < oldest) {
+        oldest = frame->queued_at;
+      }
+    }
+  }
+
+  if (oldest) {
+    stats->oldest = (clock_monotonic_us() - oldest) / 1000;
+  }
+
+  return 0;
 }
 
 int serial_start_device(struct serial_device *cfg)
 {
+  for (size_t i = 0; i < __SERIAL_PRIORITY_MAX; i++) {
+    INIT_LIST_HEAD(&cfg->tx_queue[i]);
+  }
+
   frame_parser_init(&cfg->parser);
+  cfg->parser.handler = (cfg == &device_motors) ? serial_motors_message_handler : serial_accelerometer_message_handler;
+  cfg->timer_negotiation.cb = serial_timer_negotiation_handler;
+  cfg->timer_state.cb = serial_timer_state_handler;
+  cfg->negotiate = 1;
+  cfg->ufd.fd = -1;
+  cfg->backoff = SERIAL_BACKOFF_MIN;
+  cfg->probe = 0;
+
+  if (!cfg->device) {
+    syslog(LOG_WARNING, "USB serial device '%s' is not plugged in, waiting for it.", cfg->usb_serial);
+    serial_fail_device(cfg);
+    return 0;
+  }
+
   return serial_init_device(cfg, 0);
 }
 
+int serial_device_open(struct serial_device *cfg)
+{
+  return cfg->state == SERIAL_DEVICE_PROBING || cfg->state == SERIAL_DEVICE_READY;
+}
+
 int serial_init_device(struct serial_device *cfg, int quiet)
 {
-  if (cfg->ready != 0 || !cfg->device) {
+  // Without hotplug events, adapters are looked up again by their serial number.
+  if (cfg->usb_serial && (!cfg->device || access(cfg->device, F_OK) != 0)) {
+    char *device = serial_hotplug_find(cfg->usb_serial);
+    if (device) {
+      free(cfg->device);
+      cfg->device = device;
+    }
+  }
+
+  if (serial_device_open(cfg) || !cfg->device) {
     return -1;
   }
 
-  cfg->ufd.fd = open(cfg->device, O_RDWR | O_CLOEXEC);
+  cfg->state = SERIAL_DEVICE_OPENING;
+
+  cfg->ufd.fd = open(cfg->device, O_RDWR | O_CLOEXEC | O_NONBLOCK);
   if (cfg->ufd.fd < 0) {
     if (!quiet) {
       syslog(LOG_ERR, "Failed to open serial device '%s'.", cfg->device);
@@ -136,90 +520,829 @@ int serial_init_device(struct serial_device *cfg, int quiet)
         cfg->device, strerror(errno), errno);
     }
     close(cfg->ufd.fd);
+    cfg->ufd.fd = -1;
     return -1;
   }
 
+  // Devices always start at base rate, higher rates are negotiated later.
   cfmakeraw(&serial_tio);
   cfsetispeed(&serial_tio, B115200);
   cfsetospeed(&serial_tio, B115200);
 
+  // Reads are driven by readiness events, so return whatever has arrived
+  // instead of waiting for a minimum number of bytes.
+  serial_tio.c_cc[VMIN] = 0;
+  serial_tio.c_cc[VTIME] = 0;
+
   if (tcsetattr(cfg->ufd.fd, TCSAFLUSH, &serial_tio) < 0) {
     if (!quiet) {
       syslog(LOG_ERR, "Failed to configure serial device '%s': %s (%d)",
         cfg->device, strerror(errno), errno);
     }
     close(cfg->ufd.fd);
+    cfg->ufd.fd = -1;
     return -1;
   }
 
-  cfg->ready = 1;
+  if (cfg->low_latency) {
+    serial_set_low_latency(cfg);
+  }
+
+  cfg->state = SERIAL_DEVICE_PROBING;
   cfg->ufd.cb = serial_fd_handler;
+  cfg->baudrate = SERIAL_BASE_BAUDRATE;
+
+  // A device that did not answer at base rate may have been left at a
+  // negotiated rate, so probe the other rates in order of preference.
+  if (cfg->probe > 0 && serial_set_speed(cfg, serial_baudrates[cfg->probe - 1].rate) != 0) {
+    cfg->baudrate = SERIAL_BASE_BAUDRATE;
+  }
+
+  cfg->link_state = SERIAL_LINK_BASE;
+  cfg->parse_errors = cfg->parser.errors;
+  cfg->error_window_count = 0;
+  uloop_timeout_cancel(&cfg->timer_negotiation);
+
+  cfg->parser.state = SERIAL_STATE_WAIT_START;
+  cfg->parser.length = 0;
 
+  cfg->tx_armed = 0;
   uloop_fd_add(&cfg->ufd, ULOOP_READ);
+  // While negotiation is held off (firmware flashing), the bootloader may be
+  // silent for longer and the flasher handles timeouts itself.
+  if (cfg->negotiate) {
+    uloop_timeout_set(&cfg->timer_state, SERIAL_PROBE_TIMEOUT);
+  }
 
   syslog(LOG_INFO, "Initialized serial device '%s'.", cfg->device);
 
   return 0;
 }
 
-int serial_reinit_device(struct serial_device *cfg)
+void serial_set_low_latency(struct serial_device *cfg)
+{
+  // Ask the tty layer to push received data immediately.
+  struct serial_struct serial_info;
+  if (ioctl(cfg->ufd.fd, TIOCGSERIAL, &serial_info) == 0) {
+    serial_info.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(cfg->ufd.fd, TIOCSSERIAL, &serial_info) != 0) {
+      syslog(LOG_WARNING, "Failed to enable low latency mode on serial device '%s': %s (%d)",
+        cfg->device, strerror(errno), errno);
+    }
+  }
+
+  // USB-serial adapters (FTDI) batch received data for up to 16 ms by default.
+  char path[PATH_MAX];
+  if (!realpath(cfg->device, path)) {
+    return;
+  }
+
+  char attribute[PATH_MAX + 64];
+  snprintf(attribute, sizeof(attribute), "/sys/class/tty/%s/device/latency_timer", strrchr(path, '/') + 1);
+  FILE *file = fopen(attribute, "w");
+  if (!file) {
+    // Not all adapters have a tunable latency timer.
+    return;
+  }
+
+  int written = fprintf(file, "%d", SERIAL_LATENCY_TIMER);
+  if (fclose(file) != 0 || written < 0) {
+    syslog(LOG_WARNING, "Failed to set latency timer of serial device '%s'.", cfg->device);
+    return;
+  }
+
+  syslog(LOG_INFO, "Set latency timer of serial device '%s' to %d ms.", cfg->device, SERIAL_LATENCY_TIMER);
+}
+
+void serial_close_device(struct serial_device *cfg)
+{
+  uloop_timeout_cancel(&cfg->timer_state);
+  uloop_timeout_cancel(&cfg->timer_negotiation);
+
+  if (cfg->ufd.fd >= 0) {
+    uloop_fd_delete(&cfg->ufd);
+    close(cfg->ufd.fd);
+    cfg->ufd.fd = -1;
+  }
+
+  serial_tx_clear(cfg);
+  cfg->restart_pending = 0;
+  cfg->state = SERIAL_DEVICE_BACKOFF;
+}
+
+void serial_fail_device(struct serial_device *cfg)
+{
+  serial_close_device(cfg);
+
+  // Missing devices are reattached by hotplug events instead of being polled.
+  if (uevent_socket.fd >= 0 && (!cfg->device || access(cfg->device, F_OK) != 0)) {
+    cfg->state = SERIAL_DEVICE_DETACHED;
+    return;
+  }
+
+  // Retry with exponential backoff until the device responds again.
+  uloop_timeout_set(&cfg->timer_state, cfg->backoff);
+  cfg->backoff *= 2;
+  if (cfg->backoff > SERIAL_BACKOFF_MAX) {
+    cfg->backoff = SERIAL_BACKOFF_MAX;
+  }
+}
+
+void serial_timer_state_handler(struct uloop_timeout *timer)
 {
-  cfg->ready = 0;
-  uloop_fd_delete(&cfg->ufd);
-  close(cfg->ufd.fd);
+  struct serial_device *cfg = container_of(timer, struct serial_device, timer_state);
+
+  switch (cfg->state) {
+    case SERIAL_DEVICE_RESETTING: {
+      if (cfg->reset_handler(0) != 0) {
+        syslog(LOG_ERR, "Failed to release reset of serial device '%s'.", cfg->device);
+      }
+
+      if (serial_init_device(cfg, 0) != 0) {
+        serial_fail_device(cfg);
+      }
+      break;
+    }
+
+    case SERIAL_DEVICE_BACKOFF: {
+      // Only report failures of the first attempt to avoid flooding the log.
+      if (serial_init_device(cfg, cfg->backoff > 2 * SERIAL_BACKOFF_MIN) != 0) {
+        serial_fail_device(cfg);
+      }
+      break;
+    }
+
+    case SERIAL_DEVICE_PROBING: {
+      if (++cfg->probe < SERIAL_BAUDRATE_COUNT) {
+        syslog(LOG_WARNING, "Serial device '%s' is not responding, probing at %u baud.", cfg->device,
+          serial_baudrates[cfg->probe - 1].rate);
+        serial_close_device(cfg);
+        if (serial_init_device(cfg, 0) != 0) {
+          serial_fail_device(cfg);
+        }
+        break;
+      }
 
-  return serial_init_device(cfg, 1);
+      cfg->probe = 0;
+      syslog(LOG_WARNING, "Serial device '%s' is not responding, reopening.", cfg->device);
+      serial_fail_device(cfg);
+      break;
+    }
+
+    default: {
+      // Stale timer.
+    }
+  }
 }
 
 void serial_fd_handler(struct uloop_fd *ufd, unsigned int events)
 {
   struct serial_device *cfg = serial_get_device_fd(ufd->fd);
-  if (!cfg || !cfg->ready) {
+  if (!cfg || !serial_device_open(cfg)) {
     return;
   }
 
+  // A hangup (e.g., an unplugged USB adapter) keeps the descriptor readable.
+  if (ufd->eof || ufd->error) {
+    syslog(LOG_ERR, "Serial device '%s' has hung up.", cfg->device);
+    serial_fail_device(cfg);
+    return;
+  }
+
+  if (events & ULOOP_WRITE) {
+    serial_tx_flush(cfg);
+    if (!serial_device_open(cfg)) {
+      return;
+    }
+  }
+
+  if (!(events & ULOOP_READ)) {
+    return;
+  }
+
+  METRICS_TIMER_START(handler);
+
   uint8_t buffer[1024];
   ssize_t size = read(cfg->ufd.fd, buffer, sizeof(buffer));
-  if (size < 0) {
-    syslog(LOG_ERR, "Failed to read from serial device.");
-    serial_reinit_device(cfg);
+  if (size == 0 || (size < 0 && (errno == EAGAIN || errno == EINTR))) {
+    // Without a minimum read size, no data is reported as end of file.
+    return;
+  } else if (size < 0) {
+    syslog(LOG_ERR, "Failed to read from serial device '%s'.", cfg->device);
+    serial_fail_device(cfg);
     return;
   }
 
+  METRICS_COUNT(METRICS_SERIAL_BYTES_READ, size);
   frame_parser_push_buffer(&cfg->parser, buffer, size);
+  serial_link_check_errors(cfg);
+
+  METRICS_TIMER_STOP(handler, METRICS_SERIAL_FD_HANDLER);
 }
 
-int serial_send_message(serial_device_t device, const message_t *message)
+int serial_send_message(serial_device_t device, const message_t *message, serial_priority_t priority)
 {
-  struct serial_device *cfg = serial_get_device(device);
-  if (!cfg || !cfg->ready) {
-    serial_reinit_device(cfg);
+  return serial_write_message(serial_get_device(device), message, priority);
+}
+
+int serial_write_message(struct serial_device *cfg, const message_t *message, serial_priority_t priority)
+{
+  // Closed devices are reopened by the state timer, never from the send path.
+  if (!cfg || !serial_device_open(cfg)) {
     return -1;
   }
 
-  if (cfg->ufd.fd < 0) {
-    serial_reinit_device(cfg);
+  // Frame into a worst-case (every byte escaped) buffer, then trim it to size.
+  size_t capacity = 2 * message_serialized_size(message) + 2;
+  struct serial_tx_frame *frame = (struct serial_tx_frame*) malloc(sizeof(struct serial_tx_frame) + capacity);
+  if (!frame) {
     return -1;
   }
 
-  static uint8_t buffer[FRAME_MAX_LENGTH];
-  ssize_t size = frame_message(buffer, sizeof(buffer), message);
+  METRICS_TIMER_START(frame);
+  ssize_t size = frame_message(frame->data, capacity, message);
+  METRICS_TIMER_STOP(frame, METRICS_FRAME_MESSAGE);
   if (size < 0) {
+    free(frame);
     return -1;
   }
 
-  size_t offset = 0;
-  while (offset < size) {
-    ssize_t written = write(cfg->ufd.fd, &buffer[offset], size - offset);
+  struct serial_tx_frame *trimmed = (struct serial_tx_frame*) realloc(frame, sizeof(struct serial_tx_frame) + size);
+  if (trimmed) {
+    frame = trimmed;
+  }
+
+  // Newer polls supersede older ones, so drop the oldest when over limit.
+  if (priority == SERIAL_PRIORITY_LOW && cfg->tx_queue_length[priority] >= SERIAL_TX_QUEUE_LOW_LIMIT) {
+    serial_tx_evict(cfg, priority);
+  }
+
+  while (memory_reserve(cfg->memory, size) != 0) {
+    if (list_empty(&cfg->tx_queue[SERIAL_PRIORITY_LOW]) || priority == SERIAL_PRIORITY_LOW) {
+      syslog(LOG_WARNING, "Transmit queue for serial device '%s' is full, dropping frame.", cfg->device);
+      cfg->tx_dropped++;
+      free(frame);
+      return -1;
+    }
+
+    serial_tx_evict(cfg, SERIAL_PRIORITY_LOW);
+  }
+
+  frame->queued_at = clock_monotonic_us();
+  frame->sequence = 0;
+  message_tlv_get_sequence_number(message, &frame->sequence);
+  frame->offset = 0;
+  frame->length = size;
+
+  list_add_tail(&frame->list, &cfg->tx_queue[priority]);
+  cfg->tx_queue_length[priority]++;
+  cfg->tx_bytes += size;
+
+  if (!cfg->tx_armed) {
+    // Try to write immediately, remaining data is written on readiness.
+    serial_tx_flush(cfg);
+
+    // A failed write closes the device and drops the queued frames.
+    if (!serial_device_open(cfg)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void serial_tx_drop(struct serial_device *cfg, struct serial_tx_frame *frame, serial_priority_t priority)
+{
+  list_del(&frame->list);
+  cfg->tx_queue_length[priority]--;
+  cfg->tx_bytes -= frame->length;
+  cfg->tx_dropped++;
+  memory_release(cfg->memory, frame->length);
+  free(frame);
+}
+
+void serial_tx_evict(struct serial_device *cfg, serial_priority_t priority)
+{
+  struct serial_tx_frame *frame = list_first_entry(&cfg->tx_queue[priority], struct serial_tx_frame, list);
+  uint32_t sequence = frame->sequence;
+  serial_tx_drop(cfg, frame, priority);
+
+  // The message was never written, so nothing will answer it.
+  if (cfg->drop_handler) {
+    cfg->drop_handler(sequence);
+  }
+}
+
+void serial_tx_clear(struct serial_device *cfg)
+{
+  if (cfg->tx_current) {
+    cfg->tx_bytes -= cfg->tx_current->length;
+    memory_release(cfg->memory, cfg->tx_current->length);
+    free(cfg->tx_current);
+    cfg->tx_current = NULL;
+  }
+
+  for (size_t i = 0; i < __SERIAL_PRIORITY_MAX; i++) {
+    while (!list_empty(&cfg->tx_queue[i])) {
+      serial_tx_drop(cfg, list_first_entry(&cfg->tx_queue[i], struct serial_tx_frame, list), i);
+    }
+  }
+}
+
+void serial_tx_flush(struct serial_device *cfg)
+{
+  for (;;) {
+    if (!cfg->tx_current) {
+      // Pick the oldest frame from the highest priority class.
+      for (int i = __SERIAL_PRIORITY_MAX - 1; i >= 0; i--) {
+        if (!list_empty(&cfg->tx_queue[i])) {
+          cfg->tx_current = list_first_entry(&cfg->tx_queue[i], struct serial_tx_frame, list);
+          list_del(&cfg->tx_current->list);
+          cfg->tx_queue_length[i]--;
+          break;
+        }
+      }
+
+      if (!cfg->tx_current) {
+        break;
+      }
+    }
+
+    struct serial_tx_frame *frame = cfg->tx_current;
+    ssize_t written = write(cfg->ufd.fd, &frame->data[frame->offset], frame->length - frame->offset);
     if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN) {
+        break;
+      }
+
       syslog(LOG_ERR, "Failed to write frame (%ld bytes) to serial device: %s (%d)",
-        (long int) size, strerror(errno), errno);
-      serial_reinit_device(cfg);
-      return -1;
+        (long int) frame->length, strerror(errno), errno);
+      serial_fail_device(cfg);
+      return;
+    }
+
+    frame->offset += written;
+    if (frame->offset < frame->length) {
+      // Device buffer is full, continue when it becomes writable.
+      break;
+    }
+
+    METRICS_COUNT(METRICS_SERIAL_BYTES_WRITTEN, frame->length);
+    METRICS_RECORD(METRICS_SERIAL_TX_QUEUE_TIME, clock_monotonic_us() - frame->queued_at);
+    cfg->tx_bytes -= frame->length;
+    cfg->tx_current = NULL;
+    memory_release(cfg->memory, frame->length);
+    free(frame);
+  }
+
+  if (!cfg->tx_current && cfg->restart_pending) {
+    serial_restart_device(cfg);
+    return;
+  }
+
+  // Only wait for write readiness while there is something to write.
+  uint8_t armed = cfg->tx_current != NULL;
+  if (armed != cfg->tx_armed) {
+    cfg->tx_armed = armed;
+    uloop_fd_add(&cfg->ufd, ULOOP_READ | (armed ? ULOOP_WRITE : 0));
+  }
+}
+
+int serial_set_speed(struct serial_device *cfg, uint32_t baudrate)
+{
+  speed_t speed = 0;
+  for (size_t i = 0; i < SERIAL_BAUDRATE_COUNT; i++) {
+    if (serial_baudrates[i].rate == baudrate) {
+      speed = serial_baudrates[i].speed;
+      break;
+    }
+  }
+
+  if (!speed) {
+    return -1;
+  }
+
+  struct termios serial_tio;
+  if (tcgetattr(cfg->ufd.fd, &serial_tio) < 0) {
+    return -1;
+  }
+
+  cfsetispeed(&serial_tio, speed);
+  cfsetospeed(&serial_tio, speed);
+
+  // Let any pending output drain at the old rate before switching.
+  if (tcsetattr(cfg->ufd.fd, TCSADRAIN, &serial_tio) < 0) {
+    syslog(LOG_ERR, "Failed to set serial device '%s' to %u baud: %s (%d)",
+      cfg->device, baudrate, strerror(errno), errno);
+    return -1;
+  }
+
+  // Bytes received around the switch are garbage, drop any partial frame.
+  cfg->parser.state = SERIAL_STATE_WAIT_START;
+  cfg->parser.length = 0;
+  cfg->baudrate = baudrate;
+
+  return 0;
+}
+
+void serial_message_received(struct serial_device *cfg, const message_t *message)
+{
+  tlv_reply_t reply = 0;
+  message_tlv_get_reply(message, &reply);
+  if (reply == REPLY_BAUDRATE_ACK) {
+    uint32_t baudrate;
+    if (message_tlv_get_baudrate(message, &baudrate) == MESSAGE_SUCCESS) {
+      serial_link_ack(cfg, baudrate);
+    }
+    return;
+  }
+
+  if (cfg->state == SERIAL_DEVICE_PROBING) {
+    uloop_timeout_cancel(&cfg->timer_state);
+    cfg->state = SERIAL_DEVICE_READY;
+    cfg->backoff = SERIAL_BACKOFF_MIN;
+    cfg->probe = 0;
+  }
+
+  // The first valid message shows that the device is alive at base rate.
+  if (cfg->link_state == SERIAL_LINK_BASE && cfg->negotiate) {
+    serial_link_start(cfg);
+  }
+
+  if (cfg->handler) {
+    cfg->handler(message);
+  }
+}
+
+void serial_link_start(struct serial_device *cfg)
+{
+  // Previously negotiated rate is the highest one that will be attempted.
+  char location[64];
+  snprintf(location, sizeof(location), "%s.baudrate", cfg->section);
+  uint32_t max_baudrate = uci_get_int(serial_uci, location, serial_baudrates[0].rate);
+
+  cfg->candidate = 0;
+  while (cfg->candidate < SERIAL_BAUDRATE_COUNT - 1 && serial_baudrates[cfg->candidate].rate > max_baudrate) {
+    cfg->candidate++;
+  }
+
+  if (serial_baudrates[cfg->candidate].rate == cfg->baudrate) {
+    cfg->link_state = SERIAL_LINK_ESTABLISHED;
+    return;
+  }
+
+  cfg->link_state = SERIAL_LINK_PROPOSE;
+  serial_link_propose(cfg);
+}
+
+void serial_link_propose(struct serial_device *cfg)
+{
+  message_t msg;
+  message_init(&msg);
+  message_tlv_add_command(&msg, COMMAND_SET_BAUDRATE);
+  message_tlv_add_baudrate(&msg, serial_baudrates[cfg->candidate].rate);
+  message_tlv_add_checksum(&msg);
+  int result = serial_write_message(cfg, &msg, SERIAL_PRIORITY_HIGH);
+  message_free(&msg);
+
+  if (result != 0) {
+    // Device has been closed and will be reopened at base rate.
+    return;
+  }
+
+  uloop_timeout_set(&cfg->timer_negotiation, SERIAL_NEGOTIATION_TIMEOUT);
+}
+
+void serial_link_next(struct serial_device *cfg)
+{
+  // Move on to the next lower rate, giving up when the current rate is reached.
+  cfg->candidate++;
+  if (cfg->candidate >= SERIAL_BAUDRATE_COUNT || serial_baudrates[cfg->candidate].rate == cfg->baudrate) {
+    syslog(LOG_INFO, "Serial device '%s' stays at %u baud.", cfg->device, cfg->baudrate);
+    cfg->link_state = SERIAL_LINK_ESTABLISHED;
+    cfg->error_window_count = 0;
+    return;
+  }
+
+  cfg->link_state = SERIAL_LINK_PROPOSE;
+  serial_link_propose(cfg);
+}
+
+void serial_link_ack(struct serial_device *cfg, uint32_t baudrate)
+{
+  if (baudrate != serial_baudrates[cfg->candidate].rate) {
+    return;
+  }
+
+  switch (cfg->link_state) {
+    case SERIAL_LINK_PROPOSE: {
+      // Device will switch after the acknowledgement, so switch as well and
+      // confirm that the link works at the new rate.
+      cfg->previous_baudrate = cfg->baudrate;
+      if (serial_set_speed(cfg, baudrate) != 0) {
+        uloop_timeout_cancel(&cfg->timer_negotiation);
+        serial_link_next(cfg);
+        return;
+      }
+
+      cfg->link_state = SERIAL_LINK_CONFIRM;
+      serial_link_propose(cfg);
+      break;
+    }
+
+    case SERIAL_LINK_CONFIRM: {
+      uloop_timeout_cancel(&cfg->timer_negotiation);
+      cfg->link_state = SERIAL_LINK_ESTABLISHED;
+      cfg->error_window_count = 0;
+      syslog(LOG_INFO, "Serial device '%s' switched to %u baud.", cfg->device, baudrate);
+
+      // Persist the negotiated rate.
+      char location[64];
+      snprintf(location, sizeof(location), "%s.baudrate", cfg->section);
+      if ((uint32_t) uci_get_int(serial_uci, location, 0) != baudrate) {
+        uci_set_int(serial_uci, location, baudrate);
+        if (uci_commit_package(serial_uci, "koruza") != 0) {
+          syslog(LOG_ERR, "Failed to commit negotiated serial link rate.");
+        }
+      }
+      break;
     }
 
-    offset += written;
+    default: {
+      // Ignore stale acknowledgements.
+    }
+  }
+}
+
+void serial_timer_negotiation_handler(struct uloop_timeout *timer)
+{
+  struct serial_device *cfg = container_of(timer, struct serial_device, timer_negotiation);
+
+  if (cfg->link_state == SERIAL_LINK_CONFIRM) {
+    // Device reverts to its previous rate when it does not receive the
+    // confirmation, so do the same.
+    if (serial_set_speed(cfg, cfg->previous_baudrate) != 0) {
+      serial_fail_device(cfg);
+      return;
+    }
+  }
+
+  serial_link_next(cfg);
+}
+
+void serial_link_check_errors(struct serial_device *cfg)
+{
+  uint32_t errors = cfg->parser.errors - cfg->parse_errors;
+  cfg->parse_errors = cfg->parser.errors;
+  if (!errors) {
+    return;
+  }
+
+  uint64_t now = clock_monotonic_us();
+  if (now - cfg->error_window_start > SERIAL_ERROR_BURST_WINDOW * 1000) {
+    cfg->error_window_start = now;
+    cfg->error_window_count = 0;
+  }
+
+  cfg->error_window_count += errors;
+
+  // Errors are expected while switching, only established links fall back.
+  if (cfg->link_state != SERIAL_LINK_ESTABLISHED || cfg->baudrate == SERIAL_BASE_BAUDRATE ||
+      cfg->error_window_count < SERIAL_ERROR_BURST_THRESHOLD) {
+    return;
+  }
+
+  syslog(LOG_WARNING, "Frame error burst on serial device '%s' at %u baud, falling back.",
+    cfg->device, cfg->baudrate);
+
+  cfg->candidate = 0;
+  while (serial_baudrates[cfg->candidate].rate >= cfg->baudrate) {
+    cfg->candidate++;
   }
 
+  cfg->link_state = SERIAL_LINK_PROPOSE;
+  serial_link_propose(cfg);
+}
+
+int serial_hotplug_init()
+{
+  uevent_socket.fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+  if (uevent_socket.fd < 0) {
+    return -1;
+  }
+
+  struct sockaddr_nl address;
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+  address.nl_groups = SERIAL_UEVENT_GROUP_KERNEL;
+  if (bind(uevent_socket.fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+    close(uevent_socket.fd);
+    uevent_socket.fd = -1;
+    return -1;
+  }
+
+  uevent_socket.cb = serial_hotplug_received;
+  uloop_fd_add(&uevent_socket, ULOOP_READ);
   return 0;
 }
+
+void serial_hotplug_received(struct uloop_fd *sock, unsigned int events)
+{
+  (void) events;
+
+  static char buffer[SERIAL_UEVENT_BUFFER];
+  for (;;) {
+    struct sockaddr_nl sender;
+    socklen_t sender_length = sizeof(sender);
+    ssize_t length = recvfrom(sock->fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT,
+      (struct sockaddr*) &sender, &sender_length);
+    if (length < 0) {
+      if (errno == ENOBUFS) {
+        // Events were lost, check for devices that appeared meanwhile.
+        syslog(LOG_WARNING, "Uevent buffer overrun, rescanning serial devices.");
+        serial_hotplug_resync();
+        continue;
+      }
+      break;
+    } else if (length == 0) {
+      break;
+    }
+
+    // Only trust events sent by the kernel.
+    if (sender.nl_pid != 0) {
+      continue;
+    }
+
+    // Payload is a header followed by NUL-separated KEY=VALUE pairs.
+    buffer[length] = '\0';
+    const char *action = NULL;
+    const char *subsystem = NULL;
+    const char *devname = NULL;
+    for (size_t offset = strlen(buffer) + 1; offset < (size_t) length; offset += strlen(&buffer[offset]) + 1) {
+      const char *field = &buffer[offset];
+      if (strncmp(field, "ACTION=", 7) == 0) {
+        action = field + 7;
+      } else if (strncmp(field, "SUBSYSTEM=", 10) == 0) {
+        subsystem = field + 10;
+      } else if (strncmp(field, "DEVNAME=", 8) == 0) {
+        devname = field + 8;
+      }
+    }
+
+    if (action && subsystem && devname) {
+      serial_hotplug_event(action, subsystem, devname);
+    }
+  }
+}
+
+void serial_hotplug_event(const char *action, const char *subsystem, const char *devname)
+{
+  if (strcmp(subsystem, "tty") != 0) {
+    return;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/dev/%s", devname);
+
+  struct serial_device *devices[] = { &device_motors, &device_accelerometer };
+  for (size_t i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+    struct serial_device *cfg = devices[i];
+    if (!cfg->device && !cfg->usb_serial) {
+      continue;
+    }
+
+    if (strcmp(action, "add") == 0) {
+      if (serial_device_open(cfg)) {
+        continue;
+      }
+
+      if (cfg->usb_serial) {
+        char serial[128];
+        if (serial_hotplug_read_serial(devname, serial, sizeof(serial)) != 0 ||
+            strcmp(serial, cfg->usb_serial) != 0) {
+          continue;
+        }
+
+        // Node name may differ between plugs, follow the serial number.
+        free(cfg->device);
+        cfg->device = strdup(path);
+      } else if (strcmp(cfg->device, path) != 0) {
+        continue;
+      }
+
+      syslog(LOG_INFO, "Serial device '%s' plugged in.", cfg->device);
+      serial_hotplug_attach(cfg);
+    } else if (strcmp(action, "remove") == 0) {
+      // A reset in progress notices the missing device once the line is released.
+      if (!cfg->device || strcmp(cfg->device, path) != 0 || cfg->state == SERIAL_DEVICE_DETACHED ||
+          cfg->state == SERIAL_DEVICE_RESETTING) {
+        continue;
+      }
+
+      syslog(LOG_INFO, "Serial device '%s' unplugged.", cfg->device);
+      serial_close_device(cfg);
+      cfg->state = SERIAL_DEVICE_DETACHED;
+    }
+  }
+}
+
+void serial_hotplug_attach(struct serial_device *cfg)
+{
+  // A reset in progress reopens the device itself once the line is released.
+  if (cfg->state == SERIAL_DEVICE_RESETTING) {
+    return;
+  }
+
+  uloop_timeout_cancel(&cfg->timer_state);
+  cfg->backoff = SERIAL_BACKOFF_MIN;
+  if (serial_init_device(cfg, 0) != 0) {
+    serial_fail_device(cfg);
+  }
+}
+
+void serial_hotplug_resync()
+{
+  struct serial_device *devices[] = { &device_motors, &device_accelerometer };
+  for (size_t i = 0; i < sizeof(devices) / sizeof(devices[0]); i++) {
+    struct serial_device *cfg = devices[i];
+    if (cfg->state != SERIAL_DEVICE_DETACHED) {
+      continue;
+    }
+
+    if (cfg->usb_serial) {
+      char *device = serial_hotplug_find(cfg->usb_serial);
+      if (!device) {
+        continue;
+      }
+
+      free(cfg->device);
+      cfg->device = device;
+    }
+
+    serial_hotplug_attach(cfg);
+  }
+}
+
+int serial_hotplug_read_serial(const char *devname, char *serial, size_t length)
+{
+  // Walk up from the tty towards the USB device that carries the serial number.
+  char link[PATH_MAX];
+  char path[PATH_MAX];
+  snprintf(link, sizeof(link), "/sys/class/tty/%s/device", devname);
+  if (!realpath(link, path)) {
+    return -1;
+  }
+
+  for (;;) {
+    char *separator = strrchr(path, '/');
+    if (!separator || strncmp(path, "/sys/devices/", 13) != 0) {
+      return -1;
+    }
+
+    char attribute[PATH_MAX + 8];
+    snprintf(attribute, sizeof(attribute), "%s/serial", path);
+    FILE *file = fopen(attribute, "r");
+    if (file) {
+      char *result = fgets(serial, length, file);
+      fclose(file);
+      if (!result) {
+        return -1;
+      }
+
+      serial[strcspn(serial, "\n")] = '\0';
+      return 0;
+    }
+
+    *separator = '\0';
+  }
+}
+
+char *serial_hotplug_find(const char *serial)
+{
+  DIR *directory = opendir("/sys/class/tty");
+  if (!directory) {
+    return NULL;
+  }
+
+  char *device = NULL;
+  struct dirent *entry;
+  while ((entry = readdir(directory)) != NULL) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+
+    char candidate[128];
+    if (serial_hotplug_read_serial(entry->d_name, candidate, sizeof(candidate)) == 0 &&
+        strcmp(candidate, serial) == 0) {
+      char path[PATH_MAX];
+      snprintf(path, sizeof(path), "/dev/%s", entry->d_name);
+      device = strdup(path);
+      break;
+    }
+  }
+
+  closedir(directory);
+  return device;
+}
@@ -32,8 +32,55 @@ typedef enum {
   DEVICE_ACCELEROMETER
 } serial_device_t;
 
+/**
+ * Transmit priority classes.
+ */
+typedef enum {
+  // Periodic polls, dropped first when the queue backs up.
+  SERIAL_PRIORITY_LOW,
+  // Commands that change device state (motion, stop, reset).
+  SERIAL_PRIORITY_HIGH,
+  __SERIAL_PRIORITY_MAX,
+} serial_priority_t;
+
+/**
+ * Handler for driving a device reset line.
+ *
+ * @param asserted Whether the reset should be asserted or released
+ * @return Zero on success, -1 on failure
+ */
+typedef int (*serial_reset_handler)(int asserted);
+
+/**
+ * Handler for frames dropped from the transmit queue before being written.
+ *
+ * @param sequence Sequence number of the dropped message (zero if none)
+ */
+typedef void (*serial_drop_handler)(uint32_t sequence);
+
+/**
+ * Transmit queue statistics.
+ */
+struct serial_queue_stats {
+  // Number of frames waiting to be written.
+  uint32_t depth;
+  // Number of bytes waiting to be written.
+  uint32_t bytes;
+  // Time the oldest frame has been waiting (in milliseconds).
+  uint32_t oldest;
+  // Number of frames dropped due to queue limits.
+  uint32_t dropped;
+};
+
 int serial_init(struct uci_context *uci);
-int serial_send_message(serial_device_t device, const message_t *message);
+int serial_send_message(serial_device_t device, const message_t *message, serial_priority_t priority);
+int serial_get_queue_stats(serial_device_t device, struct serial_queue_stats *stats);
 void serial_set_message_handler(serial_device_t device, frame_message_handler handler);
+void serial_set_reset_handler(serial_device_t device, serial_reset_handler handler);
+void serial_set_drop_handler(serial_device_t device, serial_drop_handler handler);
+int serial_reset(serial_device_t device);
+int serial_restart(serial_device_t device);
+void serial_set_link_negotiation(serial_device_t device, int enabled);
+uint32_t serial_get_baudrate(serial_device_t device);
 
 #endif
@@ -0,0 +1,172 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "statistics.h"
+
+#include <math.h>
+#include <string.h>
+
+// Goertzel filter coefficients for each spectrum bin.
+static float spectrum_coefficients[ACCELEROMETER_SPECTRUM_BINS];
+static int spectrum_initialized = 0;
+
+void accelerometer_statistics_resync(struct accelerometer_statistics_item *item);
+void accelerometer_statistics_push_max(struct accelerometer_statistics_item *item, float max);
+void accelerometer_statistics_goertzel_step(float * restrict s1,
+                                            float * restrict s2,
+                                            const float * restrict coefficients,
+                                            float value);
+
+void accelerometer_statistics_update(struct accelerometer_statistics_item *item, float avg, float max)
+{
+  const size_t size = ACCELEROMETER_STATISTICS_BUFFER_SIZE;
+  double value = avg;
+  double old_value = item->buffer[item->index];
+
+  accelerometer_statistics_push_max(item, max);
+  item->buffer[item->index] = avg;
+
+  if (item->samples < size) {
+    // Window is still filling up, use the regular Welford update.
+    item->samples++;
+    double delta = value - item->mean;
+    item->mean += delta / (double) item->samples;
+    item->m2 += delta * (value - item->mean);
+  } else {
+    // Window is full, replace the oldest sample.
+    double old_mean = item->mean;
+    item->mean += (value - old_value) / (double) size;
+    item->m2 += (value - old_value) * (value - item->mean + old_value - old_mean);
+  }
+
+  item->index = (item->index + 1) % size;
+  if (item->index == 0) {
+    // Discard accumulated rounding errors once per window.
+    accelerometer_statistics_resync(item);
+  }
+
+  if (item->m2 < 0) {
+    item->m2 = 0;
+  }
+
+  item->average = (float) item->mean;
+  item->variance = (float) (item->m2 / (double) item->samples);
+  item->maximum = item->buffer_max[item->max_deque[item->max_head] % size];
+}
+
+void accelerometer_statistics_push_max(struct accelerometer_statistics_item *item, float max)
+{
+  const size_t size = ACCELEROMETER_STATISTICS_BUFFER_SIZE;
+  size_t sequence = item->sequence++;
+
+  // Expire the sample that is about to leave the window.
+  while (item->max_length && sequence - item->max_deque[item->max_head] >= size) {
+    item->max_head = (item->max_head + 1) % size;
+    item->max_length--;
+  }
+
+  item->buffer_max[sequence % size] = max;
+
+  // Drop all samples that can no longer be the maximum.
+  while (item->max_length) {
+    size_t back = item->max_deque[(item->max_head + item->max_length - 1) % size];
+    if (item->buffer_max[back % size] > max) {
+      break;
+    }
+    item->max_length--;
+  }
+
+  item->max_deque[(item->max_head + item->max_length) % size] = sequence;
+  item->max_length++;
+}
+
+void accelerometer_statistics_resync(struct accelerometer_statistics_item *item)
+{
+  double sum = 0;
+  for (size_t i = 0; i < item->samples; i++) {
+    sum += item->buffer[i];
+  }
+  item->mean = sum / (double) item->samples;
+
+  item->m2 = 0;
+  for (size_t i = 0; i < item->samples; i++) {
+    double delta = item->buffer[i] - item->mean;
+    item->m2 += delta * delta;
+  }
+}
+
+void accelerometer_statistics_goertzel_step(float * restrict s1,
+                                            float * restrict s2,
+                                            const float * restrict coefficients,
+                                            float value)
+{
+  // Bins are independent, so this loop is vectorized across all bins.
+  for (size_t k = 0; k < ACCELEROMETER_SPECTRUM_BINS; k++) {
+    float s0 = value + coefficients[k] * s1[k] - s2[k];
+    s2[k] = s1[k];
+    s1[k] = s0;
+  }
+}
+
+void accelerometer_statistics_spectrum(struct accelerometer_statistics_item *item, float sample_rate)
+{
+  const size_t size = ACCELEROMETER_STATISTICS_BUFFER_SIZE;
+
+  item->frequency = 0;
+  item->energy = 0;
+  if (item->samples < size) {
+    return;
+  }
+
+  if (!spectrum_initialized) {
+    for (size_t k = 0; k < ACCELEROMETER_SPECTRUM_BINS; k++) {
+      spectrum_coefficients[k] = 2.0 * cos(2.0 * M_PI * (double) (k + 1) / (double) size);
+    }
+    spectrum_initialized = 1;
+  }
+
+  float s1[ACCELEROMETER_SPECTRUM_BINS];
+  float s2[ACCELEROMETER_SPECTRUM_BINS];
+  memset(s1, 0, sizeof(s1));
+  memset(s2, 0, sizeof(s2));
+
+  // Power spectrum does not depend on the rotation of the window, so the
+  // ring buffer can be processed in storage order.
+  float mean = (float) item->mean;
+  for (size_t n = 0; n < size; n++) {
+    accelerometer_statistics_goertzel_step(s1, s2, spectrum_coefficients, item->buffer[n] - mean);
+  }
+
+  float max_power = 0;
+  size_t max_bin = 0;
+  for (size_t k = 0; k < ACCELEROMETER_SPECTRUM_BINS; k++) {
+    float power = s1[k] * s1[k] + s2[k] * s2[k] - spectrum_coefficients[k] * s1[k] * s2[k];
+    if (power > max_power) {
+      max_power = power;
+      max_bin = k + 1;
+    }
+  }
+
+  if (!max_bin) {
+    return;
+  }
+
+  // Mean power of the dominant sinusoidal component.
+  item->frequency = (float) max_bin * sample_rate / (float) size;
+  item->energy = 2.0 * max_power / ((float) size * (float) size);
+}
@@ -0,0 +1,78 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_STATISTICS_H
+#define KORUZA_DRIVER_STATISTICS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Accelerometer statistics window size (in number of samples).
+#define ACCELEROMETER_STATISTICS_BUFFER_SIZE 120
+// Number of frequency bins used in spectrum analysis (excluding DC).
+#define ACCELEROMETER_SPECTRUM_BINS (ACCELEROMETER_STATISTICS_BUFFER_SIZE / 2)
+
+/**
+ * Sliding window statistics over accelerometer samples.
+ */
+struct accelerometer_statistics_item {
+  float average;
+  float variance;
+  float maximum;
+
+  // Dominant vibration frequency (in Hz) and its energy.
+  float frequency;
+  float energy;
+
+  float buffer[ACCELEROMETER_STATISTICS_BUFFER_SIZE];
+  float buffer_max[ACCELEROMETER_STATISTICS_BUFFER_SIZE];
+  size_t samples;
+  size_t index;
+
+  // Running mean and sum of squared differences from the mean.
+  double mean;
+  double m2;
+
+  // Monotonic deque of sample sequence numbers for the sliding maximum.
+  size_t max_deque[ACCELEROMETER_STATISTICS_BUFFER_SIZE];
+  size_t max_head;
+  size_t max_length;
+  size_t sequence;
+};
+
+/**
+ * Adds a new sample to the statistics window. All statistics are updated
+ * in constant time.
+ *
+ * @param item Statistics item
+ * @param avg Average value of the sample
+ * @param max Maximum value of the sample
+ */
+void accelerometer_statistics_update(struct accelerometer_statistics_item *item, float avg, float max);
+
+/**
+ * Performs spectrum analysis over the statistics window and updates the
+ * dominant frequency and its energy. Spectrum is only computed once the
+ * window is full.
+ *
+ * @param item Statistics item
+ * @param sample_rate Rate at which samples are added (in Hz)
+ */
+void accelerometer_statistics_spectrum(struct accelerometer_statistics_item *item, float sample_rate);
+
+#endif
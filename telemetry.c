@@ -0,0 +1,129 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "telemetry.h"
+#include "crc32.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+static size_t telemetry_template_value(const struct telemetry_template *template, uint8_t type)
+{
+  const uint8_t *buffer = template->buffer;
+  size_t offset = 0;
+  while (offset + sizeof(uint8_t) + sizeof(uint16_t) <= template->length) {
+    uint16_t length;
+    memcpy(&length, &buffer[offset + sizeof(uint8_t)], sizeof(uint16_t));
+    if (buffer[offset] == type) {
+      return offset + sizeof(uint8_t) + sizeof(uint16_t);
+    }
+
+    offset += sizeof(uint8_t) + sizeof(uint16_t) + ntohs(length);
+  }
+
+  return 0;
+}
+
+int telemetry_template_build(struct telemetry_template *template, const tlv_net_hello_t *hello,
+                             const struct auth_key *key)
+{
+  memset(template, 0, sizeof(struct telemetry_template));
+  if (key && !key->enabled) {
+    key = NULL;
+  }
+
+  // Build the message once with placeholder values.
+  message_t msg;
+  message_init(&msg);
+  message_tlv_add_net_hello(&msg, hello);
+  message_tlv_add_sequence_number(&msg, 0);
+  message_tlv_add_power_reading(&msg, 0);
+
+  tlv_motor_position_t position;
+  memset(&position, 0, sizeof(position));
+  message_tlv_add_motor_position(&msg, &position);
+
+  tlv_net_alignment_t alignment;
+  memset(&alignment, 0, sizeof(alignment));
+  message_tlv_add_net_alignment(&msg, &alignment);
+  message_tlv_add_checksum(&msg);
+
+  size_t length = message_serialized_size(&msg);
+  size_t total = length + (key ? TELEMETRY_SIGNATURE_SIZE : 0);
+  if (total > TELEMETRY_TEMPLATE_SIZE || message_serialize(template->buffer, length, &msg) != length) {
+    message_free(&msg);
+    return -1;
+  }
+  message_free(&msg);
+
+  template->length = length;
+  if (key) {
+    uint16_t mac_length = htons(AUTH_MAC_LENGTH);
+    template->buffer[length] = TLV_NET_SIGNATURE;
+    memcpy(&template->buffer[length + sizeof(uint8_t)], &mac_length, sizeof(uint16_t));
+    template->signature = length;
+    template->length = total;
+    template->key = key;
+  }
+
+  template->sequence = telemetry_template_value(template, TLV_SEQUENCE_NUMBER);
+  template->rx_power = telemetry_template_value(template, TLV_POWER_READING);
+  template->position = telemetry_template_value(template, TLV_MOTOR_POSITION);
+  template->alignment = telemetry_template_value(template, TLV_NET_ALIGNMENT);
+  template->checksum = telemetry_template_value(template, TLV_CHECKSUM);
+
+  // The hello value never changes, so its checksum is computed only once.
+  template->prefix_checksum = crc32(0, &template->buffer[telemetry_template_value(template, TLV_NET_HELLO)],
+                                    sizeof(tlv_net_hello_t));
+
+  return 0;
+}
+
+void telemetry_template_update(struct telemetry_template *template, uint32_t sequence, uint16_t rx_power,
+                               const tlv_motor_position_t *position, uint32_t alignment)
+{
+  uint8_t *buffer = template->buffer;
+
+  sequence = htonl(sequence);
+  memcpy(&buffer[template->sequence], &sequence, sizeof(uint32_t));
+
+  rx_power = htons(rx_power);
+  memcpy(&buffer[template->rx_power], &rx_power, sizeof(uint16_t));
+
+  tlv_motor_position_t value;
+  value.x = htonl(position->x);
+  value.y = htonl(position->y);
+  value.z = htonl(position->z);
+  memcpy(&buffer[template->position], &value, sizeof(tlv_motor_position_t));
+
+  alignment = htonl(alignment);
+  memcpy(&buffer[template->alignment], &alignment, sizeof(uint32_t));
+
+  // Continue the checksum from the constant prefix over the patched values.
+  uint32_t checksum = template->prefix_checksum;
+  checksum = crc32(checksum, &buffer[template->sequence], sizeof(uint32_t));
+  checksum = crc32(checksum, &buffer[template->rx_power], sizeof(uint16_t));
+  checksum = crc32(checksum, &buffer[template->position], sizeof(tlv_motor_position_t));
+  checksum = crc32(checksum, &buffer[template->alignment], sizeof(uint32_t));
+  checksum = htonl(checksum);
+  memcpy(&buffer[template->checksum], &checksum, sizeof(uint32_t));
+
+  if (template->key) {
+    auth_sign(template->key, buffer, template->signature, &buffer[template->length - AUTH_MAC_LENGTH]);
+  }
+}
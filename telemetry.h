@@ -0,0 +1,78 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_TELEMETRY_H
+#define KORUZA_DRIVER_TELEMETRY_H
+
+#include "auth.h"
+#include "message.h"
+
+#include <stddef.h>
+
+// Maximum size of a telemetry message.
+#define TELEMETRY_TEMPLATE_SIZE 128
+// Size of the signature TLV appended to authenticated messages.
+#define TELEMETRY_SIGNATURE_SIZE (sizeof(uint8_t) + sizeof(uint16_t) + AUTH_MAC_LENGTH)
+
+/**
+ * Pre-serialized periodic telemetry message with offsets of the values
+ * patched on each send.
+ */
+struct telemetry_template {
+  uint8_t buffer[TELEMETRY_TEMPLATE_SIZE];
+  size_t length;
+
+  size_t sequence;
+  size_t rx_power;
+  size_t position;
+  size_t alignment;
+  size_t checksum;
+  // Offset of the signature TLV (zero when not authenticated).
+  size_t signature;
+  // Key used to sign the message (NULL when not authenticated).
+  const struct auth_key *key;
+
+  // Checksum over the constant values preceding the patched ones.
+  uint32_t prefix_checksum;
+};
+
+/**
+ * Builds the telemetry message once with placeholder values.
+ *
+ * @param template Destination template
+ * @param hello Hello TLV identifying this unit
+ * @param key Key to sign messages with (NULL or disabled when not authenticated)
+ * @return 0 on success, -1 when the message does not fit
+ */
+int telemetry_template_build(struct telemetry_template *template, const tlv_net_hello_t *hello,
+                             const struct auth_key *key);
+
+/**
+ * Patches the values of a telemetry template and updates its checksum and
+ * signature, so that the buffer can be sent as is.
+ *
+ * @param template Template to update
+ * @param sequence Sequence number
+ * @param rx_power Received power reading
+ * @param position Motor position (host byte order)
+ * @param alignment Alignment state
+ */
+void telemetry_template_update(struct telemetry_template *template, uint32_t sequence, uint16_t rx_power,
+                               const tlv_motor_position_t *position, uint32_t alignment);
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "auth.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Number of iterations used for the benchmark.
+#define BENCHMARK_ITERATIONS 100000
+// Size of a typical telemetry message.
+#define BENCHMARK_MESSAGE_SIZE 96
+
+static int check_digest(const char *name, const uint8_t *digest, const uint8_t *expected, size_t length)
+{
+  if (memcmp(digest, expected, length) != 0) {
+    printf("BLAKE2s test vector '%s' failed.\n", name);
+    return -1;
+  }
+
+  return 0;
+}
+
+static double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+  return (double) (end->tv_sec - start->tv_sec) * 1e9 + (double) (end->tv_nsec - start->tv_nsec);
+}
+
+int main()
+{
+  struct blake2s_state state;
+  uint8_t digest[BLAKE2S_MAX_SIZE];
+
+  // RFC 7693, Appendix B.
+  const uint8_t abc_digest[] = {
+    0x50, 0x8C, 0x5E, 0x8C, 0x32, 0x7C, 0x14, 0xE2, 0xE1, 0xA7, 0x2B, 0xA3, 0x4E, 0xEB, 0x45, 0x2F,
+    0x37, 0x45, 0x8B, 0x20, 0x9E, 0xD6, 0x3A, 0x29, 0x4D, 0x99, 0x9B, 0x4C, 0x86, 0x67, 0x59, 0x82,
+  };
+  blake2s_init(&state, 32, NULL, 0);
+  blake2s_update(&state, (const uint8_t*) "abc", 3);
+  blake2s_final(&state, digest);
+  if (check_digest("abc", digest, abc_digest, 32) != 0) {
+    return -1;
+  }
+
+  // Keyed hash of a 64 byte message (BLAKE2 reference KAT), which also
+  // exercises the precomputed key block.
+  const uint8_t keyed_digest[] = {
+    0x89, 0x75, 0xB0, 0x57, 0x7F, 0xD3, 0x55, 0x66, 0xD7, 0x50, 0xB3, 0x62, 0xB0, 0x89, 0x7A, 0x26,
+    0xC3, 0x99, 0x13, 0x6D, 0xF0, 0x7B, 0xAB, 0xAB, 0xBD, 0xE6, 0x20, 0x3F, 0xF2, 0x95, 0x4E, 0xD4,
+  };
+  uint8_t key[32];
+  uint8_t data[BENCHMARK_MESSAGE_SIZE];
+  for (size_t i = 0; i < sizeof(key); i++) {
+    key[i] = i;
+  }
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = i;
+  }
+  blake2s_init(&state, 32, key, sizeof(key));
+  blake2s_precompute(&state);
+  blake2s_update(&state, data, 64);
+  blake2s_final(&state, digest);
+  if (check_digest("keyed", digest, keyed_digest, 32) != 0) {
+    return -1;
+  }
+
+  // Authentication codes must only verify for the signed message and key.
+  struct auth_key auth;
+  struct auth_key other;
+  uint8_t mac[AUTH_MAC_LENGTH];
+  auth_key_init(&auth, "koruza", 6);
+  auth_key_init(&other, "koruzA", 6);
+  auth_sign(&auth, data, sizeof(data), mac);
+  if (auth_verify(&auth, data, sizeof(data), mac) != 0) {
+    printf("Valid authentication code rejected.\n");
+    return -1;
+  }
+  if (auth_verify(&other, data, sizeof(data), mac) == 0) {
+    printf("Authentication code accepted with a wrong key.\n");
+    return -1;
+  }
+  data[10] ^= 1;
+  if (auth_verify(&auth, data, sizeof(data), mac) == 0) {
+    printf("Authentication code accepted for a modified message.\n");
+    return -1;
+  }
+  data[10] ^= 1;
+
+  // Replay window.
+  struct auth_replay_window window;
+  uint32_t skipped;
+  memset(&window, 0, sizeof(window));
+  if (auth_replay_check(&window, 0xFFFFFFF0, NULL) != 0 ||
+      auth_replay_check(&window, 0xFFFFFFF0, NULL) == 0 ||
+      auth_replay_check(&window, 0xFFFFFFF5, &skipped) != 0 || skipped != 4 ||
+      auth_replay_check(&window, 0xFFFFFFF2, NULL) != 0 ||
+      auth_replay_check(&window, 0xFFFFFFF2, NULL) == 0 ||
+      auth_replay_check(&window, 0x00000010, &skipped) != 0 || skipped != 26 ||
+      auth_replay_check(&window, 0xFFFFFFF3, NULL) != 0 ||
+      auth_replay_check(&window, 0xFFFFFFD0, NULL) == 0 ||
+      auth_replay_check(&window, 0x00001000, NULL) != 0 ||
+      auth_replay_check(&window, 0x00000010, NULL) == 0) {
+    printf("Replay window check failed.\n");
+    return -1;
+  }
+
+  // A recorded burst of consecutive messages from behind the window must
+  // never be accepted, however long it is.
+  for (uint32_t i = 0; i < 2 * AUTH_REPLAY_WINDOW; i++) {
+    if (auth_replay_check(&window, 0x100 + i, NULL) == 0) {
+      printf("Replay window accepted a replayed burst.\n");
+      return -1;
+    }
+  }
+  if (auth_replay_check(&window, 0x00001001, NULL) != 0) {
+    printf("Replay window rejected a fresh sequence number after a replayed burst.\n");
+    return -1;
+  }
+
+  // Benchmark signing and verification of a typical telemetry message.
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    data[0] = i;
+    auth_sign(&auth, data, sizeof(data), mac);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double sign_ns = elapsed_ns(&start, &end) / BENCHMARK_ITERATIONS;
+
+  int failures = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (size_t i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    failures += auth_verify(&auth, data, sizeof(data), mac) != 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double verify_ns = elapsed_ns(&start, &end) / BENCHMARK_ITERATIONS;
+
+  if (failures) {
+    printf("Verification failed during benchmark.\n");
+    return -1;
+  }
+
+  printf("Authentication of %d byte messages: sign %.0f ns, verify %.0f ns per message.\n",
+    BENCHMARK_MESSAGE_SIZE, sign_ns, verify_ns);
+
+  return 0;
+}
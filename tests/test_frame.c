@@ -17,6 +17,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "frame.h"
+#include "memory.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,6 +56,10 @@ static void validate_message_handler(const message_t *message)
   number_parsed_messages++;
 }
 
+static void validate_large_message_handler(const message_t *message)
+{
+}
+
 int main()
 {
   message_t msg;
@@ -90,6 +95,11 @@ int main()
   frame_parser_push_byte(&parser, FRAME_MARKER_END);
   frame_parser_push_buffer(&parser, frame, frame_size);
   frame_parser_push_byte(&parser, 0x10);
+  uint32_t errors = parser.errors;
+
+  // Corrupt the message contents so the checksum no longer matches.
+  frame[frame_size - 4] ^= 0x01;
+  frame_parser_push_buffer(&parser, frame, frame_size);
   frame_parser_free(&parser);
 
   if (number_parsed_messages != 1) {
@@ -97,7 +107,53 @@ int main()
     return -1;
   }
 
+  if (parser.errors != errors + 1) {
+    printf("Failed to count corrupted frame.\n");
+    return -1;
+  }
+
   message_free(&msg);
 
+  // All parser and message memory should be returned to the budget.
+  if (memory_get_usage(MEMORY_PARSER)->current != 0 || memory_get_usage(MEMORY_MESSAGE)->current != 0) {
+    printf("Memory budget was not released.\n");
+    return -1;
+  }
+
+  // Parser buffer grows geometrically for large frames and shrinks back after small ones.
+  message_t large;
+  message_init(&large);
+  uint8_t payload[4000] = {0,};
+  message_tlv_add(&large, TLV_COMMAND, sizeof(payload), payload);
+  message_tlv_add_checksum(&large);
+  uint8_t *large_frame = (uint8_t*) malloc(2 * message_serialized_size(&large) + 2);
+  ssize_t large_size = frame_message(large_frame, 2 * message_serialized_size(&large) + 2, &large);
+  message_free(&large);
+
+  frame_parser_init(&parser);
+  parser.handler = validate_large_message_handler;
+  frame_parser_push_buffer(&parser, large_frame, large_size);
+  free(large_frame);
+  if (parser.buffer_size != 4096) {
+    printf("Unexpected parser buffer size %u after large frame.\n", (unsigned int) parser.buffer_size);
+    return -1;
+  }
+
+  for (size_t i = 0; i < 4 * FRAME_PARSER_SHRINK_FRAMES; i++) {
+    frame_parser_push_buffer(&parser, frame, frame_size);
+  }
+
+  if (parser.buffer_size != FRAME_PARSER_INITIAL_SIZE) {
+    printf("Unexpected parser buffer size %u after small frames.\n", (unsigned int) parser.buffer_size);
+    return -1;
+  }
+
+  if (memory_get_usage(MEMORY_PARSER)->peak < 4096) {
+    printf("Peak parser memory was not recorded.\n");
+    return -1;
+  }
+
+  frame_parser_free(&parser);
+
   return 0;
 }
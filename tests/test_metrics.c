@@ -0,0 +1,54 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "metrics.h"
+
+#include <stdio.h>
+
+int main()
+{
+  for (uint64_t value = 1; value <= 1000; value++) {
+    metrics_record(METRICS_MCU_ROUND_TRIP, value);
+  }
+
+  const struct metrics_histogram *histogram = metrics_get_histogram(METRICS_MCU_ROUND_TRIP);
+  uint32_t p50 = metrics_histogram_percentile(histogram, 50);
+  uint32_t p90 = metrics_histogram_percentile(histogram, 90);
+  uint32_t p99 = metrics_histogram_percentile(histogram, 99);
+  uint32_t p100 = metrics_histogram_percentile(histogram, 100);
+  printf("p50=%u p90=%u p99=%u p100=%u\n", p50, p90, p99, p100);
+
+  // Buckets keep 3 bits of precision, so bounds are within 12.5% above.
+  if (histogram->count != 1000 || histogram->min != 1 || histogram->max != 1000 ||
+      p50 < 500 || p50 > 563 ||
+      p90 < 900 || p90 > 1000 ||
+      p99 < 990 || p99 > 1000 ||
+      p100 != 1000) {
+    printf("Percentiles are invalid.\n");
+    return -1;
+  }
+
+  metrics_reset();
+  if (metrics_get_histogram(METRICS_MCU_ROUND_TRIP)->count != 0 ||
+      metrics_histogram_percentile(histogram, 50) != 0) {
+    printf("Reset did not clear histogram.\n");
+    return -1;
+  }
+
+  return 0;
+}
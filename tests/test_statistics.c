@@ -0,0 +1,93 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "statistics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define NUMBER_OF_SAMPLES 1000
+
+int main()
+{
+  struct accelerometer_statistics_item item;
+  memset(&item, 0, sizeof(item));
+
+  float avg_samples[NUMBER_OF_SAMPLES];
+  float max_samples[NUMBER_OF_SAMPLES];
+
+  srand(42);
+  for (size_t i = 0; i < NUMBER_OF_SAMPLES; i++) {
+    avg_samples[i] = 1000.0 + (float) (rand() % 2000) / 10.0;
+    max_samples[i] = (float) (rand() % 5000);
+
+    accelerometer_statistics_update(&item, avg_samples[i], max_samples[i]);
+
+    // Compute reference statistics over the window.
+    size_t first = (i + 1 > ACCELEROMETER_STATISTICS_BUFFER_SIZE) ? i + 1 - ACCELEROMETER_STATISTICS_BUFFER_SIZE : 0;
+    size_t count = i + 1 - first;
+    double average = 0;
+    double variance = 0;
+    float maximum = -INFINITY;
+    for (size_t j = first; j <= i; j++) {
+      average += avg_samples[j];
+      if (max_samples[j] > maximum) {
+        maximum = max_samples[j];
+      }
+    }
+    average /= (double) count;
+    for (size_t j = first; j <= i; j++) {
+      variance += (avg_samples[j] - average) * (avg_samples[j] - average);
+    }
+    variance /= (double) count;
+
+    if (item.samples != count ||
+        fabs(item.average - average) > 1e-3 ||
+        fabs(item.variance - variance) > 1e-2 * (variance + 1.0) ||
+        item.maximum != maximum) {
+      printf("Statistics mismatch at sample %u: average %f (expected %f), variance %f (expected %f), "
+             "maximum %f (expected %f).\n",
+        (unsigned int) i, item.average, average, item.variance, variance, item.maximum, maximum);
+      return -1;
+    }
+  }
+
+  printf("Statistics match reference values for %u samples.\n", NUMBER_OF_SAMPLES);
+
+  // Spectrum analysis of a pure sinusoid at a known frequency.
+  const float sample_rate = 2.0;
+  const float frequency = 0.25;
+  const float amplitude = 50.0;
+  memset(&item, 0, sizeof(item));
+  for (size_t i = 0; i < ACCELEROMETER_STATISTICS_BUFFER_SIZE; i++) {
+    float value = 1000.0 + amplitude * sin(2.0 * M_PI * frequency * (float) i / sample_rate);
+    accelerometer_statistics_update(&item, value, value);
+  }
+  accelerometer_statistics_spectrum(&item, sample_rate);
+
+  printf("Dominant frequency %f Hz with energy %f.\n", item.frequency, item.energy);
+  if (fabs(item.frequency - frequency) > 1e-3 ||
+      fabs(item.energy - amplitude * amplitude / 2.0) > 1.0) {
+    printf("Spectrum analysis returned invalid values.\n");
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,95 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "telemetry.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <string.h>
+
+static int check_template(struct telemetry_template *template, const struct auth_key *key)
+{
+  tlv_motor_position_t position = {-18004, 12345, 0};
+  telemetry_template_update(template, 0xDEADBEEF, 0x1234, &position, 3);
+
+  // The signature covers everything before the signature TLV.
+  if (key && (template->signature != template->length - TELEMETRY_SIGNATURE_SIZE ||
+              auth_verify(key, template->buffer, template->signature,
+                          &template->buffer[template->length - AUTH_MAC_LENGTH]) != 0)) {
+    printf("Patched template has an invalid signature.\n");
+    return -1;
+  }
+
+  // Parsing also verifies the checksum.
+  message_t msg;
+  if (message_parse(&msg, template->buffer, template->length) != MESSAGE_SUCCESS) {
+    printf("Patched template does not parse.\n");
+    return -1;
+  }
+
+  tlv_net_hello_t hello;
+  uint32_t sequence;
+  uint16_t rx_power;
+  tlv_motor_position_t parsed_position;
+  tlv_net_alignment_t alignment;
+  if (message_tlv_get_net_hello(&msg, &hello) != MESSAGE_SUCCESS ||
+      message_tlv_get_sequence_number(&msg, &sequence) != MESSAGE_SUCCESS ||
+      message_tlv_get(&msg, TLV_POWER_READING, (uint8_t*) &rx_power, sizeof(uint16_t)) != MESSAGE_SUCCESS ||
+      message_tlv_get_motor_position(&msg, &parsed_position) != MESSAGE_SUCCESS ||
+      message_tlv_get_net_alignment(&msg, &alignment) != MESSAGE_SUCCESS ||
+      strcmp(hello.id, "KORUZA-1042") != 0 ||
+      sequence != 0xDEADBEEF ||
+      ntohs(rx_power) != 0x1234 ||
+      parsed_position.x != position.x ||
+      parsed_position.y != position.y ||
+      parsed_position.z != position.z ||
+      alignment.state != 3) {
+    printf("Patched template values are invalid.\n");
+    message_free(&msg);
+    return -1;
+  }
+
+  message_free(&msg);
+  return 0;
+}
+
+int main()
+{
+  tlv_net_hello_t hello = {1, "KORUZA-1042"};
+  struct telemetry_template template;
+
+  if (telemetry_template_build(&template, &hello, NULL) != 0 || check_template(&template, NULL) != 0) {
+    printf("Unauthenticated telemetry template check failed.\n");
+    return -1;
+  }
+
+  struct auth_key key;
+  auth_key_init(&key, "koruza", 6);
+  if (telemetry_template_build(&template, &hello, &key) != 0 || check_template(&template, &key) != 0) {
+    printf("Authenticated telemetry template check failed.\n");
+    return -1;
+  }
+
+  // Patching again must keep the message consistent.
+  if (check_template(&template, &key) != 0) {
+    printf("Repatched telemetry template check failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
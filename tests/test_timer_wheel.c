@@ -0,0 +1,104 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "timer_wheel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUMBER_OF_ENTRIES 2000
+#define MAX_TICKS 300000
+
+struct test_entry {
+  struct timer_wheel_entry entry;
+  uint64_t deadline;
+  uint64_t fired_at;
+  int fired;
+};
+
+static struct timer_wheel wheel;
+static struct test_entry entries[NUMBER_OF_ENTRIES];
+static int errors = 0;
+
+static void test_handler(struct timer_wheel_entry *entry)
+{
+  struct test_entry *test = (struct test_entry*) entry;
+  test->fired++;
+  test->fired_at = wheel.now;
+}
+
+int main()
+{
+  srand(42);
+  timer_wheel_init(&wheel, 1000);
+
+  for (size_t i = 0; i < NUMBER_OF_ENTRIES; i++) {
+    uint64_t ticks = 1 + rand() % MAX_TICKS;
+    // Also cover short timers and exact level boundaries.
+    if (i < 64) {
+      ticks = i + 1;
+    } else if (i < 70) {
+      ticks = (uint64_t) 1 << (TIMER_WHEEL_BITS * (i - 63) / 2);
+    }
+
+    timer_wheel_entry_init(&entries[i].entry, test_handler);
+    timer_wheel_add(&wheel, &entries[i].entry, ticks);
+    entries[i].deadline = wheel.now + ticks;
+  }
+
+  // Cancel some entries and reschedule others.
+  for (size_t i = 100; i < 200; i++) {
+    timer_wheel_del(&entries[i].entry);
+    entries[i].deadline = 0;
+  }
+  for (size_t i = 200; i < 300; i++) {
+    timer_wheel_add(&wheel, &entries[i].entry, 5000);
+    entries[i].deadline = wheel.now + 5000;
+  }
+
+  // Advance in uneven chunks.
+  uint64_t end = wheel.now + MAX_TICKS + 10;
+  while (wheel.now < end) {
+    timer_wheel_advance(&wheel, wheel.now + 1 + rand() % 97);
+  }
+
+  for (size_t i = 0; i < NUMBER_OF_ENTRIES; i++) {
+    if (!entries[i].deadline) {
+      if (entries[i].fired || timer_wheel_pending(&entries[i].entry)) {
+        printf("Cancelled entry %zu fired.\n", i);
+        errors++;
+      }
+      continue;
+    }
+
+    if (entries[i].fired != 1 || entries[i].fired_at != entries[i].deadline) {
+      printf("Entry %zu fired %d times at %llu (expected at %llu).\n", i, entries[i].fired,
+             (unsigned long long) entries[i].fired_at, (unsigned long long) entries[i].deadline);
+      errors++;
+    }
+  }
+
+  if (errors) {
+    printf("Timer wheel test failed with %d errors.\n", errors);
+    return -1;
+  }
+
+  printf("All %d timer wheel entries expired on time.\n", NUMBER_OF_ENTRIES);
+  return 0;
+}
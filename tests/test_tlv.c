@@ -17,8 +17,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "message.h"
+#include "crc32.h"
 
 #include <stdio.h>
+#include <string.h>
 
 int main()
 {
@@ -27,6 +29,17 @@ int main()
   message_tlv_add_command(&msg, COMMAND_RESTORE_MOTOR);
   tlv_motor_position_t position = {-18004, -18009, 0};
   message_tlv_add_motor_position(&msg, &position);
+  message_tlv_add_sequence_number(&msg, 0xDEADBEEF);
+  tlv_net_hello_t hello = {1, "KORUZA-1042"};
+  message_tlv_add_net_hello(&msg, &hello);
+  tlv_net_alignment_t alignment = {0x01020304};
+  message_tlv_add_net_alignment(&msg, &alignment);
+  tlv_firmware_info_t info = {49152, 0xCAFEBABE, 512};
+  message_tlv_add_firmware_info(&msg, &info);
+  const uint8_t block_data[] = {0x7E, 0x7F, 0x00, 0x01, 0xFF};
+  message_tlv_add_firmware_block(&msg, 1024, block_data, sizeof(block_data));
+  tlv_firmware_ack_t ack = {1536};
+  message_tlv_add_firmware_ack(&msg, &ack);
   message_tlv_add_checksum(&msg);
 
   printf("Generated protocol message: ");
@@ -55,6 +68,12 @@ int main()
 
   tlv_command_t parsed_command;
   tlv_motor_position_t parsed_position;
+  uint32_t parsed_sequence;
+  tlv_net_hello_t parsed_hello;
+  tlv_net_alignment_t parsed_alignment;
+  tlv_firmware_info_t parsed_info;
+  tlv_firmware_block_t parsed_block;
+  tlv_firmware_ack_t parsed_ack;
   if (message_tlv_get_command(&msg, &parsed_command) != MESSAGE_SUCCESS) {
     printf("Failed to get command TLV.\n");
     message_free(&msg);
@@ -67,6 +86,40 @@ int main()
     return -1;
   }
 
+  if (message_tlv_get_sequence_number(&msg_parsed, &parsed_sequence) != MESSAGE_SUCCESS) {
+    printf("Failed to get sequence number TLV.\n");
+    message_free(&msg);
+    return -1;
+  }
+
+  if (message_tlv_get_net_hello(&msg_parsed, &parsed_hello) != MESSAGE_SUCCESS ||
+      message_tlv_get_net_alignment(&msg_parsed, &parsed_alignment) != MESSAGE_SUCCESS) {
+    printf("Failed to get network TLVs.\n");
+    message_free(&msg);
+    return -1;
+  }
+
+  if (message_tlv_get_firmware_info(&msg_parsed, &parsed_info) != MESSAGE_SUCCESS ||
+      message_tlv_get_firmware_block(&msg_parsed, &parsed_block) != MESSAGE_SUCCESS ||
+      message_tlv_get_firmware_ack(&msg_parsed, &parsed_ack) != MESSAGE_SUCCESS) {
+    printf("Failed to get firmware TLVs.\n");
+    message_free(&msg);
+    return -1;
+  }
+
+  if (parsed_info.size != info.size ||
+      parsed_info.crc != info.crc ||
+      parsed_info.block_size != info.block_size ||
+      parsed_block.offset != 1024 ||
+      parsed_block.length != sizeof(block_data) ||
+      memcmp(parsed_block.data, block_data, sizeof(block_data)) != 0 ||
+      parsed_block.crc != crc32(0, block_data, sizeof(block_data)) ||
+      parsed_ack.offset != ack.offset) {
+    printf("Parsed firmware values are invalid.\n");
+    message_free(&msg);
+    return -1;
+  }
+
   printf("Parsed command %u and motor position (%d, %d, %d)\n",
     parsed_command,
     parsed_position.x, parsed_position.y, parsed_position.z
@@ -75,7 +128,11 @@ int main()
   if (parsed_command != COMMAND_RESTORE_MOTOR ||
       parsed_position.x != position.x ||
       parsed_position.y != position.y ||
-      parsed_position.z != position.z) {
+      parsed_position.z != position.z ||
+      parsed_sequence != 0xDEADBEEF ||
+      parsed_hello.version != hello.version ||
+      strcmp(parsed_hello.id, hello.id) != 0 ||
+      parsed_alignment.state != alignment.state) {
     printf("Parsed values are invalid.\n");
     message_free(&msg);
     return -1;
@@ -83,5 +140,25 @@ int main()
 
   message_free(&msg);
 
+  // Oversized TLVs must be rejected instead of overflowing the destination.
+  uint8_t oversized[sizeof(tlv_net_hello_t) + 8];
+  memset(oversized, 'A', sizeof(oversized));
+  message_init(&msg);
+  message_tlv_add(&msg, TLV_NET_HELLO, sizeof(oversized), oversized);
+  if (message_tlv_get_net_hello(&msg, &parsed_hello) == MESSAGE_SUCCESS) {
+    printf("Oversized hello TLV was accepted.\n");
+    message_free(&msg);
+    return -1;
+  }
+
+  message_free(&msg);
+
+  // Truncated checksum TLVs must be rejected without reading past them.
+  const uint8_t truncated[] = {TLV_CHECKSUM, 0x00, 0x01, 0x00};
+  if (message_parse(&msg, truncated, sizeof(truncated)) != MESSAGE_ERROR_PARSE_ERROR) {
+    printf("Truncated checksum TLV was accepted.\n");
+    return -1;
+  }
+
   return 0;
 }
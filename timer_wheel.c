@@ -0,0 +1,129 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "timer_wheel.h"
+
+#include <stddef.h>
+
+void timer_wheel_place(struct timer_wheel *wheel, struct timer_wheel_entry *entry);
+void timer_wheel_cascade(struct timer_wheel *wheel, int level);
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now)
+{
+  wheel->now = now;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+      INIT_LIST_HEAD(&wheel->slots[level][slot]);
+    }
+  }
+}
+
+void timer_wheel_entry_init(struct timer_wheel_entry *entry, timer_wheel_handler handler)
+{
+  INIT_LIST_HEAD(&entry->list);
+  entry->expires = 0;
+  entry->handler = handler;
+}
+
+void timer_wheel_place(struct timer_wheel *wheel, struct timer_wheel_entry *entry)
+{
+  uint64_t delta = entry->expires - wheel->now;
+  int level = 0;
+
+  // Find the lowest level that covers the remaining time, clamping entries
+  // beyond the wheel range to the last level.
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= ((uint64_t) 1 << (TIMER_WHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+
+  uint64_t expires = entry->expires;
+  uint64_t range = (uint64_t) 1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+  if (delta >= range) {
+    expires = wheel->now + range - 1;
+  }
+
+  size_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  list_add_tail(&entry->list, &wheel->slots[level][slot]);
+}
+
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_wheel_entry *entry, uint64_t ticks)
+{
+  timer_wheel_del(entry);
+
+  if (ticks < 1) {
+    ticks = 1;
+  }
+  entry->expires = wheel->now + ticks;
+  timer_wheel_place(wheel, entry);
+}
+
+void timer_wheel_del(struct timer_wheel_entry *entry)
+{
+  list_del_init(&entry->list);
+}
+
+int timer_wheel_pending(const struct timer_wheel_entry *entry)
+{
+  return !list_empty(&entry->list);
+}
+
+void timer_wheel_cascade(struct timer_wheel *wheel, int level)
+{
+  size_t slot = (wheel->now >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  struct list_head *head = &wheel->slots[level][slot];
+
+  // Detach the slot and redistribute its entries to lower levels.
+  LIST_HEAD(list);
+  list_splice_init(head, &list);
+
+  while (!list_empty(&list)) {
+    struct timer_wheel_entry *entry = list_first_entry(&list, struct timer_wheel_entry, list);
+    timer_wheel_del(entry);
+    timer_wheel_place(wheel, entry);
+  }
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now)
+{
+  while (wheel->now < now) {
+    wheel->now++;
+
+    // Cascade higher levels whenever the lower level wraps around.
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+      if (wheel->now & (((uint64_t) 1 << (TIMER_WHEEL_BITS * level)) - 1)) {
+        break;
+      }
+      timer_wheel_cascade(wheel, level);
+    }
+
+    size_t slot = wheel->now & (TIMER_WHEEL_SLOTS - 1);
+    struct list_head *head = &wheel->slots[0][slot];
+    while (!list_empty(head)) {
+      struct timer_wheel_entry *entry = list_first_entry(head, struct timer_wheel_entry, list);
+      timer_wheel_del(entry);
+
+      // Entries clamped to the wheel range are placed again.
+      if (entry->expires > wheel->now) {
+        timer_wheel_place(wheel, entry);
+        continue;
+      }
+
+      entry->handler(entry);
+    }
+  }
+}
@@ -0,0 +1,109 @@
+/*
+ * koruza-driver - KORUZA driver
+ *
+ * Copyright (C) 2017 Jernej Kos <jernej@kos.mx>
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Affero General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KORUZA_DRIVER_TIMER_WHEEL_H
+#define KORUZA_DRIVER_TIMER_WHEEL_H
+
+#include <stdint.h>
+#include <libubox/list.h>
+
+// Number of bits of the tick counter covered by each level.
+#define TIMER_WHEEL_BITS 6
+// Number of slots in each level.
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+// Number of levels (covers 2^18 ticks).
+#define TIMER_WHEEL_LEVELS 3
+
+struct timer_wheel_entry;
+
+/**
+ * Handler for expired timer wheel entries. The entry is no longer pending
+ * when the handler is called and may be re-added or freed.
+ */
+typedef void (*timer_wheel_handler)(struct timer_wheel_entry *entry);
+
+/**
+ * Timer scheduled on a timer wheel.
+ */
+struct timer_wheel_entry {
+  struct list_head list;
+  // Tick at which the entry expires.
+  uint64_t expires;
+  timer_wheel_handler handler;
+};
+
+/**
+ * Hierarchical timer wheel. Adding, removing and expiring entries take
+ * constant time regardless of the number of pending entries.
+ */
+struct timer_wheel {
+  // Current tick.
+  uint64_t now;
+  struct list_head slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+/**
+ * Initializes an empty timer wheel.
+ *
+ * @param wheel Timer wheel
+ * @param now Initial tick
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+
+/**
+ * Initializes a timer wheel entry.
+ *
+ * @param entry Entry to initialize
+ * @param handler Handler called on expiry
+ */
+void timer_wheel_entry_init(struct timer_wheel_entry *entry, timer_wheel_handler handler);
+
+/**
+ * Schedules an entry to expire after the given number of ticks. Pending
+ * entries are rescheduled.
+ *
+ * @param wheel Timer wheel
+ * @param entry Entry to schedule
+ * @param ticks Number of ticks from now (at least one)
+ */
+void timer_wheel_add(struct timer_wheel *wheel, struct timer_wheel_entry *entry, uint64_t ticks);
+
+/**
+ * Cancels a pending entry. Does nothing when the entry is not pending.
+ *
+ * @param entry Entry to cancel
+ */
+void timer_wheel_del(struct timer_wheel_entry *entry);
+
+/**
+ * Returns whether an entry is pending.
+ *
+ * @param entry Timer wheel entry
+ */
+int timer_wheel_pending(const struct timer_wheel_entry *entry);
+
+/**
+ * Advances the timer wheel to the given tick, calling handlers of all
+ * entries that expire on the way.
+ *
+ * @param wheel Timer wheel
+ * @param now Tick to advance to
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now);
+
+#endif
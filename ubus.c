@@ -19,18 +19,52 @@
 #include "ubus.h"
 #include "koruza.h"
 #include "network.h"
+#include "alignment.h"
+#include "firmware.h"
 #include "upgrade.h"
+#include "configuration.h"
+#include "history.h"
+#include "serial.h"
+#include "metrics.h"
+#include "memory.h"
+#include "clock.h"
 
 #include <libubox/blobmsg.h>
-
+#include <libubox/uloop.h>
+
+// Default minimum interval between status change notifications (in ms).
+#define UBUS_NOTIFY_INTERVAL 200
+// Interval between full status notifications (in us).
+#define UBUS_NOTIFY_SNAPSHOT_INTERVAL 10000000
+// Maximum number of points returned by a single history query (each takes
+// about 400 bytes, so this stays well below the ubus message size limit).
+#define UBUS_HISTORY_LIMIT 1000
+// Window over which the get_status request rate is measured (in us).
+#define UBUS_STATUS_RATE_WINDOW 10000000
+
+// Ubus context.
+static struct ubus_context *koruza_ubus;
 // Ubus reply buffer.
 static struct blob_buf reply_buf;
+// Ubus notification buffer.
+static struct blob_buf notify_buf;
+// Timer for status change notifications.
+static struct uloop_timeout timer_notify;
+// Minimum interval between status change notifications.
+static int notify_interval;
+// Sequence number of the last status change notification.
+static uint32_t notify_seq;
+// Section generations included in the last status change notification.
+static uint32_t notify_generation[__KORUZA_SECTION_MAX];
+// Time of the last full status notification (in microseconds).
+static uint64_t notify_snapshot_at;
 
 // Ubus attributes.
 enum {
   KORUZA_MOTOR_X,
   KORUZA_MOTOR_Y,
   KORUZA_MOTOR_Z,
+  KORUZA_MOTOR_QUEUE,
   __KORUZA_MOTOR_MAX,
 };
 
@@ -38,6 +72,7 @@ static const struct blobmsg_policy koruza_motor_policy[__KORUZA_MOTOR_MAX] = {
   [KORUZA_MOTOR_X] = { .name = "x", .type = BLOBMSG_TYPE_INT32 },
   [KORUZA_MOTOR_Y] = { .name = "y", .type = BLOBMSG_TYPE_INT32 },
   [KORUZA_MOTOR_Z] = { .name = "z", .type = BLOBMSG_TYPE_INT32 },
+  [KORUZA_MOTOR_QUEUE] = { .name = "queue", .type = BLOBMSG_TYPE_BOOL },
 };
 
 static int ubus_move_motor(struct ubus_context *ctx, struct ubus_object *obj,
@@ -52,15 +87,39 @@ static int ubus_move_motor(struct ubus_context *ctx, struct ubus_object *obj,
     return UBUS_STATUS_INVALID_ARGUMENT;
   }
 
+  uint32_t move_id;
   int result = koruza_move_motor(
     (int32_t) blobmsg_get_u32(tb[KORUZA_MOTOR_X]),
     (int32_t) blobmsg_get_u32(tb[KORUZA_MOTOR_Y]),
-    (int32_t) blobmsg_get_u32(tb[KORUZA_MOTOR_Z])
+    (int32_t) blobmsg_get_u32(tb[KORUZA_MOTOR_Z]),
+    tb[KORUZA_MOTOR_QUEUE] ? blobmsg_get_bool(tb[KORUZA_MOTOR_QUEUE]) : 0,
+    &move_id
   );
 
-  return result < 0 ? UBUS_STATUS_UNKNOWN_ERROR : UBUS_STATUS_OK;
+  if (result < 0) {
+    return UBUS_STATUS_UNKNOWN_ERROR;
+  }
+
+  blob_buf_init(&reply_buf, 0);
+  blobmsg_add_u32(&reply_buf, "id", move_id);
+  ubus_send_reply(ctx, req, reply_buf.head);
+
+  return UBUS_STATUS_OK;
 }
 
+static const char *ubus_move_result_name(enum koruza_move_result result)
+{
+  switch (result) {
+    case KORUZA_MOVE_COMPLETED: return "completed";
+    case KORUZA_MOVE_STALLED: return "stalled";
+    case KORUZA_MOVE_CANCELLED: return "cancelled";
+    case KORUZA_MOVE_COLLAPSED: return "collapsed";
+    default: return "pending";
+  }
+}
+
+static void ubus_move_handler(const struct koruza_move *move);
+
 static inline void blobmsg_add_float(struct blob_buf *buffer, const char *name, float value)
 {
   char tmp[64];
@@ -72,18 +131,177 @@ static void blobmsg_add_accelerometer_statistics_item(struct blob_buf *buffer,
                                                       const struct accelerometer_statistics_item *items,
                                                       const char *name)
 {
-  void *d = blobmsg_open_array(&reply_buf, name);
+  void *d = blobmsg_open_array(buffer, name);
   for (size_t i = 0; i < 4; i++) {
     const struct accelerometer_statistics_item *item = &items[i];
 
-    void *c = blobmsg_open_table(&reply_buf, NULL);
+    void *c = blobmsg_open_table(buffer, NULL);
     blobmsg_add_float(buffer, "average", item->average);
     blobmsg_add_u32(buffer, "count", item->samples);
     blobmsg_add_float(buffer, "variance", item->variance);
     blobmsg_add_float(buffer, "maximum", item->maximum);
+    blobmsg_add_float(buffer, "frequency", item->frequency);
+    blobmsg_add_float(buffer, "energy", item->energy);
     blobmsg_close_table(buffer, c);
   }
-  blobmsg_close_array(&reply_buf, d);
+  blobmsg_close_array(buffer, d);
+}
+
+static void blobmsg_add_motors_status(struct blob_buf *buffer, const struct koruza_status *status)
+{
+  void *c = blobmsg_open_table(buffer, "motors");
+  blobmsg_add_u8(buffer, "connected", status->motors.connected);
+  blobmsg_add_u32(buffer, "baudrate", status->motors.baudrate);
+  blobmsg_add_u32(buffer, "x", status->motors.x);
+  blobmsg_add_u32(buffer, "y", status->motors.y);
+  blobmsg_add_u32(buffer, "z", status->motors.z);
+  blobmsg_add_u32(buffer, "range_x", status->motors.range_x);
+  blobmsg_add_u32(buffer, "range_y", status->motors.range_y);
+  blobmsg_add_u32(buffer, "encoder_x", status->motors.encoder_x);
+  blobmsg_add_u32(buffer, "encoder_y", status->motors.encoder_y);
+  blobmsg_add_u32(buffer, "move_id", status->motors.move_id);
+  blobmsg_add_u16(buffer, "move_queue", status->motors.move_queue);
+  blobmsg_add_u32(buffer, "move_collapsed", status->motors.move_collapsed);
+  blobmsg_close_table(buffer, c);
+}
+
+static void blobmsg_add_accelerometer_status(struct blob_buf *buffer, const struct koruza_status *status)
+{
+  void *c = blobmsg_open_table(buffer, "accelerometer");
+  blobmsg_add_u8(buffer, "connected", status->accelerometer.connected);
+  blobmsg_add_u32(buffer, "baudrate", status->accelerometer.baudrate);
+
+  blobmsg_add_accelerometer_statistics_item(buffer, status->accelerometer.x, "x");
+  blobmsg_add_accelerometer_statistics_item(buffer, status->accelerometer.y, "y");
+  blobmsg_add_accelerometer_statistics_item(buffer, status->accelerometer.z, "z");
+
+  blobmsg_close_table(buffer, c);
+}
+
+static void blobmsg_add_sfp_status(struct blob_buf *buffer, const struct koruza_status *status)
+{
+  void *c = blobmsg_open_table(buffer, "sfp");
+  blobmsg_add_u16(buffer, "tx_power", status->sfp.tx_power);
+  blobmsg_add_u16(buffer, "rx_power", status->sfp.rx_power);
+  blobmsg_close_table(buffer, c);
+}
+
+static void blobmsg_add_alignment_status(struct blob_buf *buffer, const struct koruza_status *status)
+{
+  void *c = blobmsg_open_table(buffer, "alignment");
+  blobmsg_add_u32(buffer, "state", status->alignment.state);
+
+  void *d = blobmsg_open_array(buffer, "variables");
+  for (int i = 0; i < ALIGNMENT_VARIABLE_COUNT; i++) {
+    blobmsg_add_u32(buffer, NULL, status->alignment.variables[i]);
+  }
+  blobmsg_close_array(buffer, d);
+
+  blobmsg_close_table(buffer, c);
+}
+
+static void blobmsg_add_general_status(struct blob_buf *buffer, const struct koruza_status *status)
+{
+  void *c;
+
+  c = blobmsg_open_table(buffer, "leds");
+  blobmsg_add_u8(buffer, "state", status->leds);
+  blobmsg_close_table(buffer, c);
+
+  c = blobmsg_open_table(buffer, "errors");
+  blobmsg_add_u32(buffer, "code", status->errors.code);
+  blobmsg_close_table(buffer, c);
+}
+
+static void blobmsg_add_camera_status(struct blob_buf *buffer, const struct koruza_status *status)
+{
+  void *c = blobmsg_open_table(buffer, "camera_calibration");
+  blobmsg_add_u16(buffer, "port", status->camera_calibration.port);
+  blobmsg_add_string(buffer, "path", status->camera_calibration.path);
+  blobmsg_add_u32(buffer, "width", status->camera_calibration.width);
+  blobmsg_add_u32(buffer, "height", status->camera_calibration.height);
+  blobmsg_add_u32(buffer, "offset_x", status->camera_calibration.offset_x);
+  blobmsg_add_u32(buffer, "offset_y", status->camera_calibration.offset_y);
+  blobmsg_add_u32(buffer, "distance", status->camera_calibration.distance);
+  blobmsg_close_table(buffer, c);
+}
+
+/**
+ * Cached serialized status section.
+ */
+struct ubus_status_section {
+  // Builder for this section.
+  void (*build)(struct blob_buf *buffer, const struct koruza_status *status);
+
+  // Generation of the status section that the cache was built from.
+  uint32_t generation;
+  uint8_t valid;
+  struct blob_buf buf;
+};
+
+static struct ubus_status_section status_cache[__KORUZA_SECTION_MAX] = {
+  [KORUZA_SECTION_GENERAL] = { .build = blobmsg_add_general_status },
+  [KORUZA_SECTION_MOTORS] = { .build = blobmsg_add_motors_status },
+  [KORUZA_SECTION_ACCELEROMETER] = { .build = blobmsg_add_accelerometer_status },
+  [KORUZA_SECTION_CAMERA] = { .build = blobmsg_add_camera_status },
+  [KORUZA_SECTION_SFP] = { .build = blobmsg_add_sfp_status },
+  [KORUZA_SECTION_ALIGNMENT] = { .build = blobmsg_add_alignment_status },
+};
+
+/**
+ * Status cache statistics.
+ */
+struct ubus_status_cache_stats {
+  uint32_t requests;
+  uint32_t hits;
+  uint32_t rebuilds;
+  uint64_t build_time;
+
+  // Request rate measurement window.
+  uint64_t window_start;
+  uint32_t window_requests;
+  float request_rate;
+};
+
+static struct ubus_status_cache_stats status_cache_stats;
+
+static void blobmsg_add_status_section(struct blob_buf *buffer, enum koruza_status_section section)
+{
+  const struct koruza_status *status = koruza_get_status();
+  struct ubus_status_section *cache = &status_cache[section];
+
+  // Rebuild the section only when it changed since it was last serialized.
+  if (!cache->valid || cache->generation != status->generation[section]) {
+    uint64_t start = clock_monotonic_us();
+
+    blob_buf_init(&cache->buf, 0);
+    cache->build(&cache->buf, status);
+    cache->generation = status->generation[section];
+    cache->valid = 1;
+
+    status_cache_stats.rebuilds++;
+    status_cache_stats.build_time += clock_monotonic_us() - start;
+  } else {
+    status_cache_stats.hits++;
+  }
+
+  blob_put_raw(buffer, blob_data(cache->buf.head), blob_len(cache->buf.head));
+}
+
+static void ubus_status_cache_account_request()
+{
+  uint64_t now = clock_monotonic_us();
+
+  status_cache_stats.requests++;
+  status_cache_stats.window_requests++;
+  if (!status_cache_stats.window_start) {
+    status_cache_stats.window_start = now;
+  } else if (now - status_cache_stats.window_start >= UBUS_STATUS_RATE_WINDOW) {
+    status_cache_stats.request_rate = (float) status_cache_stats.window_requests * 1000000.0 /
+                                      (float) (now - status_cache_stats.window_start);
+    status_cache_stats.window_start = now;
+    status_cache_stats.window_requests = 0;
+  }
 }
 
 static int ubus_get_status(struct ubus_context *ctx, struct ubus_object *obj,
@@ -94,72 +312,54 @@ static int ubus_get_status(struct ubus_context *ctx, struct ubus_object *obj,
   const struct network_status *net_status = network_get_status();
   void *c;
 
+  ubus_status_cache_account_request();
+
   blob_buf_init(&reply_buf, 0);
   blobmsg_add_string(&reply_buf, "serial_number", status->serial_number);
   blobmsg_add_u8(&reply_buf, "connected", status->motors.connected);
 
-  c = blobmsg_open_table(&reply_buf, "leds");
-  blobmsg_add_u8(&reply_buf, "state", status->leds);
-  blobmsg_close_table(&reply_buf, c);
-
-  c = blobmsg_open_table(&reply_buf, "errors");
-  blobmsg_add_u32(&reply_buf, "code", status->errors.code);
-  blobmsg_close_table(&reply_buf, c);
-
-  c = blobmsg_open_table(&reply_buf, "motors");
-  blobmsg_add_u8(&reply_buf, "connected", status->motors.connected);
-  blobmsg_add_u32(&reply_buf, "x", status->motors.x);
-  blobmsg_add_u32(&reply_buf, "y", status->motors.y);
-  blobmsg_add_u32(&reply_buf, "z", status->motors.z);
-  blobmsg_add_u32(&reply_buf, "range_x", status->motors.range_x);
-  blobmsg_add_u32(&reply_buf, "range_y", status->motors.range_y);
-  blobmsg_add_u32(&reply_buf, "encoder_x", status->motors.encoder_x);
-  blobmsg_add_u32(&reply_buf, "encoder_y", status->motors.encoder_y);
-  blobmsg_close_table(&reply_buf, c);
-
-  koruza_compute_accelerometer_statistics();
-  c = blobmsg_open_table(&reply_buf, "accelerometer");
-  blobmsg_add_u8(&reply_buf, "connected", status->accelerometer.connected);
-
-  blobmsg_add_accelerometer_statistics_item(&reply_buf, status->accelerometer.x, "x");
-  blobmsg_add_accelerometer_statistics_item(&reply_buf, status->accelerometer.y, "y");
-  blobmsg_add_accelerometer_statistics_item(&reply_buf, status->accelerometer.z, "z");
-
-  blobmsg_close_table(&reply_buf, c);
-
-  c = blobmsg_open_table(&reply_buf, "camera_calibration");
-  blobmsg_add_u16(&reply_buf, "port", status->camera_calibration.port);
-  blobmsg_add_string(&reply_buf, "path", status->camera_calibration.path);
-  blobmsg_add_u32(&reply_buf, "width", status->camera_calibration.width);
-  blobmsg_add_u32(&reply_buf, "height", status->camera_calibration.height);
-  blobmsg_add_u32(&reply_buf, "offset_x", status->camera_calibration.offset_x);
-  blobmsg_add_u32(&reply_buf, "offset_y", status->camera_calibration.offset_y);
-  blobmsg_add_u32(&reply_buf, "distance", status->camera_calibration.distance);
-  blobmsg_close_table(&reply_buf, c);
-
-  c = blobmsg_open_table(&reply_buf, "sfp");
-  blobmsg_add_u16(&reply_buf, "tx_power", status->sfp.tx_power);
-  blobmsg_add_u16(&reply_buf, "rx_power", status->sfp.rx_power);
-  blobmsg_close_table(&reply_buf, c);
+  blobmsg_add_status_section(&reply_buf, KORUZA_SECTION_GENERAL);
+  blobmsg_add_status_section(&reply_buf, KORUZA_SECTION_MOTORS);
+  blobmsg_add_status_section(&reply_buf, KORUZA_SECTION_ACCELEROMETER);
+  blobmsg_add_status_section(&reply_buf, KORUZA_SECTION_CAMERA);
+  blobmsg_add_status_section(&reply_buf, KORUZA_SECTION_SFP);
 
   c = blobmsg_open_table(&reply_buf, "network");
   blobmsg_add_string(&reply_buf, "interface", net_status->interface);
-  blobmsg_add_string(&reply_buf, "ip_address", net_status->ip_address);
+  if (net_status->ip_address) {
+    blobmsg_add_string(&reply_buf, "ip_address", net_status->ip_address);
+  }
   blobmsg_add_u8(&reply_buf, "ready", net_status->ready);
+  blobmsg_add_u8(&reply_buf, "link", net_status->link);
+  blobmsg_add_u32(&reply_buf, "units", net_status->units);
   if (net_status->peer) {
-    blobmsg_add_string(&reply_buf, "peer", net_status->peer->ip_address);
+    const struct network_device *peer = net_status->peer;
+    blobmsg_add_string(&reply_buf, "peer", peer->ip_address);
+
+    void *p = blobmsg_open_table(&reply_buf, "peer_status");
+    blobmsg_add_string(&reply_buf, "id", peer->id);
+    blobmsg_add_u32(&reply_buf, "version", peer->version);
+    blobmsg_add_u32(&reply_buf, "score", peer->score);
+    if (peer->telemetry.updated_at) {
+      blobmsg_add_u32(&reply_buf, "rx_power", peer->telemetry.rx_power);
+      blobmsg_add_u32(&reply_buf, "x", peer->telemetry.motor_x);
+      blobmsg_add_u32(&reply_buf, "y", peer->telemetry.motor_y);
+      blobmsg_add_u32(&reply_buf, "alignment_state", peer->telemetry.alignment_state);
+      blobmsg_add_u64(&reply_buf, "age", network_telemetry_age(peer));
+    }
+    blobmsg_add_u32(&reply_buf, "lost", peer->telemetry.lost);
+    blobmsg_close_table(&reply_buf, p);
   }
   blobmsg_close_table(&reply_buf, c);
 
-  c = blobmsg_open_table(&reply_buf, "alignment");
-  blobmsg_add_u32(&reply_buf, "state", status->alignment.state);
-
-  void *d = blobmsg_open_array(&reply_buf, "variables");
-  for (int i = 0; i < ALIGNMENT_VARIABLE_COUNT; i++) {
-    blobmsg_add_u32(&reply_buf, NULL, status->alignment.variables[i]);
-  }
-  blobmsg_close_array(&reply_buf, d);
+  blobmsg_add_status_section(&reply_buf, KORUZA_SECTION_ALIGNMENT);
 
+  c = blobmsg_open_table(&reply_buf, "status_cache");
+  blobmsg_add_u32(&reply_buf, "requests", status_cache_stats.requests);
+  blobmsg_add_float(&reply_buf, "request_rate", status_cache_stats.request_rate);
+  blobmsg_add_u32(&reply_buf, "hits", status_cache_stats.hits);
+  blobmsg_add_u32(&reply_buf, "rebuilds", status_cache_stats.rebuilds);
+  blobmsg_add_u64(&reply_buf, "build_time_us", status_cache_stats.build_time);
   blobmsg_close_table(&reply_buf, c);
 
   ubus_send_reply(ctx, req, reply_buf.head);
@@ -316,6 +516,59 @@ static int ubus_set_leds(struct ubus_context *ctx, struct ubus_object *obj,
   return UBUS_STATUS_OK;
 }
 
+enum {
+  KORUZA_FIRMWARE_PATH,
+  __KORUZA_FIRMWARE_MAX,
+};
+
+static const struct blobmsg_policy koruza_firmware_policy[__KORUZA_FIRMWARE_MAX] = {
+  [KORUZA_FIRMWARE_PATH] = { .name = "path", .type = BLOBMSG_TYPE_STRING },
+};
+
+static int ubus_flash_firmware(struct ubus_context *ctx, struct ubus_object *obj,
+                               struct ubus_request_data *req, const char *method,
+                               struct blob_attr *msg)
+{
+  struct blob_attr *tb[__KORUZA_FIRMWARE_MAX];
+
+  blobmsg_parse(koruza_firmware_policy, __KORUZA_FIRMWARE_MAX, tb, blob_data(msg), blob_len(msg));
+
+  if (!tb[KORUZA_FIRMWARE_PATH]) {
+    return UBUS_STATUS_INVALID_ARGUMENT;
+  }
+
+  return firmware_flash(blobmsg_get_string(tb[KORUZA_FIRMWARE_PATH])) < 0 ? UBUS_STATUS_UNKNOWN_ERROR : UBUS_STATUS_OK;
+}
+
+static void blobmsg_add_firmware_progress(struct blob_buf *buf, const struct firmware_progress *progress)
+{
+  blobmsg_add_string(buf, "state", firmware_state_name(progress->state));
+  blobmsg_add_u32(buf, "offset", progress->offset);
+  blobmsg_add_u32(buf, "size", progress->size);
+  blobmsg_add_u32(buf, "retransmits", progress->retransmits);
+  blobmsg_add_u32(buf, "elapsed", progress->elapsed);
+}
+
+static int ubus_get_firmware_status(struct ubus_context *ctx, struct ubus_object *obj,
+                                    struct ubus_request_data *req, const char *method,
+                                    struct blob_attr *msg)
+{
+  blob_buf_init(&reply_buf, 0);
+  blobmsg_add_firmware_progress(&reply_buf, firmware_get_progress());
+  ubus_send_reply(ctx, req, reply_buf.head);
+
+  return UBUS_STATUS_OK;
+}
+
+static int ubus_abort_firmware(struct ubus_context *ctx, struct ubus_object *obj,
+                               struct ubus_request_data *req, const char *method,
+                               struct blob_attr *msg)
+{
+  firmware_abort();
+
+  return UBUS_STATUS_OK;
+}
+
 static int ubus_upgrade(struct ubus_context *ctx, struct ubus_object *obj,
                         struct ubus_request_data *req, const char *method,
                         struct blob_attr *msg)
@@ -367,16 +620,202 @@ static int ubus_set_alignment(struct ubus_context *ctx, struct ubus_object *obj,
   if (index != ALIGNMENT_VARIABLE_COUNT) {
     return UBUS_STATUS_INVALID_ARGUMENT;
   }
+
+  // An external alignment algorithm takes over from joint alignment.
+  alignment_joint_stop();
   koruza_set_alignment(&alignment);
 
   return UBUS_STATUS_OK;
 }
 
+enum {
+  KORUZA_HISTORY_RESOLUTION,
+  KORUZA_HISTORY_START,
+  KORUZA_HISTORY_END,
+  KORUZA_HISTORY_LIMIT,
+  __KORUZA_HISTORY_MAX,
+};
+
+static const struct blobmsg_policy koruza_history_policy[__KORUZA_HISTORY_MAX] = {
+  [KORUZA_HISTORY_RESOLUTION] = { .name = "resolution", .type = BLOBMSG_TYPE_INT32 },
+  [KORUZA_HISTORY_START] = { .name = "start", .type = BLOBMSG_TYPE_INT32 },
+  [KORUZA_HISTORY_END] = { .name = "end", .type = BLOBMSG_TYPE_INT32 },
+  [KORUZA_HISTORY_LIMIT] = { .name = "limit", .type = BLOBMSG_TYPE_INT32 },
+};
+
+/**
+ * State of a history query reply.
+ */
+struct ubus_history_reply {
+  struct blob_buf *buffer;
+  // Timestamp of the last point added to the reply.
+  uint32_t last;
+};
+
+static void ubus_history_point_handler(const struct history_point *point, void *priv)
+{
+  struct ubus_history_reply *reply = (struct ubus_history_reply*) priv;
+  struct blob_buf *buffer = reply->buffer;
+  reply->last = point->timestamp;
+
+  void *c = blobmsg_open_table(buffer, NULL);
+  blobmsg_add_u32(buffer, "timestamp", point->timestamp);
+  blobmsg_add_u32(buffer, "samples", point->samples);
+  for (size_t m = 0; m < __HISTORY_METRIC_MAX; m++) {
+    void *d = blobmsg_open_table(buffer, history_metric_name(m));
+    blobmsg_add_u32(buffer, "min", point->values[m].min);
+    blobmsg_add_u32(buffer, "max", point->values[m].max);
+    blobmsg_add_float(buffer, "avg", point->values[m].avg);
+    blobmsg_close_table(buffer, d);
+  }
+  blobmsg_close_table(buffer, c);
+}
+
+static int ubus_get_history(struct ubus_context *ctx, struct ubus_object *obj,
+                            struct ubus_request_data *req, const char *method,
+                            struct blob_attr *msg)
+{
+  struct blob_attr *tb[__KORUZA_HISTORY_MAX];
+
+  blobmsg_parse(koruza_history_policy, __KORUZA_HISTORY_MAX, tb, blob_data(msg), blob_len(msg));
+
+  uint32_t resolution = tb[KORUZA_HISTORY_RESOLUTION] ? blobmsg_get_u32(tb[KORUZA_HISTORY_RESOLUTION]) : 1;
+  uint32_t start = tb[KORUZA_HISTORY_START] ? blobmsg_get_u32(tb[KORUZA_HISTORY_START]) : 0;
+  uint32_t end = tb[KORUZA_HISTORY_END] ? blobmsg_get_u32(tb[KORUZA_HISTORY_END]) : UINT32_MAX;
+  uint32_t limit = tb[KORUZA_HISTORY_LIMIT] ? blobmsg_get_u32(tb[KORUZA_HISTORY_LIMIT]) : UBUS_HISTORY_LIMIT;
+  if (limit > UBUS_HISTORY_LIMIT) {
+    limit = UBUS_HISTORY_LIMIT;
+  }
+
+  blob_buf_init(&reply_buf, 0);
+  blobmsg_add_u32(&reply_buf, "resolution", resolution);
+
+  struct ubus_history_reply reply = { .buffer = &reply_buf };
+  void *c = blobmsg_open_array(&reply_buf, "points");
+  int result = history_query(resolution, start, end, limit, ubus_history_point_handler, &reply);
+  blobmsg_close_array(&reply_buf, c);
+
+  if (result < 0) {
+    return UBUS_STATUS_INVALID_ARGUMENT;
+  }
+
+  // When the reply is truncated, return where the next page starts.
+  if (result > 0 && (uint32_t) result == limit && reply.last < end) {
+    blobmsg_add_u32(&reply_buf, "next", reply.last + resolution);
+  }
+
+  ubus_send_reply(ctx, req, reply_buf.head);
+
+  return UBUS_STATUS_OK;
+}
+
+static void blobmsg_add_serial_queue_stats(struct blob_buf *buffer, serial_device_t device, const char *name)
+{
+  struct serial_queue_stats stats;
+  if (serial_get_queue_stats(device, &stats) != 0) {
+    return;
+  }
+
+  void *c = blobmsg_open_table(buffer, name);
+  blobmsg_add_u32(buffer, "depth", stats.depth);
+  blobmsg_add_u32(buffer, "bytes", stats.bytes);
+  blobmsg_add_u32(buffer, "oldest", stats.oldest);
+  blobmsg_add_u32(buffer, "dropped", stats.dropped);
+  blobmsg_close_table(buffer, c);
+}
+
+static int ubus_get_metrics(struct ubus_context *ctx, struct ubus_object *obj,
+                            struct ubus_request_data *req, const char *method,
+                            struct blob_attr *msg)
+{
+  blob_buf_init(&reply_buf, 0);
+
+  void *c;
+#ifdef KORUZA_METRICS
+  // Latency histograms (in microseconds).
+  c = blobmsg_open_table(&reply_buf, "latency");
+  for (metrics_histogram_t i = 0; i < __METRICS_HISTOGRAM_MAX; i++) {
+    const struct metrics_histogram *histogram = metrics_get_histogram(i);
+    void *d = blobmsg_open_table(&reply_buf, metrics_histogram_name(i));
+    blobmsg_add_u64(&reply_buf, "count", histogram->count);
+    blobmsg_add_u64(&reply_buf, "sum", histogram->sum);
+    blobmsg_add_u32(&reply_buf, "min", histogram->min);
+    blobmsg_add_u32(&reply_buf, "max", histogram->max);
+    blobmsg_add_u32(&reply_buf, "avg", histogram->count ? histogram->sum / histogram->count : 0);
+    blobmsg_add_u32(&reply_buf, "p50", metrics_histogram_percentile(histogram, 50));
+    blobmsg_add_u32(&reply_buf, "p90", metrics_histogram_percentile(histogram, 90));
+    blobmsg_add_u32(&reply_buf, "p99", metrics_histogram_percentile(histogram, 99));
+    blobmsg_close_table(&reply_buf, d);
+  }
+  blobmsg_close_table(&reply_buf, c);
+
+  c = blobmsg_open_table(&reply_buf, "counters");
+  for (metrics_counter_t i = 0; i < __METRICS_COUNTER_MAX; i++) {
+    blobmsg_add_u64(&reply_buf, metrics_counter_name(i), metrics_get_counter(i));
+  }
+  blobmsg_close_table(&reply_buf, c);
+#endif
+
+  // Heap usage per component (in bytes).
+  c = blobmsg_open_table(&reply_buf, "memory");
+  for (memory_component_t i = 0; i < __MEMORY_COMPONENT_MAX; i++) {
+    const struct memory_usage *usage = memory_get_usage(i);
+    void *d = blobmsg_open_table(&reply_buf, memory_component_name(i));
+    blobmsg_add_u32(&reply_buf, "current", usage->current);
+    blobmsg_add_u32(&reply_buf, "peak", usage->peak);
+    blobmsg_add_u32(&reply_buf, "limit", usage->limit);
+    blobmsg_close_table(&reply_buf, d);
+  }
+  blobmsg_close_table(&reply_buf, c);
+
+  // Serial transmit queues.
+  c = blobmsg_open_table(&reply_buf, "serial");
+  blobmsg_add_serial_queue_stats(&reply_buf, DEVICE_MOTORS, "motors");
+  blobmsg_add_serial_queue_stats(&reply_buf, DEVICE_ACCELEROMETER, "accelerometer");
+  blobmsg_close_table(&reply_buf, c);
+
+  ubus_send_reply(ctx, req, reply_buf.head);
+
+  return UBUS_STATUS_OK;
+}
+
+static int ubus_reset_metrics(struct ubus_context *ctx, struct ubus_object *obj,
+                              struct ubus_request_data *req, const char *method,
+                              struct blob_attr *msg)
+{
+#ifdef KORUZA_METRICS
+  metrics_reset();
+
+  return UBUS_STATUS_OK;
+#else
+  return UBUS_STATUS_NOT_SUPPORTED;
+#endif
+}
+
+static int ubus_start_joint_alignment(struct ubus_context *ctx, struct ubus_object *obj,
+                                      struct ubus_request_data *req, const char *method,
+                                      struct blob_attr *msg)
+{
+  return alignment_joint_start() < 0 ? UBUS_STATUS_UNKNOWN_ERROR : UBUS_STATUS_OK;
+}
+
+static int ubus_stop_joint_alignment(struct ubus_context *ctx, struct ubus_object *obj,
+                                     struct ubus_request_data *req, const char *method,
+                                     struct blob_attr *msg)
+{
+  alignment_joint_stop();
+
+  return UBUS_STATUS_OK;
+}
+
 static const struct ubus_method koruza_methods[] = {
   UBUS_METHOD("move_motor", ubus_move_motor, koruza_motor_policy),
   UBUS_METHOD_NOARG("homing", ubus_homing),
   UBUS_METHOD_NOARG("reboot", ubus_reboot),
   UBUS_METHOD_NOARG("firmware_upgrade", ubus_firmware_upgrade),
+  UBUS_METHOD("flash_firmware", ubus_flash_firmware, koruza_firmware_policy),
+  UBUS_METHOD_NOARG("get_firmware_status", ubus_get_firmware_status),
+  UBUS_METHOD_NOARG("abort_firmware", ubus_abort_firmware),
   UBUS_METHOD_NOARG("get_status", ubus_get_status),
   UBUS_METHOD("set_webcam_calibration", ubus_set_webcam_calibration, koruza_calibration_policy),
   UBUS_METHOD("set_distance", ubus_set_distance, koruza_distance_policy),
@@ -385,6 +824,11 @@ static const struct ubus_method koruza_methods[] = {
   UBUS_METHOD("set_leds", ubus_set_leds, koruza_leds_policy),
   UBUS_METHOD_NOARG("upgrade", ubus_upgrade),
   UBUS_METHOD("set_alignment", ubus_set_alignment, koruza_alignment_policy),
+  UBUS_METHOD_NOARG("start_joint_alignment", ubus_start_joint_alignment),
+  UBUS_METHOD_NOARG("stop_joint_alignment", ubus_stop_joint_alignment),
+  UBUS_METHOD("get_history", ubus_get_history, koruza_history_policy),
+  UBUS_METHOD_NOARG("get_metrics", ubus_get_metrics),
+  UBUS_METHOD_NOARG("reset_metrics", ubus_reset_metrics),
 };
 
 static struct ubus_object_type koruza_type =
@@ -397,7 +841,104 @@ static struct ubus_object koruza_object = {
   .n_methods = ARRAY_SIZE(koruza_methods),
 };
 
-int ubus_init(struct ubus_context *ubus)
+static void ubus_notify_status(int snapshot)
 {
+  const struct koruza_status *status = koruza_get_status();
+  int changed = 0;
+
+  // Periodically include all sections, so that subscribers which joined
+  // later are not left waiting for a change in every section.
+  uint64_t now = clock_monotonic_us();
+  if (now - notify_snapshot_at >= UBUS_NOTIFY_SNAPSHOT_INTERVAL) {
+    snapshot = 1;
+  }
+
+  if (snapshot) {
+    notify_snapshot_at = now;
+  }
+
+  // Otherwise only include sections that changed since the last notification.
+  static const enum koruza_status_section sections[] = {
+    KORUZA_SECTION_MOTORS,
+    KORUZA_SECTION_ACCELEROMETER,
+    KORUZA_SECTION_SFP,
+    KORUZA_SECTION_ALIGNMENT,
+  };
+
+  blob_buf_init(&notify_buf, 0);
+  for (size_t i = 0; i < ARRAY_SIZE(sections); i++) {
+    if (snapshot || status->generation[sections[i]] != notify_generation[sections[i]]) {
+      blobmsg_add_status_section(&notify_buf, sections[i]);
+      changed = 1;
+    }
+  }
+
+  if (changed) {
+    memcpy(notify_generation, status->generation, sizeof(notify_generation));
+    blobmsg_add_u32(&notify_buf, "seq", ++notify_seq);
+    ubus_notify(koruza_ubus, &koruza_object, "status", notify_buf.head, -1);
+  }
+}
+
+static void ubus_timer_notify_handler(struct uloop_timeout *timer)
+{
+  METRICS_TIMER_START(timer);
+  ubus_notify_status(0);
+  uloop_timeout_set(timer, notify_interval);
+
+  METRICS_TIMER_STOP(timer, METRICS_TIMER_NOTIFY);
+}
+
+static void ubus_subscribe_handler(struct ubus_context *ctx, struct ubus_object *obj)
+{
+  // Only run the notification timer while somebody is listening.
+  if (obj->has_subscribers) {
+    // Give new subscribers the current status right away.
+    ubus_notify_status(1);
+
+    if (!timer_notify.pending) {
+      uloop_timeout_set(&timer_notify, notify_interval);
+    }
+  } else {
+    uloop_timeout_cancel(&timer_notify);
+  }
+}
+
+static void ubus_move_handler(const struct koruza_move *move)
+{
+  if (!koruza_object.has_subscribers) {
+    return;
+  }
+
+  blob_buf_init(&notify_buf, 0);
+  blobmsg_add_u32(&notify_buf, "id", move->id);
+  blobmsg_add_u32(&notify_buf, "x", move->x);
+  blobmsg_add_u32(&notify_buf, "y", move->y);
+  blobmsg_add_u32(&notify_buf, "z", move->z);
+  blobmsg_add_string(&notify_buf, "result", ubus_move_result_name(move->result));
+  ubus_notify(koruza_ubus, &koruza_object, "move_complete", notify_buf.head, -1);
+}
+
+static void ubus_firmware_progress_handler(const struct firmware_progress *progress)
+{
+  // Broadcast as an event so that progress can be followed without subscribing.
+  blob_buf_init(&notify_buf, 0);
+  blobmsg_add_firmware_progress(&notify_buf, progress);
+  ubus_send_event(koruza_ubus, "koruza.firmware", notify_buf.head);
+}
+
+int ubus_init(struct ubus_context *ubus, struct uci_context *uci)
+{
+  koruza_ubus = ubus;
+  koruza_set_move_handler(ubus_move_handler);
+  firmware_set_progress_handler(ubus_firmware_progress_handler);
+
+  notify_interval = uci_get_int(uci, "koruza.@ubus[0].notify_interval", UBUS_NOTIFY_INTERVAL);
+  if (notify_interval <= 0) {
+    notify_interval = UBUS_NOTIFY_INTERVAL;
+  }
+  timer_notify.cb = ubus_timer_notify_handler;
+  koruza_object.subscribe_cb = ubus_subscribe_handler;
+
   return ubus_add_object(ubus, &koruza_object);
 }
@@ -20,7 +20,8 @@
 #define KORUZA_DRIVER_UBUS_H
 
 #include <libubus.h>
+#include <uci.h>
 
-int ubus_init(struct ubus_context *ubus);
+int ubus_init(struct ubus_context *ubus, struct uci_context *uci);
 
 #endif